@@ -0,0 +1,276 @@
+/*
+ *  admin.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "admin.h"
+#include "util.h"
+
+#define CLIENTS    8      /* connections served at once, more are refused */
+#define INPUT_MAX  1024   /* longest command line */
+
+struct admin_buf {
+	char *data;
+	size_t len, size;
+};
+
+typedef struct client {
+	int fd;
+	int eof;               /* the client is done sending */
+	char in[INPUT_MAX];
+	size_t inlen;
+	admin_buf_t out;       /* replies not sent yet */
+	size_t sent;
+	uint64_t deadline;     /* ms, when the client is dropped for idling */
+} client_t;
+
+static int listen_fd = -1;
+static char sock_path[PATH_MAX];
+static client_t clients[CLIENTS];
+static unsigned int nclients;
+static admin_command_fn command_fn;
+
+/* Listen on a Unix socket at path that only root may connect to. fn runs
+ * the commands. Returns non-zero on error with errno set.
+ */
+int admin_open(const char *path, admin_command_fn fn)
+{
+	if((listen_fd = listen_unix(path)) < 0) {
+		return(1);
+	}
+	strcpy(sock_path, path);
+	command_fn = fn;
+	return(0);
+}
+
+static void drop_client(unsigned int i)
+{
+	close(clients[i].fd);
+	free(clients[i].out.data);
+	clients[i] = clients[--nclients];
+}
+
+void admin_close()
+{
+	while(nclients) {
+		drop_client(nclients - 1);
+	}
+	if(listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		unlink(sock_path);
+	}
+}
+
+int admin_enabled()
+{
+	return(listen_fd >= 0);
+}
+
+/* Number of pollfds admin_pollfds() fills in
+ */
+unsigned int admin_npollfds()
+{
+	return(listen_fd >= 0 ? 1 + nclients : 0);
+}
+
+void admin_pollfds(struct pollfd *pfds)
+{
+	unsigned int i;
+
+	pfds[0].fd = listen_fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	for(i = 0; i < nclients; i++) {
+		pfds[1+i].fd = clients[i].fd;
+		pfds[1+i].events = clients[i].sent < clients[i].out.len ? POLLOUT : POLLIN;
+		pfds[1+i].revents = 0;
+	}
+}
+
+void admin_printf(admin_buf_t *buf, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	while(1) {
+		va_start(args, fmt);
+		n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+		va_end(args);
+		if(n < 0) {
+			return;
+		}
+		if((size_t)n < buf->size - buf->len) {
+			buf->len += n;
+			return;
+		}
+		buf->size = (buf->len + n + 1) * 2;
+		if((buf->data = realloc(buf->data, buf->size)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+}
+
+/* Split a command line into words and run it, appending the reply to the
+ * client's output
+ */
+static void run_command(client_t *c, char *line)
+{
+	char *argv[ADMIN_ARGS_MAX+1];
+	int argc = 0;
+	char *word;
+
+	for(word = strtok(line, " \t\r"); word && argc < ADMIN_ARGS_MAX; word = strtok(NULL, " \t\r")) {
+		argv[argc++] = word;
+	}
+	argv[argc] = NULL;
+	if(argc == 0) {
+		return;
+	}
+	command_fn(&c->out, argc, argv);
+	admin_printf(&c->out, "\n");
+}
+
+/* Read what the client sent and run every complete line. Returns non-zero if
+ * the connection failed.
+ */
+static int read_commands(client_t *c)
+{
+	char *start, *nl;
+	ssize_t n;
+
+	n = recv(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen, MSG_DONTWAIT);
+	if(n < 0) {
+		return(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+	}
+	if(n == 0) {
+		c->eof = 1;
+	}
+	c->inlen += n;
+	c->in[c->inlen] = '\0';
+
+	for(start = c->in; (nl = strchr(start, '\n')) != NULL; start = nl + 1) {
+		*nl = '\0';
+		run_command(c, start);
+		c->deadline = now_ms() + IDLE_MAX;
+	}
+	c->inlen -= start - c->in;
+	memmove(c->in, start, c->inlen + 1);
+	if(c->eof && c->inlen) {
+		/* the last line lacks its newline */
+		run_command(c, c->in);
+		c->inlen = 0;
+	} else if(c->inlen == sizeof(c->in) - 1) {
+		admin_printf(&c->out, "error: line too long\n\n");
+		c->inlen = 0;
+	}
+	return(0);
+}
+
+/* Send as much of the replies as the socket takes. Returns non-zero if the
+ * connection failed.
+ */
+static int send_replies(client_t *c)
+{
+	ssize_t n;
+
+	while(c->sent < c->out.len) {
+		n = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return(errno != EAGAIN && errno != EWOULDBLOCK);
+		}
+		c->sent += n;
+		c->deadline = now_ms() + IDLE_MAX;
+	}
+	c->out.len = c->sent = 0;
+	return(0);
+}
+
+/* Serve the pollfds filled in by admin_pollfds(): run commands, send replies,
+ * drop idle clients and accept new ones. New commands are only read once the
+ * replies to the previous ones are out.
+ */
+void admin_handle(const struct pollfd *pfds)
+{
+	uint64_t now = now_ms();
+	unsigned int i;
+	client_t *c;
+	int fd;
+
+	/* backwards, dropping a client moves the last one into its place */
+	for(i = nclients; i-- > 0;) {
+		c = &clients[i];
+		if(pfds[1+i].revents == 0) {
+			if(now >= c->deadline) {
+				drop_client(i);
+			}
+			continue;
+		}
+		if(c->sent == c->out.len && read_commands(c)) {
+			drop_client(i);
+			continue;
+		}
+		if(send_replies(c) || (c->eof && c->out.len == 0)) {
+			drop_client(i);
+		}
+	}
+
+	if(pfds[0].revents & POLLIN) {
+		while((fd = accept_client(listen_fd)) >= 0) {
+			if(nclients == CLIENTS) {
+				close(fd);
+				continue;
+			}
+			memset(&clients[nclients], 0, sizeof(client_t));
+			clients[nclients].fd = fd;
+			clients[nclients].deadline = now + IDLE_MAX;
+			nclients++;
+		}
+	}
+}
+
+/* Time admin_handle() has to be called by to drop idle clients, in ms on
+ * CLOCK_MONOTONIC, 0 = none
+ */
+uint64_t admin_next_expiry()
+{
+	uint64_t next = 0;
+	unsigned int i;
+
+	for(i = 0; i < nclients; i++) {
+		next = sooner(next, clients[i].deadline);
+	}
+	return(next);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,50 @@
+/*
+ *  admin.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+#ifndef _PAC_ADMIN_H
+#define _PAC_ADMIN_H
+
+#include <stdint.h>
+#include <poll.h>
+
+/* A control socket for operators. Clients send one command per line and get
+ * the reply, ending with an empty line. Replies are formatted in one go into
+ * a buffer that is then sent as the client takes it, so a slow client never
+ * holds up the main loop.
+ */
+#define ADMIN_ARGS_MAX 8    /* words of a command line, the rest is ignored */
+
+typedef struct admin_buf admin_buf_t;
+
+/* runs a command; argv[0] is the command, argc is at least 1 */
+typedef void (*admin_command_fn)(admin_buf_t *out, int argc, char **argv);
+
+int admin_open(const char *path, admin_command_fn fn);
+void admin_close();
+int admin_enabled();
+unsigned int admin_npollfds();
+void admin_pollfds(struct pollfd *pfds);
+void admin_handle(const struct pollfd *pfds);
+uint64_t admin_next_expiry();
+void admin_printf(admin_buf_t *buf, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,432 @@
+/*
+ *  cmdtmpl.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cmdtmpl.h"
+
+#define SEG_TEXT  0
+#define SEG_IP    1
+#define SEG_DOOR  2
+#define SEG_PORT  3
+#define SEG_PROTO 4
+#define SEG_TIME  5
+#define SEG_IPS   6
+
+static const struct {
+	const char *name;
+	int type;
+} tokens[] = {
+	{"%IP%",    SEG_IP},
+	{"%IPS%",   SEG_IPS},
+	{"%DOOR%",  SEG_DOOR},
+	{"%PORT%",  SEG_PORT},
+	{"%PROTO%", SEG_PROTO},
+	{"%TIME%",  SEG_TIME},
+	{NULL, 0}
+};
+
+typedef struct segment {
+	int type;
+	char *text;     /* SEG_TEXT only */
+	size_t len;
+} segment_t;
+
+typedef struct word {
+	segment_t *segs;
+	unsigned int nsegs;
+} word_t;
+
+struct cmdtmpl {
+	word_t *words;
+	unsigned int nwords;
+	int shell;
+};
+
+/* state while compiling: the word being built and its pending literal text */
+typedef struct builder {
+	cmdtmpl_t *tmpl;
+	word_t *word;
+	char *text;
+	size_t len;
+} builder_t;
+
+/* Returns non-zero if the command uses shell syntax that an argv template
+ * cannot express (pipes, redirections, variables, globs, ...).
+ */
+int cmdtmpl_needs_shell(const char *command)
+{
+	const char *c;
+	char quote = 0;
+	int wordstart = 1;
+
+	for(c = command; *c; c++) {
+		if(quote) {
+			if(*c == quote) {
+				quote = 0;
+			} else if(quote == '"' && (*c == '$' || *c == '`')) {
+				return(1);
+			} else if(quote == '"' && *c == '\\' && c[1]) {
+				c++;
+			}
+			continue;
+		}
+		if(*c == '\\') {
+			if(c[1] == '\0' || c[1] == '\n') {
+				return(1);
+			}
+			c++;
+			wordstart = 0;
+			continue;
+		}
+		if(*c == '\'' || *c == '"') {
+			quote = *c;
+			wordstart = 0;
+			continue;
+		}
+		if(strchr("|&;<>()$`*?[\n", *c) || (wordstart && (*c == '~' || *c == '#'))) {
+			return(1);
+		}
+		wordstart = (*c == ' ' || *c == '\t');
+	}
+	return(quote != 0);
+}
+
+static int add_segment(builder_t *b, int type, const char *text, size_t len)
+{
+	segment_t *segs, *seg;
+
+	segs = realloc(b->word->segs, (b->word->nsegs + 1) * sizeof(segment_t));
+	if(segs == NULL) {
+		return(1);
+	}
+	b->word->segs = segs;
+	seg = &segs[b->word->nsegs++];
+	seg->type = type;
+	seg->text = NULL;
+	seg->len = len;
+	if(type == SEG_TEXT) {
+		if((seg->text = malloc(len + 1)) == NULL) {
+			return(1);
+		}
+		memcpy(seg->text, text, len);
+		seg->text[len] = '\0';
+	}
+	return(0);
+}
+
+/* Turn the literal text collected so far into a segment of the current word
+ */
+static int flush_text(builder_t *b)
+{
+	if(b->len == 0) {
+		return(0);
+	}
+	if(add_segment(b, SEG_TEXT, b->text, b->len)) {
+		return(1);
+	}
+	b->len = 0;
+	return(0);
+}
+
+static int begin_word(builder_t *b)
+{
+	word_t *words;
+
+	if(b->word) {
+		return(0);
+	}
+	words = realloc(b->tmpl->words, (b->tmpl->nwords + 1) * sizeof(word_t));
+	if(words == NULL) {
+		return(1);
+	}
+	b->tmpl->words = words;
+	b->word = &words[b->tmpl->nwords++];
+	b->word->segs = NULL;
+	b->word->nsegs = 0;
+	return(0);
+}
+
+static int end_word(builder_t *b)
+{
+	if(b->word == NULL) {
+		return(0);
+	}
+	if(flush_text(b)) {
+		return(1);
+	}
+	b->word = NULL;
+	return(0);
+}
+
+/* Add the character at c to the current word, or the token it starts.
+ * Returns the number of characters consumed, 0 on error.
+ */
+static size_t add_char(builder_t *b, const char *c)
+{
+	int i;
+	size_t n;
+
+	if(begin_word(b)) {
+		return(0);
+	}
+	if(*c == '%') {
+		for(i = 0; tokens[i].name; i++) {
+			n = strlen(tokens[i].name);
+			if(!strncmp(c, tokens[i].name, n)) {
+				if(flush_text(b) || add_segment(b, tokens[i].type, NULL, 0)) {
+					return(0);
+				}
+				return(n);
+			}
+		}
+	}
+	b->text[b->len++] = *c;
+	return(1);
+}
+
+static int add_word(builder_t *b, const char *text)
+{
+	return(begin_word(b) || add_segment(b, SEG_TEXT, text, strlen(text)) || end_word(b));
+}
+
+/* Split a command into words. Returns non-zero if out of memory.
+ */
+static int split_words(builder_t *b, const char *command)
+{
+	const char *c;
+	char quote = 0;
+	size_t n;
+
+	for(c = command; *c; c += n) {
+		n = 1;
+		if(quote) {
+			if(*c == quote) {
+				quote = 0;
+				continue;
+			}
+			if(quote == '"' && *c == '\\' && strchr("\"\\$`", c[1])) {
+				c++;
+			}
+		} else if(*c == ' ' || *c == '\t') {
+			if(end_word(b)) {
+				return(1);
+			}
+			continue;
+		} else if(*c == '\'' || *c == '"') {
+			/* "" is an (empty) word of its own */
+			quote = *c;
+			if(begin_word(b)) {
+				return(1);
+			}
+			continue;
+		} else if(*c == '\\') {
+			c++;
+		}
+		if((n = add_char(b, c)) == 0) {
+			return(1);
+		}
+	}
+	return(end_word(b));
+}
+
+/* The command as the single argument of "sh -c", only tokens are replaced.
+ * Returns non-zero if out of memory.
+ */
+static int shell_words(builder_t *b, const char *command)
+{
+	const char *c;
+	size_t n;
+
+	if(add_word(b, CMD_SHELL) || add_word(b, "-c") || begin_word(b)) {
+		return(1);
+	}
+	for(c = command; *c; c += n) {
+		if((n = add_char(b, c)) == 0) {
+			return(1);
+		}
+	}
+	return(end_word(b));
+}
+
+/* Compile a command. Without shell the command must not need one (see
+ * cmdtmpl_needs_shell()). Returns NULL on error, with a description in *err.
+ */
+cmdtmpl_t* cmdtmpl_compile(const char *command, int shell, const char **err)
+{
+	builder_t b;
+	int ret;
+
+	if(!shell && cmdtmpl_needs_shell(command)) {
+		*err = "command uses shell syntax";
+		return(NULL);
+	}
+	*err = "out of memory";
+	memset(&b, 0, sizeof(b));
+	if((b.tmpl = calloc(1, sizeof(cmdtmpl_t))) == NULL) {
+		return(NULL);
+	}
+	if((b.text = malloc(strlen(command) + 1)) == NULL) {
+		free(b.tmpl);
+		return(NULL);
+	}
+	b.tmpl->shell = shell;
+	ret = shell ? shell_words(&b, command) : split_words(&b, command);
+	free(b.text);
+	if(ret == 0 && b.tmpl->nwords == 0) {
+		*err = "empty command";
+		ret = 1;
+	}
+	if(ret) {
+		cmdtmpl_free(b.tmpl);
+		return(NULL);
+	}
+	return(b.tmpl);
+}
+
+void cmdtmpl_free(cmdtmpl_t *tmpl)
+{
+	unsigned int i, j;
+
+	if(tmpl == NULL) {
+		return;
+	}
+	for(i = 0; i < tmpl->nwords; i++) {
+		for(j = 0; j < tmpl->words[i].nsegs; j++) {
+			free(tmpl->words[i].segs[j].text);
+		}
+		free(tmpl->words[i].segs);
+	}
+	free(tmpl->words);
+	free(tmpl);
+}
+
+int cmdtmpl_shell(const cmdtmpl_t *tmpl)
+{
+	return(tmpl->shell);
+}
+
+/* Returns non-zero if the template contains the given token (eg, "%IP%")
+ */
+int cmdtmpl_uses(const cmdtmpl_t *tmpl, const char *token)
+{
+	unsigned int i, j;
+	int type = -1;
+
+	for(i = 0; tokens[i].name; i++) {
+		if(!strcmp(tokens[i].name, token)) {
+			type = tokens[i].type;
+		}
+	}
+	for(i = 0; i < tmpl->nwords; i++) {
+		for(j = 0; j < tmpl->words[i].nsegs; j++) {
+			if(tmpl->words[i].segs[j].type == type) {
+				return(1);
+			}
+		}
+	}
+	return(0);
+}
+
+/* Fill in the tokens of a template. Returns the packed argv strings (to be
+ * freed by the caller) and their total size in *len, or NULL if out of
+ * memory.
+ */
+char* cmdtmpl_expand(const cmdtmpl_t *tmpl, const cmd_vars_t *vars, size_t *len)
+{
+	char port[8], now[24];
+	const char *values[7];
+	size_t sizes[7];
+	unsigned int i, j;
+	size_t total = 0;
+	char *args, *p, *q;
+	const segment_t *seg;
+
+	snprintf(port, sizeof(port), "%u", vars->port);
+	snprintf(now, sizeof(now), "%ld", (long)vars->time);
+	values[SEG_TEXT] = NULL;
+	values[SEG_IP] = vars->ip;
+	values[SEG_DOOR] = vars->door;
+	values[SEG_PORT] = port;
+	values[SEG_PROTO] = vars->proto;
+	values[SEG_TIME] = now;
+	values[SEG_IPS] = vars->ips ? vars->ips : vars->ip;
+	for(i = SEG_IP; i <= SEG_IPS; i++) {
+		sizes[i] = strlen(values[i]);
+	}
+
+	for(i = 0; i < tmpl->nwords; i++) {
+		for(j = 0; j < tmpl->words[i].nsegs; j++) {
+			seg = &tmpl->words[i].segs[j];
+			total += seg->type == SEG_TEXT ? seg->len : sizes[seg->type];
+		}
+		total++;
+	}
+	if((args = malloc(total)) == NULL) {
+		return(NULL);
+	}
+	for(p = args, i = 0; i < tmpl->nwords; i++) {
+		for(j = 0; j < tmpl->words[i].nsegs; j++) {
+			seg = &tmpl->words[i].segs[j];
+			if(seg->type == SEG_TEXT) {
+				memcpy(p, seg->text, seg->len);
+				p += seg->len;
+			} else {
+				memcpy(p, values[seg->type], sizes[seg->type]);
+				p += sizes[seg->type];
+			}
+		}
+		/* split a lone %IPS% into arguments, the size stays the same */
+		if(!tmpl->shell && tmpl->words[i].nsegs == 1 && tmpl->words[i].segs[0].type == SEG_IPS) {
+			for(q = p - sizes[SEG_IPS]; q < p; q++) {
+				if(*q == ' ') {
+					*q = '\0';
+				}
+			}
+		}
+		*p++ = '\0';
+	}
+	*len = total;
+	return(args);
+}
+
+/* Write packed argv strings to buf as one line for the logs, quoting the
+ * arguments that need it
+ */
+void cmdtmpl_display(const char *args, size_t len, char *buf, size_t size)
+{
+	const char *a;
+	size_t n = 0;
+
+	if(size == 0) {
+		return;
+	}
+	buf[0] = '\0';
+	for(a = args; a < args + len && n < size; a += strlen(a) + 1) {
+		if(*a && strcspn(a, " \t'\"\\") == strlen(a)) {
+			n += snprintf(buf + n, size - n, "%s%s", a == args ? "" : " ", a);
+		} else {
+			n += snprintf(buf + n, size - n, "%s'%s'", a == args ? "" : " ", a);
+		}
+	}
+}
+
+/* vim: set ts=2 sw=2 noet: */
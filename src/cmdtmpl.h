@@ -0,0 +1,66 @@
+/*
+ *  cmdtmpl.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_CMDTMPL_H
+#define _PAC_CMDTMPL_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* A door command compiled into an argv template when the config is read.
+ * Words are split like the shell does (blanks, '...', "..." and \), and
+ * every word is a list of literal text and tokens:
+ *
+ *   %IP%     knocker's IP address
+ *   %IPS%    IP addresses of all knockers of a batch, separated by blanks;
+ *            a word of its own becomes one argument per address
+ *   %DOOR%   door name
+ *   %PORT%   last port of the knock sequence
+ *   %PROTO%  its protocol (tcp or udp)
+ *   %TIME%   time of the knock (seconds since the epoch)
+ *
+ * Expanding a template gives the argv strings packed one after the other,
+ * each terminated by a NUL. In shell mode the template is the single word
+ * run by "/bin/sh -c".
+ */
+typedef struct cmdtmpl cmdtmpl_t;
+
+typedef struct cmd_vars {
+	const char *ip;
+	const char *ips;
+	const char *door;
+	unsigned short port;
+	const char *proto;
+	time_t time;
+} cmd_vars_t;
+
+#define CMD_SHELL "/bin/sh"
+
+int cmdtmpl_needs_shell(const char *command);
+cmdtmpl_t* cmdtmpl_compile(const char *command, int shell, const char **err);
+void cmdtmpl_free(cmdtmpl_t *tmpl);
+int cmdtmpl_shell(const cmdtmpl_t *tmpl);
+int cmdtmpl_uses(const cmdtmpl_t *tmpl, const char *token);
+char* cmdtmpl_expand(const cmdtmpl_t *tmpl, const cmd_vars_t *vars, size_t *len);
+void cmdtmpl_display(const char *args, size_t len, char *buf, size_t size);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,317 @@
+/*
+ *  eventdump.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "eventlog.h"
+
+static char version[] = "0.8.0";
+
+typedef struct logfile {
+	const char *path;
+	const eventlog_header_t *hdr;
+	size_t size;
+} logfile_t;
+
+/* function prototypes */
+int add_file(const char *path, int quiet);
+int add_ring(const char *base);
+int parse_address(char *str);
+int compare_files(const void *a, const void *b);
+void dump_file(const logfile_t *f);
+void print_json_string(const char *str);
+void ver();
+void usage();
+
+int o_json = 0;
+const char *o_door = NULL;
+uint32_t o_net = 0;
+uint32_t o_mask = 0;
+
+logfile_t *files = NULL;
+unsigned int nfiles = 0;
+
+static const char *type_names[] = { "?", "stage", "open", "timeout", "fail", "close" };
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int opt, optidx = 1;
+	static struct option opts[] =
+	{
+		{"json",      no_argument,       0, 'j'},
+		{"door",      required_argument, 0, 'd'},
+		{"address",   required_argument, 0, 'a'},
+		{"help",      no_argument,       0, 'h'},
+		{"version",   no_argument,       0, 'V'},
+		{0, 0, 0, 0}
+	};
+
+	while((opt = getopt_long(argc, argv, "jd:a:hV", opts, &optidx))) {
+		if(opt < 0) {
+			break;
+		}
+		switch(opt) {
+			case 0:   break;
+			case 'j': o_json = 1; break;
+			case 'd': o_door = optarg; break;
+			case 'a':
+				if(parse_address(optarg)) {
+					fprintf(stderr, "error: invalid address: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'V': ver();
+			case 'h': /* fallthrough */
+			default: usage();
+		}
+	}
+	if(optind >= argc) {
+		usage();
+	}
+
+	for(; optind < argc; optind++) {
+		if(add_file(argv[optind], 1) && add_ring(argv[optind])) {
+			fprintf(stderr, "error: cannot read %s: %s\n", argv[optind], strerror(errno));
+			exit(1);
+		}
+	}
+	/* the files of a ring are written in the order of their numbers */
+	qsort(files, nfiles, sizeof(logfile_t), compare_files);
+	for(i = 0; i < nfiles; i++) {
+		dump_file(&files[i]);
+	}
+	return(0);
+}
+
+/* Map an event log file and add it to the list. Returns non-zero if it
+ * cannot be read or is not an event log; unless quiet, the reason is
+ * printed.
+ */
+int add_file(const char *path, int quiet)
+{
+	const eventlog_header_t *hdr;
+	struct stat st;
+	void *p;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) == -1) {
+		return(1);
+	}
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(eventlog_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return(1);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) {
+		return(1);
+	}
+	hdr = (const eventlog_header_t*)p;
+	if(memcmp(hdr->magic, EVENTLOG_MAGIC, sizeof(hdr->magic)) || hdr->version != EVENTLOG_VERSION ||
+			hdr->record_size != sizeof(eventlog_record_t) ||
+			hdr->capacity > (st.st_size - sizeof(eventlog_header_t)) / sizeof(eventlog_record_t)) {
+		if(!quiet) {
+			fprintf(stderr, "warning: %s is not an event log, skipped\n", path);
+		}
+		munmap(p, st.st_size);
+		errno = EINVAL;
+		return(1);
+	}
+	if((files = realloc(files, (nfiles + 1) * sizeof(logfile_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	files[nfiles].path = path;
+	files[nfiles].hdr = hdr;
+	files[nfiles].size = st.st_size;
+	nfiles++;
+	return(0);
+}
+
+/* Add all files of the ring an Event_Log path names, <base>.0 on. Returns
+ * non-zero if there is none.
+ */
+int add_ring(const char *base)
+{
+	char *path;
+	unsigned int i;
+
+	for(i = 0; ; i++) {
+		if((path = malloc(strlen(base) + 16)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		sprintf(path, "%s.%u", base, i);
+		if(access(path, F_OK)) {
+			free(path);
+			break;
+		}
+		add_file(path, 0);
+	}
+	if(i == 0) {
+		errno = ENOENT;
+	}
+	return(i == 0);
+}
+
+/* Parse addr[/len] into the address filter
+ */
+int parse_address(char *str)
+{
+	struct in_addr in;
+	char *slash, *end;
+	long len = 32;
+
+	if((slash = strchr(str, '/'))) {
+		*slash++ = '\0';
+		len = strtol(slash, &end, 10);
+		if(end == slash || *end || len < 0 || len > 32) {
+			return(1);
+		}
+	}
+	if(inet_pton(AF_INET, str, &in) != 1) {
+		return(1);
+	}
+	o_mask = len ? 0xffffffffU << (32 - len) : 0;
+	o_net = ntohl(in.s_addr) & o_mask;
+	return(0);
+}
+
+int compare_files(const void *a, const void *b)
+{
+	uint64_t sa = ((const logfile_t*)a)->hdr->seq, sb = ((const logfile_t*)b)->hdr->seq;
+
+	return(sa < sb ? -1 : sa > sb);
+}
+
+/* Print the records of one file that pass the filters
+ */
+void dump_file(const logfile_t *f)
+{
+	const eventlog_header_t *hdr = f->hdr;
+	const eventlog_record_t *rec = (const eventlog_record_t*)(hdr + 1);
+	uint32_t i, count, ndoors;
+	char date[64], zone[8], addr[INET_ADDRSTRLEN];
+	const char *door, *type;
+	struct in_addr in;
+	struct tm tm;
+	time_t secs;
+
+	/* knockd may still be writing the file */
+	count = __atomic_load_n(&hdr->count, __ATOMIC_ACQUIRE);
+	ndoors = __atomic_load_n(&hdr->ndoors, __ATOMIC_ACQUIRE);
+	if(count > hdr->capacity) {
+		count = hdr->capacity;
+	}
+	if(ndoors > EVENTLOG_DOORS) {
+		ndoors = EVENTLOG_DOORS;
+	}
+	for(i = 0; i < count; i++, rec++) {
+		door = rec->door < ndoors ? hdr->doors[rec->door] : "?";
+		if(o_door && strncmp(door, o_door, EVENTLOG_NAME_MAX-1)) {
+			continue;
+		}
+		if((ntohl(rec->addr) & o_mask) != o_net) {
+			continue;
+		}
+		type = rec->type < sizeof(type_names) / sizeof(type_names[0]) ? type_names[rec->type] : "?";
+		in.s_addr = rec->addr;
+		inet_ntop(AF_INET, &in, addr, sizeof(addr));
+		secs = rec->time / 1000000;
+		localtime_r(&secs, &tm);
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+		strftime(zone, sizeof(zone), "%z", &tm);
+
+		if(o_json) {
+			date[10] = 'T';
+			printf("{\"time\":\"%s.%06u%s\",\"type\":\"%s\",\"src\":\"%s\",\"door\":",
+					date, (unsigned int)(rec->time % 1000000), zone, type, addr);
+			print_json_string(door);
+			printf(",\"mono\":%llu,\"stage\":%u", (unsigned long long)rec->mono, rec->stage);
+			if(rec->proto) {
+				printf(",\"port\":%u,\"proto\":\"%s\"", rec->port, rec->proto == IPPROTO_UDP ? "udp" : "tcp");
+			}
+			printf("}\n");
+		} else {
+			printf("%s.%06u %-7s %-15s %.*s stage %u", date, (unsigned int)(rec->time % 1000000),
+					type, addr, EVENTLOG_NAME_MAX, door, rec->stage);
+			if(rec->proto) {
+				printf(" port %u/%s", rec->port, rec->proto == IPPROTO_UDP ? "udp" : "tcp");
+			}
+			printf("\n");
+		}
+	}
+}
+
+void print_json_string(const char *str)
+{
+	const unsigned char *p;
+
+	putchar('"');
+	for(p = (const unsigned char*)str; *p && p - (const unsigned char*)str < EVENTLOG_NAME_MAX; p++) {
+		if(*p == '"' || *p == '\\') {
+			printf("\\%c", *p);
+		} else if(*p < 0x20) {
+			printf("\\u%04x", *p);
+		} else {
+			putchar(*p);
+		}
+	}
+	putchar('"');
+}
+
+void usage() {
+	printf("usage: knockd-eventdump [options] <file|event_log> ...\n");
+	printf("options:\n");
+	printf("  -j, --json           print one JSON object per event\n");
+	printf("  -d, --door <name>    only events of door <name>\n");
+	printf("  -a, --address <a/n>  only events of knockers in prefix <a/n>\n");
+	printf("  -V, --version        display version\n");
+	printf("  -h, --help           this help\n");
+	printf("\n");
+	printf("example:  knockd-eventdump -d SSH /var/log/knockd/events\n");
+	printf("\n");
+	exit(1);
+}
+
+void ver() {
+	printf("knockd-eventdump %s\n", version);
+	printf("Copyright (C) 2004-2016 Judd Vinet <jvinet@zeroflux.org>\n");
+	exit(0);
+}
+
+/* vim: set ts=2 sw=2 noet: */
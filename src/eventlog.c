@@ -0,0 +1,215 @@
+/*
+ *  eventlog.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "eventlog.h"
+#include "util.h"
+
+#define MIN_RECORDS 1024  /* smallest file accepted, in records */
+
+static char base[PATH_MAX];
+static unsigned int nfiles;
+static size_t file_size;
+static unsigned int current;
+static uint64_t next_seq;
+static eventlog_header_t *map = NULL;
+static eventlog_record_t *records;
+static eventlog_stats_t stats;
+
+/* door names in the order they were first seen, copied into every file */
+static char names[EVENTLOG_DOORS][EVENTLOG_NAME_MAX];
+static unsigned int nnames;
+
+static void file_name(char *buf, size_t len, unsigned int idx)
+{
+	snprintf(buf, len, "%s.%u", base, idx);
+}
+
+/* Truncate file idx, map it and write a fresh header. The blocks are
+ * allocated up front, as a store into a hole of the mapping on a full file
+ * system would raise SIGBUS. Returns non-zero on error with errno set.
+ */
+static int start_file(unsigned int idx)
+{
+	char path[PATH_MAX + 16];
+	void *p;
+	int fd, err;
+
+	if(map) {
+		munmap(map, file_size);
+		map = NULL;
+	}
+	file_name(path, sizeof(path), idx);
+	if((fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600)) == -1) {
+		return(1);
+	}
+	if((err = posix_fallocate(fd, 0, file_size)) != 0) {
+		close(fd);
+		errno = err;
+		return(1);
+	}
+	p = mmap(NULL, file_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) {
+		return(1);
+	}
+	map = (eventlog_header_t*)p;
+	records = (eventlog_record_t*)(map + 1);
+	memcpy(map->magic, EVENTLOG_MAGIC, sizeof(map->magic));
+	map->version = EVENTLOG_VERSION;
+	map->record_size = sizeof(eventlog_record_t);
+	map->seq = next_seq++;
+	map->capacity = (file_size - sizeof(eventlog_header_t)) / sizeof(eventlog_record_t);
+	map->ndoors = nnames;
+	memcpy(map->doors, names, sizeof(names));
+	current = idx;
+	stats.files++;
+	return(0);
+}
+
+/* Start logging to <path>.0 to <path>.<files-1> of size bytes each. A ring
+ * left by a previous run is continued in the file after its newest one.
+ * Returns non-zero on error with errno set.
+ */
+int eventlog_open(const char *path, size_t size, unsigned int files)
+{
+	char name[PATH_MAX + 16];
+	eventlog_header_t hdr;
+	unsigned int i, newest = files - 1;
+	int fd;
+
+	if(strlen(path) >= sizeof(base) || files == 0 ||
+			size < sizeof(eventlog_header_t) + MIN_RECORDS * sizeof(eventlog_record_t)) {
+		errno = EINVAL;
+		return(1);
+	}
+	strcpy(base, path);
+	nfiles = files;
+	file_size = size;
+	next_seq = 0;
+	for(i = 0; i < files; i++) {
+		file_name(name, sizeof(name), i);
+		if((fd = open(name, O_RDONLY|O_CLOEXEC)) == -1) {
+			continue;
+		}
+		if(read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+				!memcmp(hdr.magic, EVENTLOG_MAGIC, sizeof(hdr.magic)) && hdr.seq >= next_seq) {
+			next_seq = hdr.seq + 1;
+			newest = i;
+		}
+		close(fd);
+	}
+	stats.failed = 0;
+	return(start_file((newest + 1) % files));
+}
+
+void eventlog_close()
+{
+	if(map) {
+		munmap(map, file_size);
+		map = NULL;
+	}
+}
+
+int eventlog_enabled()
+{
+	return(map != NULL);
+}
+
+/* Return the id of a door name for eventlog_write(), adding it to the door
+ * table if it is new. Ids stay the same across reloads. When the table is
+ * full EVENTLOG_NO_DOOR is returned.
+ */
+unsigned int eventlog_door(const char *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < nnames; i++) {
+		if(!strncmp(names[i], name, EVENTLOG_NAME_MAX-1)) {
+			return(i);
+		}
+	}
+	if(nnames == EVENTLOG_DOORS) {
+		return(EVENTLOG_NO_DOOR);
+	}
+	strncpy(names[nnames], name, EVENTLOG_NAME_MAX-1);
+	if(map) {
+		memcpy(map->doors[nnames], names[nnames], EVENTLOG_NAME_MAX);
+		__atomic_store_n(&map->ndoors, nnames + 1, __ATOMIC_RELEASE);
+	}
+	return(nnames++);
+}
+
+/* Name of a door id handed out by eventlog_door(), NULL if there is none
+ */
+const char* eventlog_door_name(unsigned int door)
+{
+	return(door < nnames ? names[door] : NULL);
+}
+
+/* Append one record, addr in host byte order and time in microseconds
+ * since the epoch; the record also gets the monotonic time it was written
+ * at. The count in the header is only raised once the record is complete,
+ * so a reader of the live file never sees a partial one.
+ */
+void eventlog_write(int type, uint32_t addr, unsigned int door, unsigned int stage,
+		unsigned int port, unsigned int proto, uint64_t time)
+{
+	eventlog_record_t *rec;
+	uint32_t n;
+
+	if(map == NULL) {
+		return;
+	}
+	n = map->count;
+	if(n == map->capacity) {
+		if(start_file((current + 1) % nfiles)) {
+			stats.failed = 1;
+			return;
+		}
+		n = 0;
+	}
+	rec = &records[n];
+	rec->time = time;
+	rec->mono = now_us();
+	rec->addr = htonl(addr);
+	rec->door = door;
+	rec->port = port;
+	rec->type = type;
+	rec->stage = stage;
+	rec->proto = proto;
+	__atomic_store_n(&map->count, n + 1, __ATOMIC_RELEASE);
+	stats.written++;
+}
+
+void eventlog_get_stats(eventlog_stats_t *s)
+{
+	*s = stats;
+	s->current = current;
+}
+
+/* vim: set ts=2 sw=2 noet: */
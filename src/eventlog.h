@@ -0,0 +1,88 @@
+/*
+ *  eventlog.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_EVENTLOG_H
+#define _PAC_EVENTLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A binary log of knock events kept in a ring of fixed-size files,
+ * <path>.0 to <path>.<n-1>. Each file is a header followed by an array of
+ * fixed-size records; knockd maps the current file and appends records to
+ * it, moving on to the next file (and overwriting it) when it is full.
+ * Integers are in host byte order except for addr. Files are read back with
+ * knockd-eventdump.
+ */
+#define EVENTLOG_MAGIC     "KNOCKEVT"
+#define EVENTLOG_VERSION   2
+#define EVENTLOG_DOORS     256   /* door names a file can hold */
+#define EVENTLOG_NAME_MAX  64
+#define EVENTLOG_NO_DOOR   0xffff
+
+#define EVENTLOG_STAGE     1     /* knocker reached a stage */
+#define EVENTLOG_OPEN      2     /* door opened */
+#define EVENTLOG_TIMEOUT   3     /* sequence timed out */
+#define EVENTLOG_FAIL      4     /* sequence broken by a wrong knock */
+#define EVENTLOG_CLOSE     5     /* door closed again */
+
+typedef struct eventlog_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t seq;        /* file number, grows by one with every file started */
+	uint32_t capacity;   /* records the file can hold */
+	uint32_t count;      /* records written so far */
+	uint32_t ndoors;     /* names in the door table */
+	uint32_t pad;
+	char doors[EVENTLOG_DOORS][EVENTLOG_NAME_MAX];
+} eventlog_header_t;
+
+typedef struct eventlog_record {
+	uint64_t time;       /* microseconds since the epoch */
+	uint64_t mono;       /* microseconds on CLOCK_MONOTONIC, in order even when the system time is set */
+	uint32_t addr;       /* knocker's IPv4 address, network byte order */
+	uint16_t door;       /* index into the door table */
+	uint16_t port;       /* port knocked (STAGE, FAIL), 0 otherwise */
+	uint8_t type;        /* EVENTLOG_STAGE, _OPEN, ... */
+	uint8_t stage;       /* stage reached */
+	uint8_t proto;       /* IP protocol of the knock (STAGE, FAIL), 0 otherwise */
+	uint8_t pad[5];
+} eventlog_record_t;
+
+typedef struct eventlog_stats {
+	unsigned long written;
+	unsigned long files;     /* files started */
+	unsigned int current;    /* index of the file being written */
+	int failed;              /* the log was given up after an error */
+} eventlog_stats_t;
+
+int eventlog_open(const char *path, size_t size, unsigned int files);
+void eventlog_close();
+int eventlog_enabled();
+unsigned int eventlog_door(const char *name);
+const char* eventlog_door_name(unsigned int door);
+void eventlog_write(int type, uint32_t addr, unsigned int door, unsigned int stage,
+		unsigned int port, unsigned int proto, uint64_t time);
+void eventlog_get_stats(eventlog_stats_t *stats);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
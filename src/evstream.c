@@ -0,0 +1,311 @@
+/*
+ *  evstream.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "evstream.h"
+#include "util.h"
+
+#define DOOR_MAX 255   /* longest door name put in a record */
+
+typedef struct subscriber {
+	int fd;
+	long pid;            /* of the peer, -1 = unknown */
+	unsigned char *buf;  /* ring of records waiting to be sent */
+	size_t head, len;
+	unsigned long queued;
+	unsigned long dropped;
+	uint64_t deadline;   /* ms, when it is dropped if the queue has not moved by then */
+} subscriber_t;
+
+static int listen_fd = -1;
+static char sock_path[PATH_MAX];
+static size_t queue_size;
+static subscriber_t *subs = NULL;
+static unsigned int nsubs, subs_size;
+static uint32_t seq;
+static evstream_stats_t stats;
+
+/* Listen for subscribers on a socket at path, which only root may connect
+ * to. Every subscriber may have up to queue bytes of records waiting.
+ * Returns non-zero on error.
+ */
+int evstream_open(const char *path, size_t queue)
+{
+	if((listen_fd = listen_unix(path)) < 0) {
+		return(1);
+	}
+	strcpy(sock_path, path);
+	queue_size = queue < EVSTREAM_HDR_LEN + DOOR_MAX ? EVSTREAM_HDR_LEN + DOOR_MAX : queue;
+	return(0);
+}
+
+static void drop_subscriber(unsigned int i)
+{
+	close(subs[i].fd);
+	free(subs[i].buf);
+	subs[i] = subs[--nsubs];
+}
+
+void evstream_close()
+{
+	if(listen_fd < 0) {
+		return;
+	}
+	while(nsubs) {
+		drop_subscriber(nsubs - 1);
+	}
+	free(subs);
+	subs = NULL;
+	subs_size = 0;
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(sock_path);
+}
+
+int evstream_enabled()
+{
+	return(listen_fd >= 0);
+}
+
+/* Number of pollfds evstream_pollfds() fills in
+ */
+unsigned int evstream_npollfds()
+{
+	return(listen_fd < 0 ? 0 : 1 + nsubs);
+}
+
+void evstream_pollfds(struct pollfd *pfds)
+{
+	unsigned int i;
+
+	if(listen_fd < 0) {
+		return;
+	}
+	pfds[0].fd = listen_fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	for(i = 0; i < nsubs; i++) {
+		pfds[i+1].fd = subs[i].fd;
+		pfds[i+1].events = POLLIN | (subs[i].len ? POLLOUT : 0);
+		pfds[i+1].revents = 0;
+	}
+}
+
+/* Send as much of the queue as the socket takes. Returns non-zero if the
+ * subscriber is gone.
+ */
+static int flush(subscriber_t *s)
+{
+	size_t chunk;
+	ssize_t n;
+
+	while(s->len) {
+		chunk = s->len < queue_size - s->head ? s->len : queue_size - s->head;
+		n = send(s->fd, s->buf + s->head, chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return(errno != EAGAIN && errno != EWOULDBLOCK);
+		}
+		s->head = (s->head + n) % queue_size;
+		s->len -= n;
+		s->deadline = now_ms() + IDLE_MAX;
+	}
+	s->head = 0;
+	return(0);
+}
+
+static long peer_pid(int fd)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+		return((long)cred.pid);
+	}
+#endif
+	return(-1);
+}
+
+/* Serve the pollfds filled in by evstream_pollfds(): send queued records,
+ * drop subscribers that went away or stopped reading and accept new ones.
+ * A subscriber with nothing queued may stay idle for as long as it likes.
+ */
+void evstream_handle(const struct pollfd *pfds)
+{
+	uint64_t now = now_ms();
+	char junk[256];
+	unsigned int i;
+	ssize_t n;
+	int fd;
+
+	if(listen_fd < 0) {
+		return;
+	}
+	/* backwards, dropping a subscriber moves the last one into its place */
+	for(i = nsubs; i-- > 0;) {
+		if(subs[i].len && now >= subs[i].deadline) {
+			drop_subscriber(i);
+			continue;
+		}
+		if(pfds[i+1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			/* subscribers have nothing to say, only EOF matters */
+			n = recv(subs[i].fd, junk, sizeof(junk), MSG_DONTWAIT);
+			if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+				drop_subscriber(i);
+				continue;
+			}
+		}
+		if((pfds[i+1].revents & POLLOUT) && flush(&subs[i])) {
+			drop_subscriber(i);
+		}
+	}
+
+	if(!(pfds[0].revents & POLLIN)) {
+		return;
+	}
+	while((fd = accept_client(listen_fd)) >= 0) {
+		if(nsubs == subs_size) {
+			subscriber_t *p = realloc(subs, (subs_size ? subs_size * 2 : 4) * sizeof(subscriber_t));
+			if(p == NULL) {
+				close(fd);
+				break;
+			}
+			subs = p;
+			subs_size = subs_size ? subs_size * 2 : 4;
+		}
+		if((subs[nsubs].buf = malloc(queue_size)) == NULL) {
+			close(fd);
+			continue;
+		}
+		subs[nsubs].fd = fd;
+		subs[nsubs].pid = peer_pid(fd);
+		subs[nsubs].head = subs[nsubs].len = 0;
+		subs[nsubs].queued = subs[nsubs].dropped = 0;
+		nsubs++;
+	}
+}
+
+static unsigned char* put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return(p + 4);
+}
+
+/* Queue a record for every subscriber and send what their sockets take.
+ * addr is in host byte order, tv the time of the event.
+ */
+void evstream_publish(int type, uint32_t addr, unsigned int stage, const char *door,
+		const struct timeval *tv)
+{
+	unsigned char rec[EVSTREAM_HDR_LEN + DOOR_MAX], *p = rec + 2;
+	uint64_t usecs = (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	size_t doorlen = strlen(door), len, tail, i;
+	subscriber_t *s;
+
+	if(listen_fd < 0) {
+		return;
+	}
+	if(doorlen > DOOR_MAX) {
+		doorlen = DOOR_MAX;
+	}
+	len = EVSTREAM_HDR_LEN + doorlen;
+	rec[0] = (len - 2) >> 8;
+	rec[1] = (len - 2) & 0xff;
+	p = put32(p, ++seq);
+	p = put32(p, usecs >> 32);
+	p = put32(p, usecs & 0xffffffff);
+	p = put32(p, addr);
+	*p++ = type;
+	*p++ = stage > 255 ? 255 : stage;
+	memcpy(p, door, doorlen);
+	stats.published++;
+
+	for(i = nsubs; i-- > 0;) {
+		s = &subs[i];
+		if(queue_size - s->len < len) {
+			s->dropped++;
+			stats.dropped++;
+			continue;
+		}
+		if(s->len == 0) {
+			s->deadline = now_ms() + IDLE_MAX;
+		}
+		tail = (s->head + s->len) % queue_size;
+		if(tail + len <= queue_size) {
+			memcpy(s->buf + tail, rec, len);
+		} else {
+			memcpy(s->buf + tail, rec, queue_size - tail);
+			memcpy(s->buf, rec + queue_size - tail, len - (queue_size - tail));
+		}
+		s->len += len;
+		s->queued++;
+		if(flush(s)) {
+			drop_subscriber(i);
+		}
+	}
+}
+
+/* Time evstream_handle() has to be called by to drop subscribers that
+ * stopped reading, in ms on CLOCK_MONOTONIC, 0 = none
+ */
+uint64_t evstream_next_expiry()
+{
+	uint64_t next = 0;
+	unsigned int i;
+
+	for(i = 0; i < nsubs; i++) {
+		if(subs[i].len) {
+			next = sooner(next, subs[i].deadline);
+		}
+	}
+	return(next);
+}
+
+void evstream_get_stats(evstream_stats_t *s)
+{
+	*s = stats;
+	s->subscribers = nsubs;
+}
+
+void evstream_walk(evstream_walk_fn fn, void *arg)
+{
+	unsigned int i;
+
+	for(i = 0; i < nsubs; i++) {
+		fn(subs[i].pid, subs[i].queued, subs[i].dropped, subs[i].len, arg);
+	}
+}
+
+/* vim: set ts=2 sw=2 noet: */
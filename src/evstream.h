@@ -0,0 +1,75 @@
+/*
+ *  evstream.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_EVSTREAM_H
+#define _PAC_EVSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/time.h>
+
+/* A stream of knock events for local subscribers on a Unix stream socket.
+ * Every record is a 16 bit length followed by that many bytes:
+ *
+ *   uint32  seq     record number, a gap means records were dropped
+ *   uint64  time    microseconds since the epoch
+ *   uint32  addr    knocker's IPv4 address
+ *   uint8   type    EVSTREAM_STAGE, _OPEN, _TIMEOUT or _CLOSE
+ *   uint8   stage   stage reached (STAGE and TIMEOUT), 0 otherwise
+ *   char    door[]  door name, up to the end of the record, no NUL
+ *
+ * All integers are in network byte order. Each subscriber has a bounded
+ * queue; records that do not fit are dropped for that subscriber only, so a
+ * slow one never holds up knockd.
+ */
+#define EVSTREAM_STAGE   1
+#define EVSTREAM_OPEN    2
+#define EVSTREAM_TIMEOUT 3
+#define EVSTREAM_CLOSE   4
+
+#define EVSTREAM_HDR_LEN 20   /* length and fixed fields */
+
+typedef struct evstream_stats {
+	unsigned long published;
+	unsigned long dropped;
+	unsigned int subscribers;
+} evstream_stats_t;
+
+/* pid of the subscriber (-1 = unknown), records queued for it and dropped,
+ * bytes not sent yet */
+typedef void (*evstream_walk_fn)(long pid, unsigned long queued, unsigned long dropped,
+		size_t pending, void *arg);
+
+int evstream_open(const char *path, size_t queue);
+void evstream_close();
+int evstream_enabled();
+unsigned int evstream_npollfds();
+void evstream_pollfds(struct pollfd *pfds);
+void evstream_handle(const struct pollfd *pfds);
+uint64_t evstream_next_expiry();
+void evstream_publish(int type, uint32_t addr, unsigned int stage, const char *door,
+		const struct timeval *tv);
+void evstream_get_stats(evstream_stats_t *stats);
+void evstream_walk(evstream_walk_fn fn, void *arg);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
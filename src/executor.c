@@ -0,0 +1,742 @@
+/*
+ *  executor.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "executor.h"
+#include "probes.h"
+#include "util.h"
+
+extern char **environ;
+
+/* daemon side */
+static int exec_sock = -1;
+static pid_t exec_pid = -1;
+static exec_msg_t *result = NULL;
+static exec_stats_t stats;
+
+/* daemon side: stop jobs the socket could not take yet, oldest first */
+typedef struct held {
+	struct held *next;
+	size_t size;
+	exec_msg_t *msg;
+} held_t;
+
+static held_t *held = NULL, *held_tail = NULL;
+
+/* executor side: jobs waiting for a worker, a list per priority */
+typedef struct door_slots {
+	struct door_slots *next;
+	char name[EXEC_NAME_MAX];
+	unsigned int limit;     /* 0 = no limit */
+	unsigned int running;
+} door_slots_t;
+
+typedef struct job {
+	struct job *next;
+	door_slots_t *door;
+	uint64_t queued;        /* ms, when the job came in */
+	exec_msg_t *msg;
+} job_t;
+
+static int job_sock = -1;
+static int init_nsfd = -1;
+static job_t *jobs[EXEC_PRIOS];
+static job_t *jobs_tail[EXEC_PRIOS];
+static door_slots_t *door_slots = NULL;
+static unsigned int job_count, job_size;
+static int job_closing = 0;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+/* Start a command with the signal mask and dispositions a command expects,
+ * in a session of its own. infd (if not -1) becomes its stdin.
+ */
+static int spawn(pid_t *pid, char **argv, int infd)
+{
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+	sigset_t sigs;
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	int err;
+
+	if((err = posix_spawn_file_actions_init(&actions)) != 0) {
+		return(err);
+	}
+	if(infd >= 0 && (err = posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO)) != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		return(err);
+	}
+	if((err = posix_spawnattr_init(&attr)) != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		return(err);
+	}
+#ifdef POSIX_SPAWN_SETSID
+	flags |= POSIX_SPAWN_SETSID;
+#endif
+	posix_spawnattr_setflags(&attr, flags);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	/* undo what executor_main() ignores */
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	err = posix_spawnp(pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return(err);
+}
+
+/* Create a pipe for the input of a command. Both ends are close-on-exec, so
+ * commands started by other workers meanwhile do not hold on to them.
+ */
+static int input_pipe(int fds[2])
+{
+#ifdef HAVE_PIPE2
+	return(pipe2(fds, O_CLOEXEC));
+#else
+	/* there is a short window here in which another worker may spawn */
+	if(pipe(fds) < 0) {
+		return(-1);
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return(0);
+#endif
+}
+
+/* Write the input of a command to its stdin. A command that exits without
+ * reading all of it is not an error of ours.
+ */
+static void write_input(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while(len > 0) {
+		n = write(fd, data, len);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		data += n;
+		len -= n;
+	}
+	close(fd);
+}
+
+static void run_job(exec_msg_t *msg)
+{
+	char **argv;
+	char *a;
+	int argc = 0, i, nsfd = -1, status, err;
+	int in[2] = {-1, -1};
+	uint64_t started;
+	pid_t pid;
+
+	for(a = msg->args; a < msg->args + msg->len; a += strlen(a) + 1) {
+		argc++;
+	}
+	if((argv = calloc(argc + 1, sizeof(char*))) == NULL) {
+		msg->type = EXEC_FAILED;
+		msg->status = ENOMEM;
+		return;
+	}
+	for(a = msg->args, i = 0; i < argc; a += strlen(a) + 1, i++) {
+		argv[i] = a;
+	}
+
+	/* a network namespace is per thread, so switching only affects this
+	 * worker and the command it starts */
+	if(msg->netns[0]) {
+#ifdef HAVE_SETNS
+		if((nsfd = open(msg->netns, O_RDONLY | O_CLOEXEC)) < 0 || setns(nsfd, CLONE_NEWNET) < 0) {
+			err = errno;
+			if(nsfd >= 0) {
+				close(nsfd);
+			}
+			free(argv);
+			msg->type = EXEC_FAILED;
+			msg->status = err;
+			return;
+		}
+#else
+		free(argv);
+		msg->type = EXEC_FAILED;
+		msg->status = ENOSYS;
+		return;
+#endif
+	}
+
+	started = now_us();
+	if(msg->inlen && input_pipe(in) < 0) {
+		err = errno;
+	} else {
+		err = spawn(&pid, argv, in[0]);
+	}
+	msg->spawn = (unsigned int)(now_us() - started);
+	PROBE4(exec_spawn, msg->name, err ? -1 : (int)pid, err, msg->spawn);
+	free(argv);
+	if(in[0] >= 0) {
+		close(in[0]);
+	}
+
+#ifdef HAVE_SETNS
+	if(nsfd >= 0) {
+		close(nsfd);
+		if(setns(init_nsfd, CLONE_NEWNET) < 0) {
+			/* this worker is no good anymore, the daemon will start a new executor */
+			_exit(1);
+		}
+	}
+#endif
+	if(err) {
+		if(in[1] >= 0) {
+			close(in[1]);
+		}
+		msg->type = EXEC_FAILED;
+		msg->status = err;
+		return;
+	}
+	if(in[1] >= 0) {
+		write_input(in[1], msg->args + msg->len, msg->inlen);
+	}
+	while(waitpid(pid, &status, 0) < 0) {
+		if(errno != EINTR) {
+			status = 0;
+			break;
+		}
+	}
+	PROBE3(exec_exit, msg->name, (int)pid, status);
+	msg->type = EXEC_DONE;
+	msg->status = status;
+}
+
+/* Take the first job of the highest priority whose door is below its
+ * limit off the queue. Called with job_lock held.
+ */
+static job_t* next_job()
+{
+	job_t *job, *prev;
+	int p;
+
+	for(p = 0; p < EXEC_PRIOS; p++) {
+		for(prev = NULL, job = jobs[p]; job; prev = job, job = job->next) {
+			if(job->door->limit && job->door->running >= job->door->limit) {
+				continue;
+			}
+			if(prev) {
+				prev->next = job->next;
+			} else {
+				jobs[p] = job->next;
+			}
+			if(jobs_tail[p] == job) {
+				jobs_tail[p] = prev;
+			}
+			job_count--;
+			return(job);
+		}
+	}
+	return(NULL);
+}
+
+/* Take the newest start command off the queue, to make room for a stop
+ * command. Called with job_lock held.
+ */
+static job_t* drop_newest_start()
+{
+	job_t *job = jobs[EXEC_PRIO_START], *prev = NULL;
+
+	if(job == NULL) {
+		return(NULL);
+	}
+	while(job->next) {
+		prev = job;
+		job = job->next;
+	}
+	if(prev) {
+		prev->next = NULL;
+	} else {
+		jobs[EXEC_PRIO_START] = NULL;
+	}
+	jobs_tail[EXEC_PRIO_START] = prev;
+	job_count--;
+	return(job);
+}
+
+/* Find the slots of a door, creating them if needed. Called with job_lock
+ * held.
+ */
+static door_slots_t* find_door(const char *name)
+{
+	door_slots_t *d;
+
+	for(d = door_slots; d; d = d->next) {
+		if(!strcmp(d->name, name)) {
+			return(d);
+		}
+	}
+	if((d = calloc(1, sizeof(door_slots_t))) == NULL) {
+		return(NULL);
+	}
+	strcpy(d->name, name);
+	d->next = door_slots;
+	door_slots = d;
+	return(d);
+}
+
+/* Send a job back to the daemon as refused
+ */
+static void refuse(exec_msg_t *msg, int err, unsigned int queued)
+{
+	msg->type = EXEC_FAILED;
+	msg->status = err;
+	msg->inlen = 0;
+	msg->queued = queued;
+	send(job_sock, msg, sizeof(exec_msg_t) + msg->len, MSG_NOSIGNAL);
+}
+
+static void* worker(void *arg)
+{
+	job_t *job;
+	exec_msg_t *msg;
+
+	while(1) {
+		pthread_mutex_lock(&job_lock);
+		while((job = next_job()) == NULL) {
+			if(job_count == 0 && job_closing) {
+				/* closing and nothing left to do */
+				pthread_mutex_unlock(&job_lock);
+				return(NULL);
+			}
+			pthread_cond_wait(&job_cond, &job_lock);
+		}
+		job->door->running++;
+		msg = job->msg;
+		msg->wait = (unsigned int)(now_ms() - job->queued);
+		pthread_mutex_unlock(&job_lock);
+
+		run_job(msg);
+		/* the daemon has no use for the input */
+		msg->inlen = 0;
+
+		pthread_mutex_lock(&job_lock);
+		job->door->running--;
+		if(job->door->limit) {
+			/* a job held back by the limit of the door may go now */
+			pthread_cond_broadcast(&job_cond);
+		}
+		msg->queued = job_count;
+		pthread_mutex_unlock(&job_lock);
+		send(job_sock, msg, sizeof(exec_msg_t) + msg->len, MSG_NOSIGNAL);
+		free(msg);
+		free(job);
+	}
+	return(NULL);
+}
+
+/* Body of the executor process: queue the jobs read from the socket until
+ * the daemon closes it, then let the workers finish what is queued.
+ */
+static void executor_main(unsigned int nworkers, unsigned int queue)
+{
+	pthread_t *threads;
+	exec_msg_t *buf;
+	job_t *job, *victim;
+	unsigned int i, started = 0;
+	ssize_t n;
+
+	/* the daemon handles these and tells us what to do; it closes the
+	 * socket when it wants us gone */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+
+	job_size = queue ? queue : 1;
+	threads = calloc(nworkers ? nworkers : 1, sizeof(pthread_t));
+	buf = malloc(EXEC_MSG_MAX);
+	if(threads == NULL || buf == NULL) {
+		_exit(1);
+	}
+#ifdef HAVE_SETNS
+	/* workers come back here after running a command in another namespace */
+	init_nsfd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+#endif
+	for(i = 0; i < nworkers || i == 0; i++) {
+		if(pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+			break;
+		}
+		started++;
+	}
+	if(started == 0) {
+		_exit(1);
+	}
+
+	while(1) {
+		n = recv(job_sock, buf, EXEC_MSG_MAX, 0);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			break;
+		}
+		if(n < (ssize_t)sizeof(exec_msg_t) || buf->type != EXEC_RUN ||
+				buf->len == 0 || buf->len > EXEC_MSG_MAX || buf->inlen > EXEC_MSG_MAX ||
+				n != (ssize_t)(sizeof(exec_msg_t) + buf->len + buf->inlen) ||
+				buf->args[buf->len-1] != '\0') {
+			continue;
+		}
+		buf->name[sizeof(buf->name)-1] = '\0';
+		buf->netns[sizeof(buf->netns)-1] = '\0';
+		if(buf->prio < 0 || buf->prio >= EXEC_PRIOS) {
+			buf->prio = EXEC_PRIO_START;
+		}
+
+		victim = NULL;
+		pthread_mutex_lock(&job_lock);
+		if(job_count == job_size &&
+				(buf->prio != EXEC_PRIO_STOP || (victim = drop_newest_start()) == NULL)) {
+			pthread_mutex_unlock(&job_lock);
+			refuse(buf, ENOBUFS, job_size);
+			continue;
+		}
+		if((job = malloc(sizeof(job_t))) == NULL || (job->msg = malloc(n)) == NULL ||
+				(job->door = find_door(buf->name)) == NULL) {
+			pthread_mutex_unlock(&job_lock);
+			if(job) {
+				free(job->msg);
+				free(job);
+			}
+			refuse(buf, ENOMEM, job_count);
+			continue;
+		}
+		memcpy(job->msg, buf, n);
+		job->door->limit = buf->limit;
+		job->queued = now_ms();
+		job->next = NULL;
+		if(jobs_tail[buf->prio]) {
+			jobs_tail[buf->prio]->next = job;
+		} else {
+			jobs[buf->prio] = job;
+		}
+		jobs_tail[buf->prio] = job;
+		job_count++;
+		pthread_cond_signal(&job_cond);
+		pthread_mutex_unlock(&job_lock);
+		if(victim) {
+			/* pushed out by the stop command */
+			refuse(victim->msg, ENOBUFS, job_size);
+			free(victim->msg);
+			free(victim);
+		}
+	}
+
+	pthread_mutex_lock(&job_lock);
+	job_closing = 1;
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+	for(i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	/* don't flush stdio buffers inherited from the daemon */
+	_exit(0);
+}
+
+/* Fork the executor process with the given number of workers and queue
+ * slots. An executor that is still running is stopped first. Stop jobs
+ * still held back are dropped along with those the old executor had; the
+ * caller knows them by their cookies and sends them again. Returns
+ * non-zero on error.
+ */
+int executor_start(unsigned int workers, unsigned int queue)
+{
+	held_t *h;
+	int sv[2];
+
+	executor_stop(NULL);
+	while((h = held) != NULL) {
+		held = h->next;
+		free(h->msg);
+		free(h);
+	}
+	held_tail = NULL;
+	stats.held = 0;
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		return(1);
+	}
+	exec_pid = fork();
+	if(exec_pid < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return(1);
+	}
+	if(exec_pid == 0) {
+		close(sv[0]);
+		job_sock = sv[1];
+		executor_main(workers, queue);
+	}
+	close(sv[1]);
+	exec_sock = sv[0];
+	stats.queued = stats.pending = 0;
+	return(0);
+}
+
+/* Send the held stop jobs in order, as far as the socket takes them.
+ * Returns non-zero if the socket failed otherwise than by being full.
+ */
+static int send_held(int flags)
+{
+	held_t *h;
+
+	while((h = held) != NULL) {
+		if(send(exec_sock, h->msg, h->size, flags | MSG_NOSIGNAL) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return(errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS);
+		}
+		stats.sent[h->msg->prio]++;
+		stats.pending++;
+		stats.held--;
+		held = h->next;
+		if(held == NULL) {
+			held_tail = NULL;
+		}
+		free(h->msg);
+		free(h);
+	}
+	return(0);
+}
+
+/* Let the executor finish the jobs it has and wait for it to exit. Stop
+ * jobs still held back are handed over first, waiting for room if need
+ * be. The results of the jobs, those of the held ones included, are passed
+ * to fn (if not NULL) as they come in; jobs without a result were not run.
+ */
+void executor_stop(executor_result_fn fn)
+{
+	struct pollfd pfd;
+
+	if(exec_sock >= 0) {
+		while(held && !send_held(MSG_DONTWAIT) && held) {
+			pfd.fd = exec_sock;
+			pfd.events = POLLIN | POLLOUT;
+			if((poll(&pfd, 1, -1) < 0 && errno != EINTR) ||
+					((pfd.revents & ~POLLOUT) && executor_read(fn))) {
+				break;
+			}
+		}
+		/* the executor sees the end of the socket, runs what it has queued
+		 * and exits, which ends the results */
+		shutdown(exec_sock, SHUT_WR);
+		pfd.fd = exec_sock;
+		pfd.events = POLLIN;
+		while(!executor_read(fn)) {
+			if(poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+				break;
+			}
+		}
+		close(exec_sock);
+		exec_sock = -1;
+	}
+	if(exec_pid > 0) {
+		while(waitpid(exec_pid, NULL, 0) < 0 && errno == EINTR);
+		exec_pid = -1;
+	}
+}
+
+/* File descriptor to poll for results
+ */
+int executor_fd()
+{
+	return(exec_sock);
+}
+
+/* Non-zero if stop jobs are held back, waiting for the socket to take
+ * them; the caller then polls executor_fd() for POLLOUT too and calls
+ * executor_flush() when it is writable.
+ */
+int executor_held()
+{
+	return(held != NULL);
+}
+
+void executor_flush()
+{
+	if(exec_sock >= 0) {
+		send_held(MSG_DONTWAIT);
+	}
+}
+
+/* Hand a command (packed argv strings, see exec_msg_t) to the executor,
+ * along with inlen bytes of input for its stdin. Without input the command
+ * keeps the executor's stdin. prio is EXEC_PRIO_STOP or EXEC_PRIO_START, limit
+ * the number of commands of the door that may run at once (0 = no limit),
+ * cookie comes back with the result. This never blocks. If the socket is
+ * full a start job is refused, while a stop job is held back and sent as
+ * soon as there is room, behind any held before it; a stop job is never
+ * lost to a full socket, or else its door would stay open. Stop jobs are
+ * held back the same way while there is no executor, until
+ * executor_start(). Returns non-zero (with errno set) on error.
+ */
+int executor_run(const char *name, const char *netns, const char *args, size_t len,
+		const char *input, size_t inlen, int prio, unsigned int limit, uint64_t cookie)
+{
+	exec_msg_t *msg;
+	held_t *h;
+	size_t size = sizeof(exec_msg_t) + len + inlen;
+
+	if(exec_sock < 0 && prio != EXEC_PRIO_STOP) {
+		errno = ENOTCONN;
+		return(1);
+	}
+	if(len == 0 || args[len-1] != '\0' || size > EXEC_MSG_MAX ||
+			strlen(netns) >= sizeof(msg->netns)) {
+		errno = len ? ENAMETOOLONG : EINVAL;
+		return(1);
+	}
+	if((msg = calloc(1, size)) == NULL) {
+		return(1);
+	}
+	msg->type = EXEC_RUN;
+	strncpy(msg->name, name, sizeof(msg->name)-1);
+	strcpy(msg->netns, netns);
+	msg->prio = prio;
+	msg->limit = limit;
+	msg->sent = now_us();
+	msg->cookie = cookie;
+	msg->len = len;
+	msg->inlen = inlen;
+	memcpy(msg->args, args, len);
+	if(inlen) {
+		memcpy(msg->args + len, input, inlen);
+	}
+	if(exec_sock >= 0 && (prio != EXEC_PRIO_STOP || held == NULL)) {
+		if(send(exec_sock, msg, size, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+			stats.sent[prio]++;
+			stats.pending++;
+			free(msg);
+			return(0);
+		}
+		if(prio != EXEC_PRIO_STOP ||
+				(errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)) {
+			stats.rejected[prio]++;
+			free(msg);
+			return(1);
+		}
+	}
+	if((h = malloc(sizeof(held_t))) == NULL) {
+		free(msg);
+		return(1);
+	}
+	h->next = NULL;
+	h->size = size;
+	h->msg = msg;
+	if(held_tail) {
+		held_tail->next = h;
+	} else {
+		held = h;
+	}
+	held_tail = h;
+	stats.held++;
+	return(0);
+}
+
+static void count_result(const exec_msg_t *msg)
+{
+	if(msg->type == EXEC_FAILED && msg->status == ENOBUFS) {
+		stats.rejected[msg->prio]++;
+	} else {
+		stats.done[msg->prio]++;
+		stats.wait_total[msg->prio] += msg->wait;
+		if(msg->wait > stats.wait_max[msg->prio]) {
+			stats.wait_max[msg->prio] = msg->wait;
+		}
+	}
+	stats.queued = msg->queued;
+	if(stats.pending) {
+		stats.pending--;
+	}
+}
+
+/* Pass every result waiting on the socket to fn. Returns non-zero if the
+ * executor has gone away.
+ */
+int executor_read(executor_result_fn fn)
+{
+	ssize_t n;
+
+	if(result == NULL && (result = malloc(EXEC_MSG_MAX)) == NULL) {
+		return(0);
+	}
+	while(1) {
+		n = recv(exec_sock, result, EXEC_MSG_MAX, MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return(errno != EAGAIN && errno != EWOULDBLOCK);
+		}
+		if(n == 0) {
+			return(1);
+		}
+		if(n >= (ssize_t)sizeof(exec_msg_t) && result->inlen == 0 &&
+				n == (ssize_t)(sizeof(exec_msg_t) + result->len) &&
+				(result->type == EXEC_DONE || result->type == EXEC_FAILED) &&
+				result->prio >= 0 && result->prio < EXEC_PRIOS) {
+			result->name[sizeof(result->name)-1] = '\0';
+			count_result(result);
+			if(fn) {
+				fn(result);
+			}
+		}
+	}
+}
+
+void executor_get_stats(exec_stats_t *s)
+{
+	*s = stats;
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,93 @@
+/*
+ *  executor.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_EXECUTOR_H
+#define _PAC_EXECUTOR_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The executor is a long-lived process, forked at startup and again should
+ * it go away, that runs door commands for the daemon. Jobs are sent to it
+ * over a socketpair and run by a fixed number of worker threads; jobs beyond
+ * that wait in a bounded queue, stop commands ahead of start commands. A
+ * door may also limit how many of its commands run at once; its jobs beyond
+ * that wait without holding up those of other doors. Commands are argv
+ * vectors started with posix_spawn(), no shell is involved unless the argv
+ * says so, and may be given input on their stdin. The outcome of every job
+ * is sent back to the daemon, which does all the logging.
+ */
+#define EXEC_NAME_MAX 128
+#define EXEC_MSG_MAX  65536           /* largest message, argv and input included */
+
+typedef struct exec_msg {
+	int type;                       /* EXEC_RUN, EXEC_DONE or EXEC_FAILED */
+	int status;                     /* wait status (EXEC_DONE) or errno (EXEC_FAILED) */
+	char name[EXEC_NAME_MAX];       /* door name, for logging */
+	char netns[PATH_MAX];           /* namespace file to run in, "" = ours */
+	int prio;                       /* EXEC_PRIO_STOP or EXEC_PRIO_START */
+	unsigned int limit;             /* commands of the door run at once, 0 = no limit */
+	unsigned int wait;              /* ms the job was queued (EXEC_DONE, EXEC_FAILED) */
+	unsigned int queued;            /* jobs queued when the result was sent */
+	uint64_t sent;                  /* us on CLOCK_MONOTONIC when executor_run() sent the job */
+	unsigned int spawn;             /* us it took to start the command (EXEC_DONE) */
+	uint64_t cookie;                /* the caller's, passed back with the result */
+	size_t len;                     /* size of the argv strings */
+	size_t inlen;                   /* size of the input following them */
+	char args[];                    /* argv strings, each terminated by a NUL, then the input */
+} exec_msg_t;
+
+#define EXEC_RUN    1
+#define EXEC_DONE   2
+#define EXEC_FAILED 3   /* the command could not be started */
+
+/* queued stop commands run first and may push out the newest start
+ * command when the queue is full */
+#define EXEC_PRIO_STOP  0
+#define EXEC_PRIO_START 1
+#define EXEC_PRIOS      2
+
+typedef struct exec_stats {
+	unsigned long sent[EXEC_PRIOS];
+	unsigned long rejected[EXEC_PRIOS]; /* queue full, or socket full (start jobs) */
+	unsigned long done[EXEC_PRIOS];     /* run, or failed to start */
+	unsigned long wait_total[EXEC_PRIOS]; /* ms, of the jobs done */
+	unsigned int wait_max[EXEC_PRIOS];
+	unsigned int queued;                /* as of the last result */
+	unsigned int pending;               /* sent, no result yet */
+	unsigned int held;                  /* stop jobs waiting for room on the socket */
+} exec_stats_t;
+
+typedef void (*executor_result_fn)(const exec_msg_t *msg);
+
+int executor_start(unsigned int workers, unsigned int queue);
+void executor_stop(executor_result_fn fn);
+int executor_fd();
+int executor_held();
+void executor_flush();
+int executor_run(const char *name, const char *netns, const char *args, size_t len,
+		const char *input, size_t inlen, int prio, unsigned int limit, uint64_t cookie);
+int executor_read(executor_result_fn fn);
+void executor_get_stats(exec_stats_t *stats);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
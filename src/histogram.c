@@ -0,0 +1,113 @@
+/*
+ *  histogram.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "histogram.h"
+
+#define SUB_COUNT (1 << HIST_SUB_BITS)
+
+static unsigned int bucket_of(uint64_t v)
+{
+	unsigned int mag;
+
+	if(v < SUB_COUNT) {
+		return((unsigned int)v);
+	}
+	if(v >= (uint64_t)1 << HIST_MAX_BITS) {
+		return(HIST_BUCKETS - 1);
+	}
+	mag = 63 - __builtin_clzll(v);
+	return(((mag - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (mag - HIST_SUB_BITS)) & (SUB_COUNT - 1)));
+}
+
+/* Highest value that falls into bucket i
+ */
+static uint64_t bucket_top(unsigned int i)
+{
+	unsigned int mag, sub;
+
+	if(i < SUB_COUNT) {
+		return(i);
+	}
+	mag = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = i & (SUB_COUNT - 1);
+	return((((uint64_t)(SUB_COUNT + sub + 1)) << (mag - HIST_SUB_BITS)) - 1);
+}
+
+void histogram_record(histogram_t *h, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	while(value > max &&
+			!__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		;
+	}
+}
+
+/* The value percentile percent of the recorded ones are at or below, as the
+ * top of its bucket (but not above the largest value recorded). 0 if there
+ * are none.
+ */
+uint64_t histogram_percentile(const histogram_t *h, double percentile)
+{
+	unsigned long count = histogram_count(h), seen = 0, rank;
+	unsigned int i;
+	uint64_t top;
+
+	if(count == 0) {
+		return(0);
+	}
+	rank = (unsigned long)(percentile / 100.0 * count + 0.5);
+	if(rank == 0) {
+		rank = 1;
+	}
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if(seen >= rank) {
+			break;
+		}
+	}
+	if(i >= HIST_BUCKETS - 1) {
+		return(histogram_max(h));
+	}
+	top = bucket_top(i);
+	return(top < histogram_max(h) ? top : histogram_max(h));
+}
+
+unsigned long histogram_count(const histogram_t *h)
+{
+	return(__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+uint64_t histogram_mean(const histogram_t *h)
+{
+	unsigned long count = histogram_count(h);
+
+	return(count ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count : 0);
+}
+
+uint64_t histogram_max(const histogram_t *h)
+{
+	return(__atomic_load_n(&h->max, __ATOMIC_RELAXED));
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,51 @@
+/*
+ *  histogram.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_HISTOGRAM_H
+#define _PAC_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* A log-linear histogram in the style of HdrHistogram: values below
+ * 2^HIST_SUB_BITS get a bucket each, every power of two above that is split
+ * into 2^HIST_SUB_BITS linear buckets, so a value is known to within 1/16th
+ * of itself. Values up to 2^HIST_MAX_BITS are told apart, larger ones share
+ * the last bucket. Recording is a few relaxed atomic adds and takes no lock.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct histogram {
+	unsigned long count;
+	uint64_t sum;
+	uint64_t max;
+	unsigned long buckets[HIST_BUCKETS];
+} histogram_t;
+
+void histogram_record(histogram_t *h, uint64_t value);
+uint64_t histogram_percentile(const histogram_t *h, double percentile);
+unsigned long histogram_count(const histogram_t *h);
+uint64_t histogram_mean(const histogram_t *h);
+uint64_t histogram_max(const histogram_t *h);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
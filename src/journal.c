@@ -0,0 +1,421 @@
+/*
+ *  journal.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC       "knockd journal 1\n"
+#define JOURNAL_RECORD_MAX  (1 << 20)   /* largest payload accepted on replay */
+#define JOURNAL_COMPACT_MIN 1024        /* records before compaction is worth it */
+
+typedef struct record_hdr {
+	uint32_t crc;       /* of the rest of the header and the payload */
+	uint32_t type;
+	uint64_t id;
+	int64_t expires;
+	uint32_t len;       /* size of the payload */
+	uint32_t pad;
+} record_hdr_t;
+
+/* an OPEN record found on replay */
+typedef struct entry {
+	uint64_t id;
+	time_t expires;
+	const char *data;
+	size_t len;
+	int closed;
+} entry_t;
+
+static int fd = -1;
+static int new_fd = -1;             /* journal being compacted into, -1 = none */
+static char *jpath = NULL;
+static char *buf = NULL;            /* records not written yet */
+static size_t buflen, bufsize;
+static unsigned int records;        /* records in the journal */
+static unsigned int live;           /* jobs opened and not closed yet */
+static unsigned int old_records, old_live;
+static uint64_t last_id;            /* highest job id seen on replay */
+
+static uint32_t crc32(uint32_t crc, const unsigned char *p, size_t len)
+{
+	int i;
+
+	crc = ~crc;
+	while(len--) {
+		crc ^= *p++;
+		for(i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+		}
+	}
+	return(~crc);
+}
+
+static uint32_t record_crc(const record_hdr_t *hdr, const void *data)
+{
+	uint32_t crc;
+
+	crc = crc32(0, (const unsigned char*)hdr + sizeof(hdr->crc), sizeof(record_hdr_t) - sizeof(hdr->crc));
+	return(crc32(crc, data, hdr->len));
+}
+
+static int write_all(int f, const char *p, size_t len)
+{
+	ssize_t n;
+
+	while(len > 0) {
+		if((n = write(f, p, len)) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return(1);
+		}
+		p += n;
+		len -= n;
+	}
+	return(0);
+}
+
+/* Make a new or renamed file in the journal's directory durable
+ */
+static int sync_dir()
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int d, ret;
+
+	strncpy(dir, jpath, sizeof(dir)-1);
+	dir[sizeof(dir)-1] = '\0';
+	if((slash = strrchr(dir, '/')) == NULL) {
+		strcpy(dir, ".");
+	} else if(slash == dir) {
+		dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+	if((d = open(dir, O_RDONLY | O_CLOEXEC)) < 0) {
+		return(1);
+	}
+	ret = fsync(d);
+	close(d);
+	return(ret != 0);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const entry_t *x = a, *y = b;
+
+	return(x->id < y->id ? -1 : x->id > y->id);
+}
+
+/* Walk the records in mem from the magic up to size. Returns the offset of
+ * the first record that is torn or corrupt (or size). With entries NULL the
+ * OPEN records are collected in *found, otherwise EXTEND and CLOSE records
+ * are applied to the sorted entries.
+ */
+static size_t scan(const char *mem, size_t size, entry_t **found, unsigned int *count, entry_t *entries)
+{
+	size_t off = strlen(JOURNAL_MAGIC);
+	record_hdr_t hdr;
+	entry_t key, *e;
+
+	while(off + sizeof(hdr) <= size) {
+		memcpy(&hdr, mem + off, sizeof(hdr));
+		if(hdr.len > JOURNAL_RECORD_MAX || off + sizeof(hdr) + hdr.len > size ||
+				hdr.crc != record_crc(&hdr, mem + off + sizeof(hdr))) {
+			break;
+		}
+		if(entries == NULL && hdr.type == JOURNAL_OPEN) {
+			if((*count & (*count - 1)) == 0) {
+				e = realloc(*found, (*count ? *count * 2 : 64) * sizeof(entry_t));
+				if(e == NULL) {
+					return(0);
+				}
+				*found = e;
+			}
+			e = &(*found)[(*count)++];
+			e->id = hdr.id;
+			e->expires = (time_t)hdr.expires;
+			e->data = mem + off + sizeof(hdr);
+			e->len = hdr.len;
+			e->closed = 0;
+		} else if(entries && (hdr.type == JOURNAL_EXTEND || hdr.type == JOURNAL_CLOSE)) {
+			key.id = hdr.id;
+			if((e = bsearch(&key, entries, *count, sizeof(entry_t), entry_cmp)) != NULL) {
+				if(hdr.type == JOURNAL_EXTEND) {
+					e->expires = (time_t)hdr.expires;
+				} else {
+					e->closed = 1;
+				}
+			}
+		}
+		if(hdr.id > last_id) {
+			last_id = hdr.id;
+		}
+		records++;
+		off += sizeof(hdr) + hdr.len;
+	}
+	return(off);
+}
+
+/* Open (or create) the journal at path and pass every job still pending in
+ * it to fn. A torn record at the end, left by a crash, is cut off. Returns
+ * non-zero (with errno set) on error, eg, if path is not a journal.
+ */
+int journal_open(const char *path, journal_replay_fn fn, void *arg)
+{
+	struct stat st;
+	char *mem = NULL;
+	entry_t *entries = NULL;
+	unsigned int count = 0, i;
+	size_t end, magic = strlen(JOURNAL_MAGIC);
+	ssize_t n;
+	int err;
+
+	journal_close();
+	if((jpath = strdup(path)) == NULL) {
+		return(1);
+	}
+	if((fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0 || fstat(fd, &st) < 0) {
+		goto fail;
+	}
+	records = live = 0;
+	last_id = 0;
+	if(st.st_size == 0) {
+		if(write_all(fd, JOURNAL_MAGIC, magic) || fsync(fd) || sync_dir()) {
+			goto fail;
+		}
+		return(0);
+	}
+
+	if((mem = malloc(st.st_size)) == NULL) {
+		goto fail;
+	}
+	for(end = 0; end < (size_t)st.st_size; end += n) {
+		if((n = pread(fd, mem + end, st.st_size - end, end)) <= 0) {
+			if(n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if(n == 0) {
+				errno = EIO;
+			}
+			goto fail;
+		}
+	}
+	if((size_t)st.st_size < magic || memcmp(mem, JOURNAL_MAGIC, magic)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	if((end = scan(mem, st.st_size, &entries, &count, NULL)) == 0) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	qsort(entries, count, sizeof(entry_t), entry_cmp);
+	records = 0;
+	scan(mem, end, &entries, &count, entries);
+	if(end < (size_t)st.st_size && (ftruncate(fd, end) < 0 || fsync(fd) < 0)) {
+		goto fail;
+	}
+
+	for(i = 0; i < count; i++) {
+		if(!entries[i].closed) {
+			live++;
+			fn(entries[i].id, entries[i].expires, entries[i].data, entries[i].len, arg);
+		}
+	}
+	free(entries);
+	free(mem);
+	return(0);
+
+fail:
+	err = errno;
+	free(entries);
+	free(mem);
+	journal_close();
+	errno = err;
+	return(1);
+}
+
+/* Write what is buffered and close the journal
+ */
+void journal_close()
+{
+	if(fd >= 0) {
+		journal_sync();
+		close(fd);
+		fd = -1;
+	}
+	free(jpath);
+	jpath = NULL;
+	free(buf);
+	buf = NULL;
+	buflen = bufsize = 0;
+}
+
+int journal_enabled()
+{
+	return(fd >= 0);
+}
+
+/* Highest job id in the journal when it was opened, including jobs that are
+ * done. New jobs have to use higher ones.
+ */
+uint64_t journal_last_id()
+{
+	return(last_id);
+}
+
+/* Buffer a record. It is written on the next journal_sync(). Returns
+ * non-zero if out of memory.
+ */
+int journal_append(int type, uint64_t id, time_t expires, const void *data, size_t len)
+{
+	record_hdr_t hdr;
+	char *p;
+	size_t size;
+
+	if(fd < 0) {
+		return(0);
+	}
+	if(buflen + sizeof(hdr) + len > bufsize) {
+		for(size = bufsize ? bufsize : 4096; size < buflen + sizeof(hdr) + len; size *= 2);
+		if((p = realloc(buf, size)) == NULL) {
+			return(1);
+		}
+		buf = p;
+		bufsize = size;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = type;
+	hdr.id = id;
+	hdr.expires = expires;
+	hdr.len = len;
+	hdr.crc = record_crc(&hdr, data);
+	memcpy(buf + buflen, &hdr, sizeof(hdr));
+	if(len) {
+		memcpy(buf + buflen + sizeof(hdr), data, len);
+	}
+	buflen += sizeof(hdr) + len;
+	records++;
+	if(type == JOURNAL_OPEN) {
+		live++;
+	} else if(type == JOURNAL_CLOSE && live) {
+		live--;
+	}
+	return(0);
+}
+
+/* Write the buffered records and fsync() them, all at once. If that fails,
+ * the file is cut back to where it ended, as a torn record would end the
+ * replay there, and the records stay buffered for the next call. Returns
+ * non-zero (with errno set) on error.
+ */
+int journal_sync()
+{
+	int f = new_fd >= 0 ? new_fd : fd;
+	off_t end;
+	int err;
+
+	if(f < 0 || buflen == 0) {
+		return(0);
+	}
+	if((end = lseek(f, 0, SEEK_END)) < 0) {
+		return(1);
+	}
+	if(write_all(f, buf, buflen) || fsync(f)) {
+		err = errno;
+		while(ftruncate(f, end) < 0 && errno == EINTR);
+		errno = err;
+		return(1);
+	}
+	buflen = 0;
+	return(0);
+}
+
+/* Returns non-zero if most of the journal is jobs that are done
+ */
+int journal_needs_compaction()
+{
+	return(fd >= 0 && new_fd < 0 && records > JOURNAL_COMPACT_MIN && records > live * 4);
+}
+
+/* Start writing a new journal. The caller then appends an OPEN record for
+ * every pending job and calls journal_end_compaction(), which replaces the
+ * old journal with the new one. Returns non-zero (with errno set) on error.
+ */
+int journal_begin_compaction()
+{
+	char tmp[PATH_MAX];
+
+	if(fd < 0 || journal_sync()) {
+		return(1);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.new", jpath);
+	if((new_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+		return(1);
+	}
+	if(write_all(new_fd, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC))) {
+		close(new_fd);
+		new_fd = -1;
+		unlink(tmp);
+		return(1);
+	}
+	old_records = records;
+	old_live = live;
+	records = live = 0;
+	return(0);
+}
+
+int journal_end_compaction()
+{
+	char tmp[PATH_MAX];
+	int err;
+
+	if(new_fd < 0) {
+		return(1);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.new", jpath);
+	if(journal_sync() || rename(tmp, jpath) < 0) {
+		err = errno;
+		close(new_fd);
+		new_fd = -1;
+		unlink(tmp);
+		/* the records were for the new journal, the old one has them */
+		buflen = 0;
+		records = old_records;
+		live = old_live;
+		errno = err;
+		return(1);
+	}
+	sync_dir();
+	close(fd);
+	fd = new_fd;
+	new_fd = -1;
+	return(0);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,56 @@
+/*
+ *  journal.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_JOURNAL_H
+#define _PAC_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* An append-only file of the stop jobs knockd has pending, so that doors
+ * opened before a restart or crash still get closed. Every job is an OPEN
+ * record with an opaque payload, followed by EXTEND records when its expiry
+ * moves and a CLOSE record once it has run. Records are buffered and written
+ * with one fsync() per journal_sync(). Each carries a CRC, and a torn record
+ * at the end of the file is cut off when the journal is opened.
+ *
+ * Expiry times are wall clock times, as the monotonic clock does not survive
+ * a reboot.
+ */
+#define JOURNAL_OPEN   1
+#define JOURNAL_EXTEND 2
+#define JOURNAL_CLOSE  3
+
+typedef void (*journal_replay_fn)(uint64_t id, time_t expires, const void *data, size_t len, void *arg);
+
+int journal_open(const char *path, journal_replay_fn fn, void *arg);
+void journal_close();
+int journal_enabled();
+uint64_t journal_last_id();
+int journal_append(int type, uint64_t id, time_t expires, const void *data, size_t len);
+int journal_sync();
+int journal_needs_compaction();
+int journal_begin_compaction();
+int journal_end_compaction();
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
@@ -18,6 +18,10 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #if __APPLE__
 /* In MacOSX 10.5+, the daemon function is deprecated and will give a warning.
  * This nasty hack which is used by Apple themselves in mDNSResponder does
@@ -34,6 +38,8 @@
 #include <limits.h>
 #include <netdb.h>
 #include <pcap.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -57,6 +63,26 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "list.h"
+#include "prefix.h"
+#include "offender.h"
+#include "ratelimit.h"
+#include "executor.h"
+#include "cmdtmpl.h"
+#include "nftset.h"
+#include "xdpgate.h"
+#include "timerq.h"
+#include "lease.h"
+#include "journal.h"
+#include "plugin.h"
+#include "evstream.h"
+#include "eventlog.h"
+#include "resolver.h"
+#include "metrics.h"
+#include "admin.h"
+#include "trace.h"
+#include "probes.h"
+#include "logring.h"
+#include "util.h"
 // This must come before otp.h
 #include "shared_structs.h"
 #ifdef HAVE_OPENSSL_SHA_H
@@ -73,6 +99,31 @@ static char version[] = "0.8.0";
 #define SEQ_TIMEOUT		25 /* default knock timeout in seconds */
 #define CMD_TIMEOUT		10 /* default timeout in seconds between start and stop commands */
 #define SEQ_MAX			32 /* maximum number of ports in a knock sequence */
+#define SCAN_WINDOW		60   /* default window (seconds) for counting failed knocks */
+#define SCAN_BLOCK		600  /* default time (seconds) a scanner is suppressed */
+#define SCAN_TABLE_SIZE		4096 /* default number of sources tracked for scanner suppression */
+#define RATE_TABLE_SIZE		4096 /* default number of sources tracked for rate limiting */
+#define EXEC_WORKERS			8    /* default number of commands run at the same time */
+#define EXEC_QUEUE_SIZE		1024 /* default number of commands waiting for a worker */
+#define XDP_TABLE_SIZE		16384 /* default number of grants an XDP gate holds */
+#define EVENT_QUEUE_SIZE	65536 /* default bytes of events queued per subscriber */
+#define LOG_QUEUE_SIZE		1024  /* default number of log messages waiting to be written */
+#define EVENT_LOG_SIZE		4194304 /* default size of an event log file */
+#define EVENT_LOG_FILES		4     /* default number of event log files */
+#define LOOKUP_CACHE_SIZE	1024  /* default number of DNS names cached for --lookup */
+#define TRACE_RECORDS		8192 /* default number of flight recorder records kept per thread */
+#define CAPTURE_STATS_INTERVAL	60 /* default seconds between two checks of the capture statistics */
+#define CAPTURE_DROP_THRESHOLD	1  /* default percentage of dropped packets that grows the capture buffer */
+#define CAPTURE_BUFFER_DEFAULT	2097152 /* what libpcap uses when no buffer size is set */
+#define EXEC_RESTART_DELAY	1000 /* ms before an executor that went away is started again */
+#define EXEC_RESTART_MAX	60000 /* ms the delay grows to for an executor that keeps going away */
+#define STOP_RETRY_DELAY	1000 /* ms before a stop command or event refused by a full queue is tried again */
+#define OVERLAP_MAX		16 /* packets with the same time told apart when a capture is replaced */
+#define TARGET_FILTER_MAX	64 /* max. number of target/ACL prefixes spelled out in the pcap filter */
+
+/* values stored in a door's source ACL */
+#define ACL_DENY		0
+#define ACL_ALLOW		1
 
 typedef enum _flag_stat {
 	DONT_CARE,  /* 0 */
@@ -80,20 +131,44 @@ typedef enum _flag_stat {
 	NOT_SET     /* 2 */
 } flag_stat;
 
+struct listener;
+
 //
 // TO-DO: Add the singular open door port struct to this struct
 //
 /* knock/event tuples */
 typedef struct opendoor {
 	char name[128];
+	char netns[64];           /* network namespace, "" = the one we were started in */
+	char iface[32];           /* interface, "" = the global default */
+	struct listener *listener;
 	unsigned short seqcount;
 	unsigned short sequence[SEQ_MAX];
 	unsigned short protocol[SEQ_MAX];
 	char *target;
+	prefix_set_t *target_set;
+	prefix_set_t *allow_set;  /* allow/deny directives as given, merged into acl */
+	prefix_set_t *deny_set;
+	prefix_set_t *acl;        /* source ACL, longest match wins (NULL = allow all) */
 	time_t seq_timeout;
 	char *start_command;
 	time_t cmd_timeout;
 	char *stop_command;
+	int shell;                /* run commands through the shell: 1, 0, -1 = if needed */
+	unsigned int exec_limit;  /* commands of the door run at once, 0 = no limit */
+	cmdtmpl_t *start_tmpl;
+	cmdtmpl_t *stop_tmpl;
+	nftset_t *nft_set;        /* set to add knockers to, NULL = none */
+	unsigned short xdp_count; /* ports the XDP gate keeps closed until knocked */
+	unsigned short xdp_port[SEQ_MAX];
+	unsigned short xdp_proto[SEQ_MAX];
+	unsigned int batch_window; /* ms to gather knockers for one command, 0 = run at once */
+	struct batch *batch;      /* knockers gathered so far, NULL = none */
+	char plugin_name[PLUGIN_NAME_MAX]; /* Action = plugin:<name> <args>, "" = none */
+	char *plugin_args;
+	plugin_t *plugin;
+	unsigned int event_id;    /* door id in the event log */
+	metrics_door_t *metrics;
 	flag_stat flag_fin;
 	flag_stat flag_syn;
 	flag_stat flag_rst;
@@ -103,7 +178,7 @@ typedef struct opendoor {
 	FILE *one_time_sequences_fd;
 	char *pcap_filter_exp;
 } opendoor_t;
-PMList *doors = NULL;
+PMList *doors = NULL;	/* doors read from the config, until assign_doors() hands them out */
 
 /* we keep one list of knock attempts per IP address,
  * and increment the stage as they progress through the sequence.
@@ -112,19 +187,107 @@ typedef struct knocker {
 	opendoor_t *door;
 	short stage;
 	char src[16];   /* IP address */
+	uint32_t srcaddr; /* IP address, host byte order */
 	char *srchost;  /* Hostname */
 	time_t seq_start;
+	uint64_t last_knock; /* us since the epoch of the last knock that advanced the attempt */
+	uint64_t decided; /* us since the epoch the sequence was found complete */
 } knocker_t;
-PMList *attempts = NULL;
+
+/* a stop command or XDP grant waiting for the cmd_timeout of its door to pass
+ */
+typedef struct stop_job {
+	char name[128];
+	char src[16];
+	char *srchost;
+	char *netns;    /* namespace file, "" = ours */
+	char *args;     /* expanded stop command, NULL = none */
+	size_t len;
+	char *input;    /* stdin of the stop command, NULL = none */
+	size_t inlen;
+	unsigned int exec_limit;
+	uint32_t addr;  /* source, host byte order */
+	char xdp_netns[64];
+	char xdp_iface[32];
+	unsigned short xdp_count;
+	unsigned short xdp_port[SEQ_MAX];
+	unsigned short xdp_proto[SEQ_MAX];
+	plugin_t *plugin;
+	knockd_event_t *event; /* stop event for the plugin, NULL = none */
+	lease_t *lease;  /* lease the job ends, NULL = none */
+	uint64_t id;     /* journal id, 0 = not journaled yet */
+	int retry;       /* only the command is left to run */
+	struct stop_job *next; /* in running_stops */
+} stop_job_t;
+timerq_t *stop_timers = NULL;
+stop_job_t *running_stops = NULL; /* commands handed to the executor, no result yet */
+uint64_t journal_id = 0;	/* last journal id handed out */
+
+/* a stop job as stored in the journal, followed by srchost, netns, args,
+ * input and the args of the plugin event
+ */
+typedef struct job_record {
+	char name[128];
+	char src[16];
+	uint32_t addr;
+	int32_t leased;
+	int64_t opened;
+	uint32_t renewals;
+	char xdp_netns[64];
+	char xdp_iface[32];
+	uint16_t xdp_count;
+	uint16_t xdp_port[SEQ_MAX];
+	uint16_t xdp_proto[SEQ_MAX];
+	char plugin[PLUGIN_NAME_MAX]; /* plugin of the stop event, "" = none */
+	int64_t time;
+	uint32_t timeout;
+	uint16_t seqcount;
+	uint16_t sequence[SEQ_MAX];
+	uint16_t protocol[SEQ_MAX];
+	uint32_t hostlen;   /* sizes of what follows, strings with their NUL */
+	uint32_t nslen;
+	uint32_t len;
+	uint32_t inlen;
+	uint32_t argslen;
+	uint32_t exec_limit;
+} job_record_t;
+lease_table_t *leases = NULL;	/* doors open per source, see open_door() */
+
+/* knockers of a door with a batch window, waiting for the window to close
+ */
+typedef struct batch {
+	opendoor_t *door; /* NULL once the door is gone */
+	char *addrs;      /* addresses, one per line */
+	size_t len;
+	unsigned int count;
+	time_t time;      /* time of the first knock */
+	uint64_t decided; /* us since the epoch the first knocker was let in */
+} batch_t;
+timerq_t *batch_timers = NULL;
 
 /* function prototypes */
 void dprint(char *fmt, ...);
 void vprint(char *fmt, ...);
 void logprint(char *fmt, ...);
 void dprint_sequence(opendoor_t *door, char *fmt, ...);
-void cleanup(int signum);
+void cleanup(int code);
 void child_exit(int signum);
 void reload(int signum);
+void dump_stats(int signum);
+int dump_trace();
+void print_lease(lease_t *lease, void *arg);
+void print_plugin(const char *name, const plugin_stats_t *stats, void *arg);
+void print_subscriber(long pid, unsigned long queued, unsigned long dropped, size_t pending, void *arg);
+void render_metrics(metrics_buf_t *buf);
+void print_latency(const char *name, const metrics_door_t *door, void *arg);
+void print_funnel(const char *name, const metrics_door_t *door, void *arg);
+void admin_command(admin_buf_t *out, int argc, char **argv);
+void admin_attempts(admin_buf_t *out, uint32_t addr, int all);
+void admin_lease(lease_t *lease, void *arg);
+void admin_close_lease(lease_t *lease, void *arg);
+void admin_doors(admin_buf_t *out);
+int admin_flush(uint32_t addr);
+void signal_flag(int signum);
 void ver();
 void usage(int exit_code);
 char* strtoupper(char *str);
@@ -136,14 +299,48 @@ int get_new_one_time_sequence(opendoor_t *door);
 long get_next_one_time_sequence(opendoor_t *door);
 int disable_used_one_time_sequence(opendoor_t *door);
 long get_current_one_time_sequence_position(opendoor_t *door);
-void generate_pcap_filter();
+void generate_pcap_filter(struct listener *l);
 size_t realloc_strcat(char **dest, const char *src, size_t size);
 void close_door(opendoor_t *door);
 char* get_ip(const char *iface, char *buf, int bufsize);
-size_t parse_cmd(char *dest, size_t size, const char *command, const char *src);
-int exec_cmd(char *command, char *name);
+int exec_cmd(const char *args, size_t len, const char *name, const char *netns,
+		const char *input, size_t inlen, int prio, unsigned int limit, uint64_t cookie);
+void exec_result(const exec_msg_t *msg);
+void open_door(knocker_t *attempt, const struct timeval *ts);
+stop_job_t* run_commands(knocker_t *attempt, const struct timeval *ts);
+stop_job_t* start_door(opendoor_t *door, const cmd_vars_t *vars, const char *src, const char *srchost,
+		const char *input, size_t inlen);
+stop_job_t* new_stop_job(opendoor_t *door, const char *src, const char *srchost);
+void schedule_stop(stop_job_t *job, uint64_t due);
+void add_to_batch(knocker_t *attempt, const struct timeval *ts);
+void run_batch(batch_t *batch);
+void run_batch_timers(uint64_t now);
+void add_to_nft_set(knocker_t *attempt);
+knockd_event_t* notify_plugin(knocker_t *attempt, const struct timeval *ts);
+int send_event(plugin_t *plugin, const knockd_event_t *event, const char *src);
+int grant_xdp(knocker_t *attempt);
+void revoke_xdp(stop_job_t *job);
+int update_xdp_gate(struct listener *l);
+int parse_xdp_ports(char *list, opendoor_t *door);
+void run_stop_timers(uint64_t now);
+void stop_done(uint64_t id, int refused);
+uint64_t batch_expires(stop_job_t *job);
+void retry_running_stops();
+void free_running_stops();
+void free_stop_job(stop_job_t *job);
+void journal_job(stop_job_t *job, uint64_t due);
+void replay_job(uint64_t id, time_t expires, const void *data, size_t len, void *arg);
+void compact_journal();
+time_t wall_time(uint64_t due);
+uint64_t tv_usecs(const struct timeval *tv);
+void note_latency(metrics_door_t *door, int step, uint64_t from, uint64_t to);
+int netns_path(const char *netns, char *buf, size_t size);
 void sniff(u_char *arg, const struct pcap_pkthdr *hdr, const u_char *packet);
-int target_strcmp(char *ip, char *target);
+int parse_prefix_list(char *list, prefix_set_t **set, opendoor_t *door);
+int compile_acl(opendoor_t *door);
+int compile_command(opendoor_t *door, const char *command, cmdtmpl_t **tmpl);
+int target_match(opendoor_t *door, uint32_t addr);
+int acl_match(opendoor_t *door, uint32_t addr);
 
 /* list of IP addresses for given interface
  */
@@ -151,7 +348,57 @@ typedef struct ip_literal {
 	struct ip_literal *next;
 	char *value;
 } ip_literal_t;
-ip_literal_t *myips = NULL;
+
+/* packets counted by a capture, see pcap_stats(3pcap) */
+typedef struct capture_counts {
+	unsigned long recv;
+	unsigned long drop;       /* dropped by the kernel for lack of buffer space */
+	unsigned long ifdrop;     /* dropped by the interface or its driver */
+} capture_counts_t;
+
+/* a packet capture on one interface in one network namespace, together with
+ * the doors bound to it and the knock attempts in progress there
+ */
+typedef struct listener {
+	char netns[64];           /* "" = the namespace we were started in */
+	char iface[32];
+	int nsfd;                 /* namespace to run commands in, -1 = ours */
+	pcap_t *cap;
+	int lltype;
+	unsigned int buffer;      /* kernel capture buffer in bytes, 0 = libpcap's default */
+	unsigned int grown;       /* times the capture was reopened with a larger buffer */
+	struct pcap_stat last;    /* pcap_stats() of cap when last read */
+	capture_counts_t total;   /* over all captures opened on iface */
+	capture_counts_t window;  /* since the last check of the drop rate */
+	struct timeval overlap;   /* packets up to this time came from the replaced capture */
+	uint32_t overlap_seen[OVERLAP_MAX]; /* packets it had at that very time, see packet_hash() */
+	unsigned int noverlap;
+	ip_literal_t *myips;      /* IP addresses of iface */
+	prefix_set_t *myip_set;   /* the same addresses, compiled for matching in sniff() */
+	PMList *doors;
+	PMList *attempts;
+	int nft_sock;             /* netlink socket for nft sets, -1 = not opened yet */
+	xdpgate_t *xdp;           /* XDP gate on iface, NULL = no door protects ports */
+} listener_t;
+PMList *listeners = NULL;
+int init_nsfd = -1;         /* the namespace we were started in */
+
+listener_t* find_listener(const char *netns, const char *iface);
+int open_listener(listener_t *l);
+pcap_t* open_capture(listener_t *l, unsigned int buffer);
+void read_capture_stats(listener_t *l);
+void check_captures();
+void grow_capture(listener_t *l);
+void sniff_replaced(u_char *arg, const struct pcap_pkthdr *hdr, const u_char *packet);
+uint32_t packet_hash(const struct pcap_pkthdr *hdr, const u_char *packet);
+int seen_on_replaced(listener_t *l, const struct pcap_pkthdr *hdr, const u_char *packet);
+void close_listener(listener_t *l);
+void flush_attempts(listener_t *l);
+int assign_doors();
+const char* listener_name(listener_t *l);
+int event_loop();
+int enter_netns(const char *netns);
+void leave_netns();
 
 // Global variables
 int  o_usesyslog = 0;
@@ -159,20 +406,49 @@ int  o_verbose   = 0;
 int  o_debug     = 0;
 int  o_daemon    = 0;
 int  o_lookup    = 0;
+unsigned int o_scan_threshold = 0;	/* failed knocks before a source is suppressed (0 = off) */
+time_t o_scan_window = SCAN_WINDOW;
+time_t o_scan_block  = SCAN_BLOCK;
+unsigned int o_scan_table_size = SCAN_TABLE_SIZE;
+ratelimit_spec_t o_packet_rate = {0, 1000, 0};	/* per-source packet rate (0 = unlimited) */
+ratelimit_spec_t o_open_rate   = {0, 1000, 0};	/* per-source door openings */
+unsigned int o_rate_table_size = RATE_TABLE_SIZE;
+unsigned int o_exec_workers    = EXEC_WORKERS;
+unsigned int o_exec_queue_size = EXEC_QUEUE_SIZE;
+unsigned int o_xdp_table_size  = XDP_TABLE_SIZE;
+unsigned int o_event_queue_size = EVENT_QUEUE_SIZE;
+unsigned int o_log_queue_size = LOG_QUEUE_SIZE;
+unsigned long o_event_log_size = EVENT_LOG_SIZE;
+unsigned int o_event_log_files = EVENT_LOG_FILES;
+unsigned int o_lookup_cache_size = LOOKUP_CACHE_SIZE;
+unsigned int o_capture_buffer = 0;	/* kernel capture buffer in bytes (0 = libpcap's default) */
+unsigned int o_capture_buffer_max = 0;	/* grow the capture buffer up to this size on drops (0 = never) */
+unsigned int o_capture_stats_interval = CAPTURE_STATS_INTERVAL;	/* seconds, 0 = never check */
+unsigned int o_capture_drop_threshold = CAPTURE_DROP_THRESHOLD;
+int o_log_block = 0;	/* wait for room in the log queue instead of dropping */
 char o_int[32]           = "";		/* default (eth0) is set after parseconfig() */
 char o_cfg[PATH_MAX]     = "/etc/knockd.conf";
 char o_pidfile[PATH_MAX] = "/var/run/knockd.pid";
 char o_logfile[PATH_MAX] = "";
-int  lltype = -1;
-pcap_t *cap = NULL;
-FILE *logfd = NULL;
+char o_journal[PATH_MAX] = "";	/* journal of pending stop commands, "" = none */
+char o_event_socket[PATH_MAX] = "";	/* socket for event subscribers, "" = none */
+char o_event_log[PATH_MAX] = "";	/* binary event log files, "" = none */
+char o_metrics_socket[PATH_MAX] = "";	/* socket serving metrics, "" = none */
+unsigned short o_metrics_port = 0;	/* loopback TCP port serving metrics, 0 = none */
+char o_admin_socket[PATH_MAX] = "";	/* control socket, "" = none */
+char o_trace_file[PATH_MAX] = "/var/tmp/knockd.trace";	/* where the flight recorder is dumped */
+unsigned int o_trace_records = TRACE_RECORDS;
+volatile sig_atomic_t reload_pending = 0;
+volatile sig_atomic_t stats_pending  = 0;
+volatile sig_atomic_t reopen_pending = 0;
+volatile sig_atomic_t trace_pending  = 0;
+volatile sig_atomic_t quit_pending   = 0;	/* signal asking us to exit */
 
 int main(int argc, char **argv)
 {
-	struct ifaddrs *ifaddr, *ifa;
-	ip_literal_t *myip;
-	char pcapErr[PCAP_ERRBUF_SIZE] = "";
+	PMList *lp;
 	int opt, ret, optidx = 1;
+	char err[256];
 
 	static struct option opts[] =
 	{
@@ -220,6 +496,11 @@ int main(int argc, char **argv)
 	if(parseconfig(o_cfg)) {
 		usage(1);
 	}
+	if(offender_init(o_scan_threshold, o_scan_window, o_scan_block, o_scan_table_size) ||
+			ratelimit_init(&o_packet_rate, &o_open_rate, o_rate_table_size)) {
+		perror("malloc");
+		exit(1);
+	}
 
 	/* set o_int to a default value if it has not been set by the -i switch nor by
 	 * the config file */
@@ -229,26 +510,388 @@ int main(int argc, char **argv)
 	if(o_usesyslog) {
 		openlog("knockd", 0, LOG_USER);
 	}
-	if(strlen(o_logfile)) {
-		/* open the log file */
-		logfd = fopen(o_logfile, "a");
-		if(logfd == NULL) {
-			perror("warning: cannot open logfile");
+	logring_set_syslog(o_usesyslog);
+	if(logring_set_file(o_logfile)) {
+		perror("warning: cannot open logfile");
+	}
+
+	/* open a capture for every interface/namespace pair used by a door */
+	if(assign_doors()) {
+		cleanup(1);
+	}
+
+	if(o_daemon) {
+		FILE *pidfp;
+		if(daemon(0, 0) < 0) {
+			perror("daemon");
+			cleanup(1);
+		}
+		/* write our PID to the pidfile*/
+		if((pidfp = fopen(o_pidfile, "w"))) {
+			fprintf(pidfp, "%d\n", getpid());
+			fclose(pidfp);
+		} else {
+			dprint("could not create pid file %s: %s\n", o_pidfile, strerror(errno));
+			logprint("could not create pid file %s: %s", o_pidfile, strerror(errno));
 		}
 	}
 
-	/* 50ms timeout for packet capture. See pcap(3pcap) manpage, which
-	 * recommends that a timeout of 0 not be used. */
-	cap = pcap_open_live(o_int, 65535, 0, 50, pcapErr);
-	if(strlen(pcapErr)) {
-		fprintf(stderr, "could not open %s: %s\n", o_int, pcapErr);
+	/* log messages are written by a thread of their own from here on */
+	if(logring_start(o_log_queue_size, o_log_block)) {
+		perror("logring");
+		cleanup(1);
 	}
-	if(cap == NULL) {
-		exit(1);
+	atexit(logring_stop);
+	trace_init(o_trace_records);
+
+	/* door commands are run by a separate process, forked here */
+	if((stop_timers = timerq_new()) == NULL || (batch_timers = timerq_new()) == NULL ||
+			(leases = lease_table_new()) == NULL) {
+		perror("malloc");
+		cleanup(1);
+	}
+	if(executor_start(o_exec_workers, o_exec_queue_size)) {
+		perror("executor");
+		cleanup(1);
+	}
+	/* plugin threads would not survive daemon(), so they start here */
+	if(plugin_start(err, sizeof(err))) {
+		fprintf(stderr, "error: cannot load plugin: %s\n", err);
+		logprint("error: cannot load plugin: %s", err);
+		cleanup(1);
+	}
+	/* pick up the doors a previous run left open */
+	if(o_journal[0]) {
+		unsigned int restored = 0;
+		if(journal_open(o_journal, replay_job, &restored)) {
+			fprintf(stderr, "error: cannot open journal %s: %s\n", o_journal, strerror(errno));
+			logprint("error: cannot open journal %s: %s", o_journal, strerror(errno));
+			cleanup(1);
+		}
+		if(journal_last_id() > journal_id) {
+			journal_id = journal_last_id();
+		}
+		if(restored) {
+			vprint("restored %u pending stop commands from %s\n", restored, o_journal);
+			logprint("restored %u pending stop commands from %s", restored, o_journal);
+		}
+	}
+	if(o_event_socket[0] && evstream_open(o_event_socket, o_event_queue_size)) {
+		fprintf(stderr, "error: cannot listen on %s: %s\n", o_event_socket, strerror(errno));
+		logprint("error: cannot listen on %s: %s", o_event_socket, strerror(errno));
+		cleanup(1);
+	}
+	/* names for --lookup are resolved by threads, which have to start here */
+	if(o_lookup && resolver_start(o_lookup_cache_size)) {
+		perror("resolver");
+		cleanup(1);
+	}
+	if((o_metrics_socket[0] || o_metrics_port) && metrics_open(o_metrics_socket, o_metrics_port, render_metrics)) {
+		fprintf(stderr, "error: cannot serve metrics: %s\n", strerror(errno));
+		logprint("error: cannot serve metrics: %s", strerror(errno));
+		cleanup(1);
+	}
+	if(o_admin_socket[0] && admin_open(o_admin_socket, admin_command)) {
+		fprintf(stderr, "error: cannot listen on %s: %s\n", o_admin_socket, strerror(errno));
+		logprint("error: cannot listen on %s: %s", o_admin_socket, strerror(errno));
+		cleanup(1);
 	}
+	if(o_event_log[0] && eventlog_open(o_event_log, o_event_log_size, o_event_log_files)) {
+		fprintf(stderr, "error: cannot open event log %s: %s\n", o_event_log, strerror(errno));
+		logprint("error: cannot open event log %s: %s", o_event_log, strerror(errno));
+		cleanup(1);
+	}
+
+	signal(SIGINT, signal_flag);
+	signal(SIGTERM, signal_flag);
+	signal(SIGCHLD, child_exit);
+	signal(SIGHUP, signal_flag);
+	signal(SIGUSR1, signal_flag);
+	signal(SIGUSR2, signal_flag);
+	if(o_daemon) {
+		/* in the foreground it comes with every resize of the terminal */
+		signal(SIGWINCH, signal_flag);
+	}
+
+	for(lp = listeners; lp; lp = lp->next) {
+		vprint("listening on %s...\n", listener_name((listener_t*)lp->data));
+		logprint("starting up, listening on %s", listener_name((listener_t*)lp->data));
+	}
+	ret = event_loop();
+	dprint("bailed out of main loop! (ret=%d)\n", ret);
+
+	cleanup(quit_pending);
+	/* notreached */
+	exit(0);
+}
+
+/* Wait for packets on all listeners and feed them to sniff(). Reloads and
+ * statistics requested by signals, stop commands that are due and results
+ * from the executor are handled here, between two batches of packets.
+ * Returns when a capture fails or on SIGINT/SIGTERM.
+ */
+int event_loop()
+{
+	struct pollfd *pfds = NULL;
+	listener_t **ls = NULL;
+	PMList *lp;
+	int i, n, ret, timeout;
+	unsigned int nev, nmet, nadm;
+	uint64_t now, next, capture_check = 0;
+	uint64_t exec_started = now_ms(), exec_restart = 0;
+	unsigned int exec_delay = 0;
+
+	while(1) {
+		if(quit_pending) {
+			free(pfds);
+			free(ls);
+			return(0);
+		}
+		if(reload_pending) {
+			reload_pending = 0;
+			reload(SIGHUP);
+		}
+		if(stats_pending) {
+			stats_pending = 0;
+			dump_stats(SIGUSR1);
+		}
+		if(trace_pending) {
+			trace_pending = 0;
+			dump_trace();
+		}
+		if(reopen_pending) {
+			reopen_pending = 0;
+			vprint("Re-opening log file: %s\n", o_logfile);
+			logprint("Re-opening log file: %s", o_logfile);
+			if(logring_set_file(o_logfile)) {
+				perror("warning: cannot open logfile");
+			}
+		}
+
+		now = now_ms();
+		if(executor_fd() < 0 && now >= exec_restart) {
+			if(executor_start(o_exec_workers, o_exec_queue_size)) {
+				perror("executor");
+				cleanup(1);
+			}
+			exec_started = now;
+			/* those it had, and those held back meanwhile */
+			retry_running_stops();
+		}
+		run_batch_timers(now);
+		run_stop_timers(now);
+		if(o_capture_stats_interval && now >= capture_check) {
+			check_captures();
+			capture_check = now + o_capture_stats_interval * 1000ULL;
+		}
+		/* one write and fsync for all that happened since the last pass */
+		if(journal_needs_compaction()) {
+			compact_journal();
+		}
+		if(journal_sync()) {
+			fprintf(stderr, "error: cannot write journal %s: %s\n", o_journal, strerror(errno));
+			logprint("error: cannot write journal %s: %s", o_journal, strerror(errno));
+		}
+		timeout = -1;
+		next = timerq_next(stop_timers);
+		if(timerq_next(batch_timers) && (next == 0 || timerq_next(batch_timers) < next)) {
+			next = timerq_next(batch_timers);
+		}
+		if(o_capture_stats_interval && (next == 0 || capture_check < next)) {
+			next = capture_check;
+		}
+		next = sooner(next, evstream_next_expiry());
+		next = sooner(next, metrics_next_expiry());
+		next = sooner(next, admin_next_expiry());
+		if(executor_fd() < 0) {
+			next = sooner(next, exec_restart);
+		}
+		if(next) {
+			timeout = next <= now ? 0 : next - now > INT_MAX ? INT_MAX : (int)(next - now);
+		}
+
+		/* the set of listeners may change on reload, the executor, event
+		 * subscribers, metrics and admin clients go last */
+		n = list_count(listeners);
+		nev = evstream_npollfds();
+		nmet = metrics_npollfds();
+		nadm = admin_npollfds();
+		pfds = realloc(pfds, (n + 1 + nev + nmet + nadm) * sizeof(struct pollfd));
+		ls = realloc(ls, (n + 1) * sizeof(listener_t*));
+		if(pfds == NULL || ls == NULL) {
+			perror("realloc");
+			cleanup(1);
+		}
+		for(lp = listeners, i = 0; lp; lp = lp->next, i++) {
+			ls[i] = (listener_t*)lp->data;
+			pfds[i].fd = pcap_get_selectable_fd(ls[i]->cap);
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+		pfds[n].fd = executor_fd();
+		pfds[n].events = POLLIN | (executor_held() ? POLLOUT : 0);
+		pfds[n].revents = 0;
+		evstream_pollfds(pfds + n + 1);
+		metrics_pollfds(pfds + n + 1 + nev);
+		if(nadm) {
+			admin_pollfds(pfds + n + 1 + nev + nmet);
+		}
+
+		ret = poll(pfds, n + 1 + nev + nmet + nadm, timeout);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+		if(pfds[n].revents & POLLOUT) {
+			executor_flush();
+		}
+		if((pfds[n].revents & ~POLLOUT) && executor_read(exec_result)) {
+			/* one that keeps going away right after it was started is
+			 * restarted less and less often */
+			executor_stop(NULL);
+			now = now_ms();
+			if(exec_delay && now - exec_started < EXEC_RESTART_MAX) {
+				exec_delay = exec_delay * 2 > EXEC_RESTART_MAX ? EXEC_RESTART_MAX : exec_delay * 2;
+			} else {
+				exec_delay = EXEC_RESTART_DELAY;
+			}
+			exec_restart = now + exec_delay;
+			vprint("executor went away, restarting it in %u ms\n", exec_delay);
+			logprint("executor went away, restarting it in %u ms", exec_delay);
+		}
+		if(nev) {
+			evstream_handle(pfds + n + 1);
+		}
+		if(nmet) {
+			metrics_handle(pfds + n + 1 + nev);
+		}
+		if(nadm) {
+			admin_handle(pfds + n + 1 + nev + nmet);
+		}
+		for(i = 0; i < n; i++) {
+			if(pfds[i].revents == 0) {
+				continue;
+			}
+			ret = pcap_dispatch(ls[i]->cap, -1, sniff, (u_char*)ls[i]);
+			if(ret < 0) {
+				pcap_perror(ls[i]->cap, "pcap");
+				free(pfds);
+				free(ls);
+				return(ret);
+			}
+		}
+	}
+	free(pfds);
+	free(ls);
+	return(-1);
+}
 
-	lltype = pcap_datalink(cap);
-	switch(lltype) {
+/* Describe a listener for log messages
+ */
+const char* listener_name(listener_t *l)
+{
+	static char name[128];
+
+	if(l->netns[0]) {
+		snprintf(name, sizeof(name), "%s (netns %s)", l->iface, l->netns);
+	} else {
+		snprintf(name, sizeof(name), "%s", l->iface);
+	}
+	return(name);
+}
+
+listener_t* find_listener(const char *netns, const char *iface)
+{
+	PMList *lp;
+
+	for(lp = listeners; lp; lp = lp->next) {
+		listener_t *l = (listener_t*)lp->data;
+		if(!strcmp(l->netns, netns) && !strcmp(l->iface, iface)) {
+			return(l);
+		}
+	}
+	return(NULL);
+}
+
+/* Path of the file for a network namespace, which is either a name created
+ * by "ip netns add" or an absolute path. "" stays "".
+ */
+int netns_path(const char *netns, char *buf, size_t size)
+{
+	if(netns[0] == '\0' || netns[0] == '/') {
+		return(snprintf(buf, size, "%s", netns));
+	}
+	return(snprintf(buf, size, "/var/run/netns/%s", netns));
+}
+
+/* Switch the calling thread to the given network namespace (see
+ * netns_path()). Returns the namespace fd, or -1 on error.
+ */
+int enter_netns(const char *netns)
+{
+#ifdef HAVE_SETNS
+	char path[PATH_MAX];
+	int fd;
+
+	if(init_nsfd < 0 && (init_nsfd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)) < 0) {
+		perror("/proc/self/ns/net");
+		return(-1);
+	}
+	netns_path(netns, path, sizeof(path));
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		perror(path);
+		return(-1);
+	}
+	if(setns(fd, CLONE_NEWNET) < 0) {
+		fprintf(stderr, "error: cannot enter network namespace %s: %s\n", netns, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+#else
+	fprintf(stderr, "error: network namespaces are not supported on this system\n");
+	return(-1);
+#endif
+}
+
+/* Go back to the namespace we were started in
+ */
+void leave_netns()
+{
+#ifdef HAVE_SETNS
+	if(init_nsfd >= 0 && setns(init_nsfd, CLONE_NEWNET) < 0) {
+		fprintf(stderr, "error: cannot return to the initial network namespace: %s\n", strerror(errno));
+		cleanup(1);
+	}
+#endif
+}
+
+/* Open the packet capture of a listener and collect the IP addresses of its
+ * interface. Both happen inside the listener's network namespace, the capture
+ * socket stays bound to it afterwards. Returns non-zero on error.
+ */
+int open_listener(listener_t *l)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	ip_literal_t *myip;
+	int ret = 1;
+
+	l->nsfd = -1;
+	l->nft_sock = -1;
+	if(l->netns[0] && (l->nsfd = enter_netns(l->netns)) < 0) {
+		return(1);
+	}
+
+	if((l->cap = open_capture(l, o_capture_buffer)) == NULL) {
+		goto out;
+	}
+	l->buffer = o_capture_buffer;
+
+	l->lltype = pcap_datalink(l->cap);
+	switch(l->lltype) {
 		case DLT_EN10MB:
 			dprint("ethernet interface detected\n");
 			break;
@@ -261,21 +904,24 @@ int main(int argc, char **argv)
 			dprint("raw interface detected, no encapsulation\n");
 			break;
 		default:
-			fprintf(stderr, "error: unsupported link-layer type: %d\n", lltype);
-			cleanup(1);
-			break;
+			fprintf(stderr, "error: unsupported link-layer type: %d\n", l->lltype);
+			goto out;
 	}
 
 	/* get our local IP addresses */
+	if((l->myip_set = prefix_set_new()) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
 	if(getifaddrs(&ifaddr) != 0) {
-		fprintf(stderr, "error: could not get IP address for %s: %s\n", o_int, strerror(errno));
-		cleanup(1);
+		fprintf(stderr, "error: could not get IP address for %s: %s\n", listener_name(l), strerror(errno));
+		goto out;
 	} else {
 		for(ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
 			if (ifa->ifa_addr == NULL)
 				continue;
 
-			if((strcmp(ifa->ifa_name, o_int) == 0) && (ifa->ifa_addr->sa_family == AF_INET)) {
+			if((strcmp(ifa->ifa_name, l->iface) == 0) && (ifa->ifa_addr->sa_family == AF_INET)) {
 				if((myip = calloc(1, sizeof(ip_literal_t))) == NULL) {
 					perror("malloc");
 					exit(1);
@@ -284,13 +930,17 @@ int main(int argc, char **argv)
 					exit(1);
 				} else {
 					if(getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in), myip->value, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0) {
-						fprintf(stderr, "error: could not get IP address for %s: %s\n", o_int, strerror(errno));
+						fprintf(stderr, "error: could not get IP address for %s: %s\n", listener_name(l), strerror(errno));
+						free(myip->value);
+						free(myip);
 						freeifaddrs(ifaddr);
-						cleanup(1);
+						goto out;
 					} else {
-						if(myips)
-							myip->next = myips;
-						myips = myip;
+						if(l->myips)
+							myip->next = l->myips;
+						l->myips = myip;
+						prefix_set_add(l->myip_set,
+								ntohl(((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr), 32, 0);
 						dprint("Local IP: %s\n", myip->value);
 					}
 				}
@@ -298,42 +948,405 @@ int main(int argc, char **argv)
 		}
 		freeifaddrs(ifaddr);
 	}
+	ret = 0;
 
-	generate_pcap_filter();
+out:
+	if(l->netns[0]) {
+		leave_netns();
+	}
+	return(ret);
+}
 
-	if(o_daemon) {
-		FILE *pidfp;
-		if(daemon(0, 0) < 0) {
-			perror("daemon");
-			cleanup(1);
+/* Open a capture on the interface of a listener with a kernel buffer of the
+ * given size (0 = libpcap's default). Has to be called inside the listener's
+ * network namespace. Returns NULL on error.
+ */
+pcap_t* open_capture(listener_t *l, unsigned int buffer)
+{
+	char pcapErr[PCAP_ERRBUF_SIZE] = "";
+	pcap_t *cap;
+	int ret;
+
+	if((cap = pcap_create(l->iface, pcapErr)) == NULL) {
+		fprintf(stderr, "could not open %s: %s\n", listener_name(l), pcapErr);
+		return(NULL);
+	}
+	/* 50ms timeout for packet capture. See pcap(3pcap) manpage, which
+	 * recommends that a timeout of 0 not be used. */
+	pcap_set_snaplen(cap, 65535);
+	pcap_set_promisc(cap, 0);
+	pcap_set_timeout(cap, 50);
+	if(buffer && pcap_set_buffer_size(cap, (int)buffer) != 0) {
+		fprintf(stderr, "warning: cannot set the capture buffer of %s to %u bytes\n", listener_name(l), buffer);
+	}
+	if((ret = pcap_activate(cap)) < 0) {
+		fprintf(stderr, "could not open %s: %s\n", listener_name(l),
+				ret == PCAP_ERROR ? pcap_geterr(cap) : pcap_statustostr(ret));
+		pcap_close(cap);
+		return(NULL);
+	} else if(ret > 0) {
+		fprintf(stderr, "warning: %s: %s\n", listener_name(l), pcap_statustostr(ret));
+	}
+	if(pcap_setnonblock(cap, 1, pcapErr) < 0 || pcap_get_selectable_fd(cap) < 0) {
+		fprintf(stderr, "error: cannot poll capture on %s\n", listener_name(l));
+		pcap_close(cap);
+		return(NULL);
+	}
+	return(cap);
+}
+
+/* Add what the capture of a listener counted since the last call to its
+ * totals and to the current window
+ */
+void read_capture_stats(listener_t *l)
+{
+	struct pcap_stat ps;
+	unsigned int recv, drop, ifdrop;
+
+	if(pcap_stats(l->cap, &ps) < 0) {
+		return;
+	}
+	/* the counters are 32 bits wide and wrap around on busy interfaces */
+	recv = ps.ps_recv - l->last.ps_recv;
+	drop = ps.ps_drop - l->last.ps_drop;
+	ifdrop = ps.ps_ifdrop - l->last.ps_ifdrop;
+	l->last = ps;
+	l->total.recv += recv;
+	l->total.drop += drop;
+	l->total.ifdrop += ifdrop;
+	l->window.recv += recv;
+	l->window.drop += drop;
+	l->window.ifdrop += ifdrop;
+}
+
+/* Check the captures for dropped packets every Capture_Stats_Interval. A
+ * capture that dropped Capture_Drop_Threshold percent or more of what it
+ * received gets a larger buffer, as long as Capture_Buffer_Max allows.
+ */
+void check_captures()
+{
+	PMList *lp;
+	listener_t *l;
+
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		read_capture_stats(l);
+		if(l->window.drop || l->window.ifdrop) {
+			vprint("%s: capture dropped %lu packets, the interface %lu, of %lu received\n", listener_name(l),
+					l->window.drop, l->window.ifdrop, l->window.recv);
+			logprint("%s: capture dropped %lu packets, the interface %lu, of %lu received", listener_name(l),
+					l->window.drop, l->window.ifdrop, l->window.recv);
 		}
-		/* write our PID to the pidfile*/
-		if((pidfp = fopen(o_pidfile, "w"))) {
-			fprintf(pidfp, "%d\n", getpid());
-			fclose(pidfp);
-		} else {
-			dprint("could not create pid file %s: %s\n", o_pidfile, strerror(errno));
-			logprint("could not create pid file %s: %s", o_pidfile, strerror(errno));
+		/* Linux counts dropped packets as received as well, other systems
+		 * don't, so the rate may exceed 100% there */
+		if(l->window.drop && o_capture_buffer_max &&
+				l->window.drop * 100 >= (unsigned long long)o_capture_drop_threshold * l->window.recv) {
+			grow_capture(l);
 		}
+		memset(&l->window, 0, sizeof(l->window));
 	}
+}
 
-	signal(SIGINT, cleanup);
-	signal(SIGTERM, cleanup);
-	signal(SIGCHLD, child_exit);
-	signal(SIGHUP, reload);
+/* Replace the capture of a listener with one that has twice the buffer, up
+ * to Capture_Buffer_Max. Doors and knock attempts stay as they are: the old
+ * capture is read empty before it is closed, and what both captures saw is
+ * only processed once.
+ */
+void grow_capture(listener_t *l)
+{
+	PMList *lp;
+	opendoor_t *door;
+	pcap_t *cap, *old;
+	struct timeval opened;
+	unsigned int size;
+	int fd = -1, n;
 
-	vprint("listening on %s...\n", o_int);
-	logprint("starting up, listening on %s", o_int);
-	ret = 1;
-	while(ret >= 0) {
-		ret = pcap_dispatch(cap, -1, sniff, NULL);
+	size = l->buffer ? l->buffer : CAPTURE_BUFFER_DEFAULT;
+	if(size >= o_capture_buffer_max) {
+		return;
 	}
-	dprint("bailed out of main loop! (ret=%d)\n", ret);
-	pcap_perror(cap, "pcap");
+	size = size > o_capture_buffer_max / 2 ? o_capture_buffer_max : size * 2;
 
-	cleanup(0);
-	/* notreached */
-	exit(0);
+	if(l->netns[0] && (fd = enter_netns(l->netns)) < 0) {
+		return;
+	}
+	gettimeofday(&opened, NULL);
+	cap = open_capture(l, size);
+	if(l->netns[0]) {
+		leave_netns();
+		close(fd);
+	}
+	if(cap == NULL) {
+		vprint("%s: cannot reopen the capture with a %u byte buffer\n", listener_name(l), size);
+		logprint("%s: cannot reopen the capture with a %u byte buffer", listener_name(l), size);
+		return;
+	}
+	vprint("%s: growing the capture buffer to %u bytes\n", listener_name(l), size);
+	logprint("%s: growing the capture buffer to %u bytes", listener_name(l), size);
+
+	/* the new capture needs the filter as well */
+	old = l->cap;
+	l->cap = cap;
+	for(lp = l->doors; lp; lp = lp->next) {
+		door = (opendoor_t*)lp->data;
+		free(door->pcap_filter_exp);
+		door->pcap_filter_exp = NULL;
+	}
+	generate_pcap_filter(l);
+
+	/* one dispatch may not return all that is buffered. Packets from after
+	 * the new capture was opened are on that one as well, so a busy
+	 * interface does not keep us here */
+	timerclear(&l->overlap);
+	l->noverlap = 0;
+	do {
+		n = pcap_dispatch(old, -1, sniff_replaced, (u_char*)l);
+	} while(n > 0 && !timercmp(&l->overlap, &opened, >));
+	if(n < 0) {
+		pcap_perror(old, "pcap");
+	}
+	l->cap = old;
+	read_capture_stats(l);
+	pcap_close(old);
+	l->cap = cap;
+	l->buffer = size;
+	l->grown++;
+	memset(&l->last, 0, sizeof(l->last));
+}
+
+/* pcap callback for a capture that is being replaced: remember the time of
+ * the last packet, and which packets had that time, so the new capture can
+ * skip those and everything before
+ */
+void sniff_replaced(u_char *arg, const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+	listener_t *l = (listener_t*)arg;
+	struct timeval last = l->overlap;
+
+	/* not to be checked against itself */
+	timerclear(&l->overlap);
+	sniff(arg, hdr, packet);
+	l->overlap = hdr->ts;
+	if(timercmp(&hdr->ts, &last, !=)) {
+		l->noverlap = 0;
+	}
+	if(l->noverlap < OVERLAP_MAX) {
+		l->overlap_seen[l->noverlap++] = packet_hash(hdr, packet);
+	}
+}
+
+/* FNV-1a of the length and the headers of a packet, enough to tell apart
+ * the packets captured at the same time
+ */
+uint32_t packet_hash(const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+	uint32_t h = 2166136261U ^ hdr->len;
+	bpf_u_int32 i;
+
+	for(i = 0; i < hdr->caplen && i < 64; i++) {
+		h = (h ^ packet[i]) * 16777619U;
+	}
+	return(h);
+}
+
+/* Returns 1 if a packet of the capture that replaced another one was
+ * processed already, from the replaced one
+ */
+int seen_on_replaced(listener_t *l, const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+	uint32_t h;
+	unsigned int i;
+
+	if(timercmp(&hdr->ts, &l->overlap, <)) {
+		return(1);
+	}
+	if(timercmp(&hdr->ts, &l->overlap, >)) {
+		timerclear(&l->overlap);
+		return(0);
+	}
+	h = packet_hash(hdr, packet);
+	for(i = 0; i < l->noverlap; i++) {
+		if(l->overlap_seen[i] == h) {
+			/* each one only matches once */
+			l->overlap_seen[i] = l->overlap_seen[--l->noverlap];
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/* Drop all knock attempts in progress on a listener
+ */
+void flush_attempts(listener_t *l)
+{
+	PMList *lp;
+
+	for(lp = l->attempts; lp; lp = lp->next) {
+		free(((knocker_t*)lp->data)->srchost);
+	}
+	FREELIST(l->attempts);
+}
+
+/* Close a listener's capture and free it. Its doors must be gone already.
+ */
+void close_listener(listener_t *l)
+{
+	ip_literal_t *myip;
+
+	flush_attempts(l);
+	if(l->cap) {
+		pcap_close(l->cap);
+	}
+	while(l->myips) {
+		myip = l->myips;
+		l->myips = myip->next;
+		free(myip->value);
+		free(myip);
+	}
+	prefix_set_free(l->myip_set);
+	if(l->nsfd >= 0) {
+		close(l->nsfd);
+	}
+	if(l->nft_sock >= 0) {
+		close(l->nft_sock);
+	}
+	xdpgate_detach(l->xdp);
+	free(l);
+}
+
+/* Hand every door read from the config to the listener of its namespace and
+ * interface, opening new listeners as needed and closing those no door uses
+ * anymore. Then (re)generate the pcap filters and XDP gates. Returns non-zero
+ * on error.
+ */
+int assign_doors()
+{
+	PMList *lp, *unused = NULL;
+	opendoor_t *door;
+	listener_t *l;
+	const char *iface;
+
+	for(lp = doors; lp; lp = lp->next) {
+		door = (opendoor_t*)lp->data;
+		iface = door->iface[0] ? door->iface : o_int;
+		if((l = find_listener(door->netns, iface)) == NULL) {
+			if((l = calloc(1, sizeof(listener_t))) == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+			snprintf(l->netns, sizeof(l->netns), "%s", door->netns);
+			snprintf(l->iface, sizeof(l->iface), "%s", iface);
+			if(open_listener(l)) {
+				close_listener(l);
+				return(1);
+			}
+			listeners = list_add(listeners, l);
+		}
+		door->listener = l;
+		door->event_id = eventlog_door(door->name);
+		door->metrics = metrics_door(door->name);
+		l->doors = list_add(l->doors, door);
+		lp->data = NULL;
+	}
+	FREELIST(doors);
+
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		if(l->doors == NULL) {
+			unused = list_add(unused, l);
+		}
+	}
+	for(lp = unused; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		vprint("closing %s, no doors left\n", listener_name(l));
+		logprint("closing %s, no doors left", listener_name(l));
+		listeners = list_remove(listeners, l);
+		close_listener(l);
+		lp->data = NULL;
+	}
+	FREELIST(unused);
+
+	for(lp = listeners; lp; lp = lp->next) {
+		generate_pcap_filter((listener_t*)lp->data);
+		if(update_xdp_gate((listener_t*)lp->data)) {
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/* Protect the ports listed by the doors of a listener with an XDP gate on its
+ * interface, attaching the gate when the first door asks for it and detaching
+ * it when none does anymore. Grants made so far are kept. Returns non-zero on
+ * error.
+ */
+int update_xdp_gate(listener_t *l)
+{
+	unsigned short ports[SEQ_MAX], protos[SEQ_MAX];
+	unsigned int count = 0, i, j;
+	char err[1024];
+	opendoor_t *door;
+	PMList *lp;
+	int nsfd = -1;
+
+	for(lp = l->doors; lp; lp = lp->next) {
+		door = (opendoor_t*)lp->data;
+		for(i = 0; i < door->xdp_count; i++) {
+			for(j = 0; j < count; j++) {
+				if(ports[j] == door->xdp_port[i] && protos[j] == door->xdp_proto[i]) {
+					break;
+				}
+			}
+			if(j < count) {
+				continue;
+			}
+			if(count >= SEQ_MAX) {
+				fprintf(stderr, "error: %s: too many ports protected by XDP\n", listener_name(l));
+				logprint("error: %s: too many ports protected by XDP", listener_name(l));
+				return(1);
+			}
+			ports[count] = door->xdp_port[i];
+			protos[count++] = door->xdp_proto[i];
+		}
+	}
+
+	if(count == 0) {
+		if(l->xdp) {
+			vprint("removing XDP gate from %s\n", listener_name(l));
+			logprint("removing XDP gate from %s", listener_name(l));
+			xdpgate_detach(l->xdp);
+			l->xdp = NULL;
+		}
+		return(0);
+	}
+	if(l->xdp == NULL) {
+		if(l->lltype != DLT_EN10MB) {
+			fprintf(stderr, "error: %s: XDP_Protect needs an ethernet interface\n", listener_name(l));
+			logprint("error: %s: XDP_Protect needs an ethernet interface", listener_name(l));
+			return(1);
+		}
+		if(l->netns[0] && (nsfd = enter_netns(l->netns)) < 0) {
+			return(1);
+		}
+		l->xdp = xdpgate_attach(l->iface, o_xdp_table_size, err, sizeof(err));
+		if(nsfd >= 0) {
+			close(nsfd);
+			leave_netns();
+		}
+		if(l->xdp == NULL) {
+			fprintf(stderr, "error: %s: cannot attach XDP gate: %s\n", listener_name(l), err);
+			logprint("error: %s: cannot attach XDP gate: %s", listener_name(l), err);
+			return(1);
+		}
+		vprint("attached XDP gate to %s\n", listener_name(l));
+		logprint("attached XDP gate to %s", listener_name(l));
+	}
+	if(xdpgate_protect(l->xdp, ports, protos, count)) {
+		fprintf(stderr, "error: %s: cannot update XDP gate: %s\n", listener_name(l), strerror(errno));
+		logprint("error: %s: cannot update XDP gate: %s", listener_name(l), strerror(errno));
+		return(1);
+	}
+	return(0);
 }
 
 void dprint(char *fmt, ...)
@@ -358,132 +1371,668 @@ void vprint(char *fmt, ...)
 	}
 }
 
-/* Output a message to syslog and/or a logfile */
+/* Output a message to syslog and/or a logfile, see logring.c */
 void logprint(char *fmt, ...)
 {
-	char msg[1024];
 	va_list args;
 	va_start(args, fmt);
-	vsnprintf(msg, 1024, fmt, args);
+	logring_vwrite(fmt, args);
 	va_end(args);
-	if(o_usesyslog) {
-		syslog(LOG_NOTICE, "%s", msg);
+}
+
+/* Output current sequence of door for debugging */
+void dprint_sequence(opendoor_t *door, char *fmt, ...)
+{
+	va_list args;
+	int i;
+
+	if(o_debug) {
+		va_start(args, fmt);
+		vprintf(fmt, args);
+		va_end(args);
+		for(i = 0; i < door->seqcount; i++) {
+			switch(door->protocol[i]){
+				case IPPROTO_UDP:
+					printf((i == door->seqcount-1 ? "%u:udp\n" : "%u:udp,"), door->sequence[i]);
+					break;
+				case IPPROTO_TCP: /* fallthrough */
+				default:
+					printf((i == door->seqcount-1 ? "%u:tcp\n" : "%u:tcp,"), door->sequence[i]);
+			}
+		}
+		fflush(stdout);
 	}
-	if(logfd) {
-		time_t t;
-		struct tm *tm;
-		t = time(NULL);
-		tm = localtime(&t);
+}
 
-		fprintf(logfd, "[%04d-%02d-%02d %02d:%02d] %s\n", tm->tm_year+1900,
-			tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, msg);
-		fflush(logfd);
+/* Shut down and exit with status code, from the main thread, never from a
+ * signal handler: SIGINT and SIGTERM only get the event loop to return.
+ */
+void cleanup(int code)
+{
+	listener_t *l;
+	batch_t *batch;
+
+	/* doors are not opened anymore, just to be closed right away */
+	while(batch_timers && (batch = timerq_pop(batch_timers, UINT64_MAX)) != NULL) {
+		if(batch->door) {
+			vprint("%s: dropping a batch of %u knockers\n", batch->door->name, batch->count);
+			logprint("%s: dropping a batch of %u knockers", batch->door->name, batch->count);
+			batch->door->batch = NULL;
+		}
+		free(batch->addrs);
+		free(batch);
+	}
+	/* the next run picks them up from the journal, or else nobody would run
+	 * them after we're gone, so close the doors now */
+	if(journal_enabled()) {
+		if(stop_timers && timerq_count(stop_timers)) {
+			vprint("leaving %u pending stop commands to the journal\n", timerq_count(stop_timers));
+			logprint("leaving %u pending stop commands to the journal", timerq_count(stop_timers));
+		}
+	} else if(stop_timers && timerq_count(stop_timers)) {
+		vprint("running %u pending stop commands early\n", timerq_count(stop_timers));
+		logprint("running %u pending stop commands early", timerq_count(stop_timers));
+		run_stop_timers(UINT64_MAX);
+	}
+
+	vprint("waiting for child processes...\n");
+	logprint("waiting for child processes...");
+	/* the stop jobs the executor reports on are closed as usual, the rest
+	 * stay open in the journal */
+	executor_stop(exec_result);
+	free_running_stops();
+	journal_close();
+	plugin_stop();
+	evstream_close();
+	eventlog_close();
+	resolver_stop();
+	metrics_close();
+	admin_close();
+
+	vprint("closing...\n");
+	logprint("shutting down");
+	if(o_daemon) {
+		unlink(o_pidfile);
+	}
+
+	while(listeners) {
+		l = (listener_t*)listeners->data;
+		listeners = list_remove(listeners, l);
+		while(l->doors) {
+			close_door((opendoor_t*)l->doors->data);
+		}
+		close_listener(l);
+	}
+
+	exit(code);
+}
+
+/* Signal handlers */
+void child_exit(int signum)
+{
+	int status;
+
+	while ( waitpid( (pid_t)-1, &status, WNOHANG ) > 0 ) continue;
+	return;
+}
+
+void reload(int signum)
+{
+	PMList *lp;
+	listener_t *l;
+	int res_cfg;
+	char err[256];
+	unsigned int trace_records = o_trace_records;
+
+	vprint("Re-reading config file: %s\n", o_cfg);
+	logprint("Re-reading config file: %s\n", o_cfg);
+
+	/* attempts refer to the old doors, so they have to go as well */
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		flush_attempts(l);
+		while(l->doors) {
+			close_door((opendoor_t*)l->doors->data);
+		}
+	}
+
+	res_cfg = parseconfig(o_cfg);
+
+	if(res_cfg) {
+		exit(1);
+	}
+	if(o_trace_records != trace_records) {
+		/* the rings of the threads are sized when they start */
+		fprintf(stderr, "config: Trace_Records cannot be changed on reload, restart knockd to change it\n");
+		logprint("config: Trace_Records cannot be changed on reload, restart knockd to change it");
+		o_trace_records = trace_records;
+	}
+	if(offender_init(o_scan_threshold, o_scan_window, o_scan_block, o_scan_table_size) ||
+			ratelimit_init(&o_packet_rate, &o_open_rate, o_rate_table_size)) {
+		perror("malloc");
+		exit(1);
+	}
+
+	vprint("Re-opening log file: %s\n", o_logfile);
+	logprint("Re-opening log file: %s\n", o_logfile);
+
+	/* re-open the log file, the old one is closed once it has all that was
+	 * logged before */
+	logring_set_syslog(o_usesyslog);
+	if(logring_set_file(o_logfile)) {
+		perror("warning: cannot open logfile");
+	}
+
+	/* Fix issue #2 by regenerating the PCAP filter post config file re-read.
+	 * This also opens captures for new namespaces/interfaces */
+	if(assign_doors()) {
+		cleanup(1);
+	}
+	/* doors of a plugin that fails to load drop their events */
+	if(plugin_start(err, sizeof(err))) {
+		fprintf(stderr, "error: cannot load plugin: %s\n", err);
+		logprint("error: cannot load plugin: %s", err);
+	}
+	for(lp = listeners; lp; lp = lp->next) {
+		vprint("listening on %s...\n", listener_name((listener_t*)lp->data));
+		logprint("listening on %s", listener_name((listener_t*)lp->data));
+	}
+
+	return;
+}
+
+/* Signal handler for requests that are served from the event loop
+ */
+void signal_flag(int signum)
+{
+	switch(signum) {
+		case SIGHUP:  reload_pending = 1; break;
+		case SIGUSR1: stats_pending = 1; break;
+		case SIGUSR2: trace_pending = 1; break;
+		case SIGWINCH: reopen_pending = 1; break;
+		case SIGINT:
+		case SIGTERM: quit_pending = signum; break;
+	}
+}
+
+/* Write engine statistics to the log (and stdout if verbose)
+ */
+void dump_stats(int signum)
+{
+	offender_stats_t off;
+	ratelimit_stats_t rl;
+	exec_stats_t ex;
+	logring_stats_t lg;
+	PMList *lp;
+	uint64_t now;
+	int i;
+
+	for(lp = listeners; lp; lp = lp->next) {
+		listener_t *l = (listener_t*)lp->data;
+		vprint("statistics: %s: %d doors, %d knock attempts in progress\n", listener_name(l),
+				list_count(l->doors), list_count(l->attempts));
+		logprint("statistics: %s: %d doors, %d knock attempts in progress", listener_name(l),
+				list_count(l->doors), list_count(l->attempts));
+		read_capture_stats(l);
+		vprint("statistics: %s: capture: %lu packets received, %lu dropped, %lu dropped by the interface, "
+				"%u byte buffer (grown %u times)\n", listener_name(l), l->total.recv, l->total.drop, l->total.ifdrop,
+				l->buffer ? l->buffer : CAPTURE_BUFFER_DEFAULT, l->grown);
+		logprint("statistics: %s: capture: %lu packets received, %lu dropped, %lu dropped by the interface, "
+				"%u byte buffer (grown %u times)", listener_name(l), l->total.recv, l->total.drop, l->total.ifdrop,
+				l->buffer ? l->buffer : CAPTURE_BUFFER_DEFAULT, l->grown);
+	}
+	if(offender_enabled()) {
+		offender_get_stats(&off);
+		vprint("statistics: scanner suppression: %u/%u sources tracked, %lu hits, %lu inserts, %lu evicts\n",
+				off.tracked, off.size, off.hits, off.inserts, off.evicts);
+		logprint("statistics: scanner suppression: %u/%u sources tracked, %lu hits, %lu inserts, %lu evicts",
+				off.tracked, off.size, off.hits, off.inserts, off.evicts);
+	}
+	if(ratelimit_enabled()) {
+		ratelimit_get_stats(&rl);
+		vprint("statistics: rate limiting: %u/%u sources tracked, %lu packets and %lu opens limited\n",
+				rl.tracked, rl.size, rl.packets_limited, rl.opens_limited);
+		logprint("statistics: rate limiting: %u/%u sources tracked, %lu packets and %lu opens limited",
+				rl.tracked, rl.size, rl.packets_limited, rl.opens_limited);
+	}
+	logring_get_stats(&lg);
+	vprint("statistics: log: %lu messages written, %lu dropped, %u/%u queued\n",
+			lg.written, lg.dropped, lg.queued, lg.size);
+	logprint("statistics: log: %lu messages written, %lu dropped, %u/%u queued",
+			lg.written, lg.dropped, lg.queued, lg.size);
+	executor_get_stats(&ex);
+	vprint("statistics: executor: %u commands queued, %u waiting for a result, %u stop commands waiting to be sent\n",
+			ex.queued, ex.pending, ex.held);
+	logprint("statistics: executor: %u commands queued, %u waiting for a result, %u stop commands waiting to be sent",
+			ex.queued, ex.pending, ex.held);
+	for(i = 0; i < EXEC_PRIOS; i++) {
+		const char *what = i == EXEC_PRIO_STOP ? "stop" : "start";
+		unsigned long avg = ex.done[i] ? ex.wait_total[i] / ex.done[i] : 0;
+		vprint("statistics: executor: %s commands: %lu sent, %lu done, %lu rejected, waited %lu ms on average, %u ms at most\n",
+				what, ex.sent[i], ex.done[i], ex.rejected[i], avg, ex.wait_max[i]);
+		logprint("statistics: executor: %s commands: %lu sent, %lu done, %lu rejected, waited %lu ms on average, %u ms at most",
+				what, ex.sent[i], ex.done[i], ex.rejected[i], avg, ex.wait_max[i]);
+	}
+	if(leases) {
+		now = now_ms();
+		vprint("statistics: %u doors open\n", lease_count(leases));
+		logprint("statistics: %u doors open", lease_count(leases));
+		lease_walk(leases, print_lease, &now);
+	}
+	plugin_walk(print_plugin, NULL);
+	if(evstream_enabled()) {
+		evstream_stats_t ev;
+		evstream_get_stats(&ev);
+		vprint("statistics: event stream: %u subscribers, %lu events, %lu records dropped\n",
+				ev.subscribers, ev.published, ev.dropped);
+		logprint("statistics: event stream: %u subscribers, %lu events, %lu records dropped",
+				ev.subscribers, ev.published, ev.dropped);
+		evstream_walk(print_subscriber, NULL);
+	}
+	metrics_door_walk(print_latency, NULL);
+	metrics_door_walk(print_funnel, NULL);
+	if(o_lookup) {
+		resolver_stats_t rs;
+		resolver_get_stats(&rs);
+		vprint("statistics: DNS lookups: %lu names, %lu failures, %lu pending from cache, %lu queued, %lu dropped, "
+				"%lu resolved, %lu failed, %u/%u cached\n", rs.hits, rs.negative, rs.pending, rs.queued, rs.dropped,
+				rs.resolved, rs.failed, rs.cached, rs.size);
+		logprint("statistics: DNS lookups: %lu names, %lu failures, %lu pending from cache, %lu queued, %lu dropped, "
+				"%lu resolved, %lu failed, %u/%u cached", rs.hits, rs.negative, rs.pending, rs.queued, rs.dropped,
+				rs.resolved, rs.failed, rs.cached, rs.size);
+	}
+	if(o_event_log[0]) {
+		eventlog_stats_t el;
+		eventlog_get_stats(&el);
+		vprint("statistics: event log: %lu records, %lu files started, writing %s.%u%s\n",
+				el.written, el.files, o_event_log, el.current, el.failed ? " (failed)" : "");
+		logprint("statistics: event log: %lu records, %lu files started, writing %s.%u%s",
+				el.written, el.files, o_event_log, el.current, el.failed ? " (failed)" : "");
+	}
+}
+
+/* Run a command from the admin socket. Replies are built right here from
+ * the current state; the admin module sends them on as the client reads.
+ */
+void admin_command(admin_buf_t *out, int argc, char **argv)
+{
+	struct in_addr in;
+	uint32_t addr = 0;
+	uint64_t now;
+	void *arg[3];
+	int n;
+
+	/* flush and close need a source, attempts and leases take one */
+	if(!strcmp(argv[0], "flush") || !strcmp(argv[0], "close") ||
+			(argc > 1 && (!strcmp(argv[0], "attempts") || !strcmp(argv[0], "leases")))) {
+		if(argc < 2 || inet_pton(AF_INET, argv[1], &in) != 1) {
+			admin_printf(out, "error: %s needs an IPv4 address\n", argv[0]);
+			return;
+		}
+		addr = ntohl(in.s_addr);
+	}
+
+	if(!strcmp(argv[0], "help")) {
+		admin_printf(out, "attempts [address]      knock attempts in progress\n"
+				"leases [address]        open doors\n"
+				"doors                   doors per capture with their pcap filters\n"
+				"flush <address>         drop the knock attempts of a source\n"
+				"close <address> [door]  close the doors open for a source now\n"
+				"reload                  re-read the configuration\n"
+				"reopen                  re-open the log file\n"
+				"trace                   dump the flight recorder to the trace file\n");
+	} else if(!strcmp(argv[0], "attempts")) {
+		admin_attempts(out, addr, argc == 1);
+	} else if(!strcmp(argv[0], "leases")) {
+		if(leases) {
+			now = now_ms();
+			arg[0] = out;
+			arg[1] = &now;
+			arg[2] = argc > 1 ? &addr : NULL;
+			lease_walk(leases, admin_lease, arg);
+		}
+	} else if(!strcmp(argv[0], "doors")) {
+		admin_doors(out);
+	} else if(!strcmp(argv[0], "flush")) {
+		n = admin_flush(addr);
+		vprint("%s: %d knock attempts flushed by admin\n", argv[1], n);
+		logprint("%s: %d knock attempts flushed by admin", argv[1], n);
+		admin_printf(out, "%d attempts flushed\n", n);
+	} else if(!strcmp(argv[0], "close")) {
+		now = now_ms();
+		arg[0] = &addr;
+		arg[1] = argc > 2 ? argv[2] : NULL;
+		arg[2] = &n;
+		n = 0;
+		if(leases) {
+			lease_walk(leases, admin_close_lease, arg);
+		}
+		vprint("%s: %d doors closed by admin\n", argv[1], n);
+		logprint("%s: %d doors closed by admin", argv[1], n);
+		admin_printf(out, "%d doors closing\n", n);
+	} else if(!strcmp(argv[0], "reload")) {
+		reload_pending = 1;
+		admin_printf(out, "reloading\n");
+	} else if(!strcmp(argv[0], "reopen")) {
+		reopen_pending = 1;
+		admin_printf(out, "re-opening the log file\n");
+	} else if(!strcmp(argv[0], "trace")) {
+		if(dump_trace()) {
+			admin_printf(out, "error: cannot dump the flight recorder, see the log\n");
+		} else {
+			admin_printf(out, "written to %s\n", o_trace_file);
+		}
+	} else {
+		admin_printf(out, "error: unknown command: %s, try help\n", argv[0]);
+	}
+}
+
+/* List the knock attempts in progress, all of them or those of addr
+ */
+void admin_attempts(admin_buf_t *out, uint32_t addr, int all)
+{
+	PMList *lp, *ap;
+	listener_t *l;
+	knocker_t *attempt;
+	time_t now = time(NULL);
+
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		for(ap = l->attempts; ap; ap = ap->next) {
+			attempt = (knocker_t*)ap->data;
+			if(!all && attempt->srcaddr != addr) {
+				continue;
+			}
+			if(attempt->stage < 0) {
+				admin_printf(out, "%s %s invalidated age %lds capture %s\n", attempt->src, attempt->door->name,
+						(long)(now - attempt->seq_start), listener_name(l));
+				continue;
+			}
+			admin_printf(out, "%s %s stage %d/%u age %lds capture %s\n", attempt->src, attempt->door->name,
+					attempt->stage, attempt->door->seqcount, (long)(now - attempt->seq_start), listener_name(l));
+		}
+	}
+}
+
+/* List one open door, for the leases command
+ */
+void admin_lease(lease_t *lease, void *arg)
+{
+	admin_buf_t *out = ((void**)arg)[0];
+	uint64_t now = *(uint64_t*)((void**)arg)[1];
+	uint32_t *addr = ((void**)arg)[2];
+	unsigned long left = lease->expires > now ? (lease->expires - now + 999) / 1000 : 0;
+	struct in_addr in;
+	char src[16];
+
+	if(addr && lease->addr != *addr) {
+		return;
+	}
+	in.s_addr = htonl(lease->addr);
+	inet_ntop(AF_INET, &in, src, sizeof(src));
+	admin_printf(out, "%s %s open %lds left %lus renewed %u\n", src, lease->door,
+			(long)(time(NULL) - lease->opened), left, lease->renewals);
+}
+
+/* Make the stop job of a lease of the source (and door, if given) due now,
+ * for the close command
+ */
+void admin_close_lease(lease_t *lease, void *arg)
+{
+	uint32_t addr = *(uint32_t*)((void**)arg)[0];
+	const char *door = ((void**)arg)[1];
+	int *n = ((void**)arg)[2];
+	uint64_t now = now_ms();
+
+	if(lease->addr != addr || (door && strcmp(lease->door, door))) {
+		return;
+	}
+	lease->expires = now;
+	if(timerq_reschedule(stop_timers, lease->data, now) == 0) {
+		(*n)++;
+	}
+}
+
+/* List the doors of every capture with the pcap filter generated for them
+ */
+void admin_doors(admin_buf_t *out)
+{
+	PMList *lp, *dp;
+	listener_t *l;
+	opendoor_t *door;
+	int i;
+
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		admin_printf(out, "capture %s: %d doors, %d attempts, %u byte buffer\n", listener_name(l),
+				list_count(l->doors), list_count(l->attempts), l->buffer ? l->buffer : CAPTURE_BUFFER_DEFAULT);
+		for(dp = l->doors; dp; dp = dp->next) {
+			door = (opendoor_t*)dp->data;
+			admin_printf(out, "  door %s: sequence ", door->name);
+			for(i = 0; i < door->seqcount; i++) {
+				admin_printf(out, "%s%u:%s", i ? "," : "", door->sequence[i],
+						door->protocol[i] == IPPROTO_UDP ? "udp" : "tcp");
+			}
+			admin_printf(out, ", seq_timeout %lds, cmd_timeout %lds\n", (long)door->seq_timeout,
+					(long)door->cmd_timeout);
+			admin_printf(out, "    filter: %s\n", door->pcap_filter_exp ? door->pcap_filter_exp : "(none)");
+		}
 	}
 }
 
-/* Output current sequence of door for debugging */
-void dprint_sequence(opendoor_t *door, char *fmt, ...)
+/* Drop the knock attempts of addr on every capture. Returns how many there
+ * were.
+ */
+int admin_flush(uint32_t addr)
 {
-	va_list args;
-	int i;
-
-	if(o_debug) {
-		va_start(args, fmt);
-		vprintf(fmt, args);
-		va_end(args);
-		for(i = 0; i < door->seqcount; i++) {
-			switch(door->protocol[i]){
-				case IPPROTO_UDP:
-					printf((i == door->seqcount-1 ? "%u:udp\n" : "%u:udp,"), door->sequence[i]);
-					break;
-				case IPPROTO_TCP: /* fallthrough */
-				default:
-					printf((i == door->seqcount-1 ? "%u:tcp\n" : "%u:tcp,"), door->sequence[i]);
+	PMList *lp, *ap, *apnext;
+	listener_t *l;
+	knocker_t *attempt;
+	int n = 0;
+
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		for(ap = l->attempts; ap; ap = apnext) {
+			apnext = ap->next;
+			attempt = (knocker_t*)ap->data;
+			if(attempt->srcaddr != addr) {
+				continue;
 			}
+			if(ap->prev) ap->prev->next = ap->next;
+			if(ap->next) ap->next->prev = ap->prev;
+			if(ap == l->attempts) l->attempts = apnext;
+			ap->prev = ap->next = NULL;
+			free(attempt->srchost);
+			list_free(ap);
+			n++;
 		}
-		fflush(stdout);
 	}
+	return(n);
 }
 
-/* Signal handlers */
-void cleanup(int signum)
+/* Write the flight recorder to Trace_File. Returns non-zero on error.
+ */
+int dump_trace()
 {
-	ip_literal_t *myip = myips;
-	int status;
-
-	vprint("waiting for child processes...\n");
-	logprint("waiting for child processes...");
-	wait(&status);
+	unsigned long n;
 
-	vprint("closing...\n");
-	logprint("shutting down");
-	pcap_close(cap);
-	if(o_daemon) {
-		unlink(o_pidfile);
+	if(trace_size == 0) {
+		vprint("flight recorder is off, nothing to dump\n");
+		logprint("flight recorder is off, nothing to dump");
+		return(1);
 	}
-
-	if(myips) {
-		while(myips) {
-			if(myip->value)
-				free(myip->value);
-			myips = myip->next;
-			free(myip);
-		}
+	if(trace_dump(o_trace_file, eventlog_door_name, &n)) {
+		fprintf(stderr, "error: cannot write %s: %s\n", o_trace_file, strerror(errno));
+		logprint("error: cannot write %s: %s", o_trace_file, strerror(errno));
+		return(1);
 	}
-
-	exit(signum);
+	vprint("flight recorder: %lu records written to %s\n", n, o_trace_file);
+	logprint("flight recorder: %lu records written to %s", n, o_trace_file);
+	return(0);
 }
 
-void child_exit(int signum)
+/* Log one open door, for dump_stats()
+ */
+void print_lease(lease_t *lease, void *arg)
 {
-	int status;
+	uint64_t now = *(uint64_t*)arg;
+	unsigned long left = lease->expires > now ? (lease->expires - now + 999) / 1000 : 0;
+	struct in_addr in;
+	char src[16];
+
+	in.s_addr = htonl(lease->addr);
+	inet_ntop(AF_INET, &in, src, sizeof(src));
+	vprint("statistics: open: %s: %s, open for %ld seconds, %lu seconds left, renewed %u times\n",
+			src, lease->door, (long)(time(NULL) - lease->opened), left, lease->renewals);
+	logprint("statistics: open: %s: %s, open for %ld seconds, %lu seconds left, renewed %u times",
+			src, lease->door, (long)(time(NULL) - lease->opened), left, lease->renewals);
+}
 
-	while ( waitpid( (pid_t)-1, &status, WNOHANG ) > 0 ) continue;
-	return;
+/* Log the counters of a plugin, for dump_stats()
+ */
+void print_plugin(const char *name, const plugin_stats_t *stats, void *arg)
+{
+	vprint("statistics: plugin %s: %lu calls, %lu failed, %lu dropped, %u queued\n",
+			name, stats->calls, stats->failed, stats->dropped, stats->queued);
+	logprint("statistics: plugin %s: %lu calls, %lu failed, %lu dropped, %u queued",
+			name, stats->calls, stats->failed, stats->dropped, stats->queued);
 }
 
-void reload(int signum)
+/* Log the queue of an event subscriber, for dump_stats()
+ */
+void print_subscriber(long pid, unsigned long queued, unsigned long dropped, size_t pending, void *arg)
 {
-	PMList *lp;
-	opendoor_t *door;
-	int res_cfg;
+	vprint("statistics: subscriber %ld: %lu records queued, %lu dropped, %lu bytes pending\n",
+			pid, queued, dropped, (unsigned long)pending);
+	logprint("statistics: subscriber %ld: %lu records queued, %lu dropped, %lu bytes pending",
+			pid, queued, dropped, (unsigned long)pending);
+}
 
-	vprint("Re-reading config file: %s\n", o_cfg);
-	logprint("Re-reading config file: %s\n", o_cfg);
+/* Log the latency histograms of a door, for dump_stats()
+ */
+void print_latency(const char *name, const metrics_door_t *door, void *arg)
+{
+	static const char *steps[LATENCY_STEPS] = {
+		"capture to decision", "decision to dispatch", "spawn", "dispatch to completion"
+	};
+	const histogram_t *h;
+	int i;
 
-	for(lp = doors; lp; lp = lp->next) {
-		door = (opendoor_t*)lp->data;
-		close_door(door);
+	for(i = 0; i < LATENCY_STEPS; i++) {
+		h = &door->latency[i];
+		if(histogram_count(h) == 0) {
+			continue;
+		}
+		vprint("statistics: latency: %s: %s: %lu samples, mean %llu us, p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n",
+				name, steps[i], histogram_count(h), (unsigned long long)histogram_mean(h),
+				(unsigned long long)histogram_percentile(h, 50), (unsigned long long)histogram_percentile(h, 90),
+				(unsigned long long)histogram_percentile(h, 99), (unsigned long long)histogram_max(h));
+		logprint("statistics: latency: %s: %s: %lu samples, mean %llu us, p50 %llu us, p90 %llu us, p99 %llu us, max %llu us",
+				name, steps[i], histogram_count(h), (unsigned long long)histogram_mean(h),
+				(unsigned long long)histogram_percentile(h, 50), (unsigned long long)histogram_percentile(h, 90),
+				(unsigned long long)histogram_percentile(h, 99), (unsigned long long)histogram_max(h));
 	}
-	list_free(doors);
-
-	res_cfg = parseconfig(o_cfg);
+}
 
-	vprint("Closing log file: %s\n", o_logfile);
-	logprint("Closing log file: %s\n", o_logfile);
+/* Log how far the attempts on a door got and the time between their
+ * knocks, for dump_stats(). Stages no attempt reached are left out.
+ */
+void print_funnel(const char *name, const metrics_door_t *door, void *arg)
+{
+	const histogram_t *h = &door->gap;
+	int i, last;
 
-	/* close the log file */
-	if(logfd) {
-		fclose(logfd);
+	if(door->created == 0) {
+		return;
 	}
-
-	if(res_cfg) {
-		exit(1);
+	for(last = METRICS_STAGES - 1; last > 0 && door->stage_reached[last] == 0; last--);
+	vprint("statistics: funnel: %s: %lu attempts, %lu timed out, %lu invalidated, %lu opened\n",
+			name, door->created, door->timed_out, door->invalidated, door->opened);
+	logprint("statistics: funnel: %s: %lu attempts, %lu timed out, %lu invalidated, %lu opened",
+			name, door->created, door->timed_out, door->invalidated, door->opened);
+	for(i = 0; i <= last; i++) {
+		vprint("statistics: funnel: %s: stage %d: %lu reached, %lu timed out, %lu invalidated\n",
+				name, i + 1, door->stage_reached[i], door->stage_timed_out[i], door->stage_invalidated[i]);
+		logprint("statistics: funnel: %s: stage %d: %lu reached, %lu timed out, %lu invalidated",
+				name, i + 1, door->stage_reached[i], door->stage_timed_out[i], door->stage_invalidated[i]);
 	}
+	if(histogram_count(h)) {
+		vprint("statistics: funnel: %s: knock gaps: %lu samples, mean %llu ms, p50 %llu ms, p90 %llu ms, p99 %llu ms, max %llu ms\n",
+				name, histogram_count(h), (unsigned long long)histogram_mean(h) / 1000,
+				(unsigned long long)histogram_percentile(h, 50) / 1000, (unsigned long long)histogram_percentile(h, 90) / 1000,
+				(unsigned long long)histogram_percentile(h, 99) / 1000, (unsigned long long)histogram_max(h) / 1000);
+		logprint("statistics: funnel: %s: knock gaps: %lu samples, mean %llu ms, p50 %llu ms, p90 %llu ms, p99 %llu ms, max %llu ms",
+				name, histogram_count(h), (unsigned long long)histogram_mean(h) / 1000,
+				(unsigned long long)histogram_percentile(h, 50) / 1000, (unsigned long long)histogram_percentile(h, 90) / 1000,
+				(unsigned long long)histogram_percentile(h, 99) / 1000, (unsigned long long)histogram_max(h) / 1000);
+	}
+}
 
-	vprint("Re-opening log file: %s\n", o_logfile);
-	logprint("Re-opening log file: %s\n", o_logfile);
+/* Add the gauges only knockd itself knows to a metrics response
+ */
+void render_metrics(metrics_buf_t *buf)
+{
+	exec_stats_t ex;
+	char label[256];
+	PMList *lp;
+	listener_t *l;
 
-	/* re-open the log file */
-	logfd = fopen(o_logfile, "a");
-	if(logfd == NULL) {
-		perror("warning: cannot open logfile");
+	metrics_printf(buf, "# HELP knockd_attempts Knock attempts in progress.\n# TYPE knockd_attempts gauge\n");
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		metrics_printf(buf, "knockd_attempts{capture=\"%s\"} %d\n",
+				metrics_escape(listener_name(l), label, sizeof(label)), list_count(l->attempts));
 	}
+	metrics_printf(buf, "# HELP knockd_doors_open Doors open for a knocker.\n# TYPE knockd_doors_open gauge\n");
+	metrics_printf(buf, "knockd_doors_open %u\n", leases ? lease_count(leases) : 0);
 
-	/* Fix issue #2 by regenerating the PCAP filter post config file re-read */
-	generate_pcap_filter();
+	for(lp = listeners; lp; lp = lp->next) {
+		read_capture_stats((listener_t*)lp->data);
+	}
+	metrics_printf(buf, "# HELP knockd_pcap_received_total Packets received by the capture.\n"
+			"# TYPE knockd_pcap_received_total counter\n");
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		metrics_printf(buf, "knockd_pcap_received_total{capture=\"%s\"} %lu\n",
+				metrics_escape(listener_name(l), label, sizeof(label)), l->total.recv);
+	}
+	metrics_printf(buf, "# HELP knockd_pcap_dropped_total Packets the capture dropped for lack of buffer space.\n"
+			"# TYPE knockd_pcap_dropped_total counter\n");
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		metrics_printf(buf, "knockd_pcap_dropped_total{capture=\"%s\"} %lu\n",
+				metrics_escape(listener_name(l), label, sizeof(label)), l->total.drop);
+	}
+	metrics_printf(buf, "# HELP knockd_pcap_if_dropped_total Packets the interface or its driver dropped.\n"
+			"# TYPE knockd_pcap_if_dropped_total counter\n");
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		metrics_printf(buf, "knockd_pcap_if_dropped_total{capture=\"%s\"} %lu\n",
+				metrics_escape(listener_name(l), label, sizeof(label)), l->total.ifdrop);
+	}
+	metrics_printf(buf, "# HELP knockd_capture_buffer_bytes Kernel buffer of the capture.\n"
+			"# TYPE knockd_capture_buffer_bytes gauge\n");
+	for(lp = listeners; lp; lp = lp->next) {
+		l = (listener_t*)lp->data;
+		metrics_printf(buf, "knockd_capture_buffer_bytes{capture=\"%s\"} %u\n",
+				metrics_escape(listener_name(l), label, sizeof(label)), l->buffer ? l->buffer : CAPTURE_BUFFER_DEFAULT);
+	}
 
-	return;
+	executor_get_stats(&ex);
+	metrics_printf(buf, "# HELP knockd_commands_sent_total Commands handed to the executor.\n"
+			"# TYPE knockd_commands_sent_total counter\n");
+	metrics_printf(buf, "knockd_commands_sent_total{kind=\"start\"} %lu\n", ex.sent[EXEC_PRIO_START]);
+	metrics_printf(buf, "knockd_commands_sent_total{kind=\"stop\"} %lu\n", ex.sent[EXEC_PRIO_STOP]);
+	metrics_printf(buf, "# HELP knockd_commands_rejected_total Commands dropped for a full executor queue.\n"
+			"# TYPE knockd_commands_rejected_total counter\n");
+	metrics_printf(buf, "knockd_commands_rejected_total{kind=\"start\"} %lu\n", ex.rejected[EXEC_PRIO_START]);
+	metrics_printf(buf, "knockd_commands_rejected_total{kind=\"stop\"} %lu\n", ex.rejected[EXEC_PRIO_STOP]);
+	metrics_printf(buf, "# HELP knockd_commands_queued Commands waiting for an executor worker.\n"
+			"# TYPE knockd_commands_queued gauge\n");
+	metrics_printf(buf, "knockd_commands_queued %u\n", ex.queued);
+	metrics_printf(buf, "# HELP knockd_commands_held Stop commands waiting for room on the executor socket.\n"
+			"# TYPE knockd_commands_held gauge\n");
+	metrics_printf(buf, "knockd_commands_held %u\n", ex.held);
 }
 
 void usage(int exit_code) {
@@ -590,12 +2139,30 @@ int parseconfig(char *configfile)
 				}
 				strncpy(door->name, section, sizeof(door->name)-1);
 				door->name[sizeof(door->name)-1] = '\0';
+				door->netns[0] = '\0';
+				door->iface[0] = '\0';
+				door->listener = NULL;
 				door->target = 0;
+				door->target_set = NULL;
+				door->allow_set = NULL;
+				door->deny_set = NULL;
+				door->acl = NULL;
 				door->seqcount = 0;
 				door->seq_timeout  = SEQ_TIMEOUT; /* default sequence timeout (seconds)  */
 				door->start_command = NULL;
 				door->cmd_timeout = CMD_TIMEOUT; /* default command timeout (seconds) */
 				door->stop_command = NULL;
+				door->shell = -1;
+				door->exec_limit = 0;
+				door->start_tmpl = NULL;
+				door->stop_tmpl = NULL;
+				door->nft_set = NULL;
+				door->xdp_count = 0;
+				door->batch_window = 0;
+				door->batch = NULL;
+				door->plugin_name[0] = '\0';
+				door->plugin_args = NULL;
+				door->plugin = NULL;
 				door->one_time_sequences_fd = NULL;
 				door->pcap_filter_exp = NULL;
 				doors = list_add(doors, door);
@@ -629,10 +2196,130 @@ int parseconfig(char *configfile)
 						strncpy(o_logfile, ptr, PATH_MAX-1);
 						o_logfile[PATH_MAX-1] = '\0';
 						dprint("config: log file: %s\n", o_logfile);
+					} else if(!strcmp(key, "JOURNAL")) {
+						strncpy(o_journal, ptr, PATH_MAX-1);
+						o_journal[PATH_MAX-1] = '\0';
+						dprint("config: journal: %s\n", o_journal);
+					} else if(!strcmp(key, "PLUGIN")) {
+						char *name = strsep(&ptr, " \t");
+						int i;
+						if(ptr == NULL || !strlen(name) || strlen(name) >= PLUGIN_NAME_MAX || !strlen(trim(ptr))) {
+							fprintf(stderr, "config: line %d: Plugin takes a name and the path of a shared object\n", linenum);
+							return(1);
+						}
+						i = plugin_add(name, ptr);
+						if(i < 0) {
+							perror("malloc");
+							exit(1);
+						}
+						if(i > 0) {
+							fprintf(stderr, "config: line %d: plugin %s is loaded from another path, restart knockd to change it\n",
+									linenum, name);
+							logprint("config: plugin %s is loaded from another path, restart knockd to change it", name);
+						}
+						dprint("config: plugin: %s: %s\n", name, ptr);
+					} else if(!strcmp(key, "EVENT_SOCKET")) {
+						strncpy(o_event_socket, ptr, PATH_MAX-1);
+						o_event_socket[PATH_MAX-1] = '\0';
+						dprint("config: event socket: %s\n", o_event_socket);
+					} else if(!strcmp(key, "EVENT_QUEUE_SIZE")) {
+						o_event_queue_size = (unsigned int)atoi(ptr);
+						dprint("config: event_queue_size: %u\n", o_event_queue_size);
+					} else if(!strcmp(key, "EVENT_LOG")) {
+						strncpy(o_event_log, ptr, PATH_MAX-1);
+						o_event_log[PATH_MAX-1] = '\0';
+						dprint("config: event log: %s\n", o_event_log);
+					} else if(!strcmp(key, "EVENT_LOG_SIZE")) {
+						o_event_log_size = strtoul(ptr, NULL, 10);
+						dprint("config: event_log_size: %lu\n", o_event_log_size);
+					} else if(!strcmp(key, "EVENT_LOG_FILES")) {
+						o_event_log_files = (unsigned int)atoi(ptr);
+						if(o_event_log_files == 0) {
+							fprintf(stderr, "config: line %d: Event_Log_Files must be at least 1\n", linenum);
+							return(1);
+						}
+						dprint("config: event_log_files: %u\n", o_event_log_files);
+					} else if(!strcmp(key, "METRICS_SOCKET")) {
+						strncpy(o_metrics_socket, ptr, PATH_MAX-1);
+						o_metrics_socket[PATH_MAX-1] = '\0';
+						dprint("config: metrics socket: %s\n", o_metrics_socket);
+					} else if(!strcmp(key, "METRICS_PORT")) {
+						o_metrics_port = (unsigned short)atoi(ptr);
+						dprint("config: metrics port: %u\n", o_metrics_port);
+					} else if(!strcmp(key, "TRACE_FILE")) {
+						strncpy(o_trace_file, ptr, PATH_MAX-1);
+						o_trace_file[PATH_MAX-1] = '\0';
+						dprint("config: trace file: %s\n", o_trace_file);
+					} else if(!strcmp(key, "TRACE_RECORDS")) {
+						o_trace_records = (unsigned int)atoi(ptr);
+						dprint("config: trace_records: %u\n", o_trace_records);
+					} else if(!strcmp(key, "ADMIN_SOCKET")) {
+						strncpy(o_admin_socket, ptr, PATH_MAX-1);
+						o_admin_socket[PATH_MAX-1] = '\0';
+						dprint("config: admin socket: %s\n", o_admin_socket);
+					} else if(!strcmp(key, "CAPTURE_BUFFER")) {
+						o_capture_buffer = (unsigned int)strtoul(ptr, NULL, 10);
+						dprint("config: capture_buffer: %u\n", o_capture_buffer);
+					} else if(!strcmp(key, "CAPTURE_BUFFER_MAX")) {
+						o_capture_buffer_max = (unsigned int)strtoul(ptr, NULL, 10);
+						dprint("config: capture_buffer_max: %u\n", o_capture_buffer_max);
+					} else if(!strcmp(key, "CAPTURE_STATS_INTERVAL")) {
+						o_capture_stats_interval = (unsigned int)atoi(ptr);
+						dprint("config: capture_stats_interval: %u\n", o_capture_stats_interval);
+					} else if(!strcmp(key, "CAPTURE_DROP_THRESHOLD")) {
+						o_capture_drop_threshold = (unsigned int)atoi(ptr);
+						dprint("config: capture_drop_threshold: %u\n", o_capture_drop_threshold);
+					} else if(!strcmp(key, "LOOKUP_CACHE_SIZE")) {
+						o_lookup_cache_size = (unsigned int)atoi(ptr);
+						dprint("config: lookup_cache_size: %u\n", o_lookup_cache_size);
+					} else if(!strcmp(key, "LOG_QUEUE_SIZE")) {
+						o_log_queue_size = (unsigned int)atoi(ptr);
+						dprint("config: log_queue_size: %u\n", o_log_queue_size);
+					} else if(!strcmp(key, "LOG_OVERFLOW")) {
+						strtoupper(ptr);
+						if(!strcmp(ptr, "DROP")) {
+							o_log_block = 0;
+						} else if(!strcmp(ptr, "BLOCK")) {
+							o_log_block = 1;
+						} else {
+							fprintf(stderr, "config: line %d: Log_Overflow must be drop or block\n", linenum);
+							return(1);
+						}
+						dprint("config: log_overflow: %s\n", ptr);
 					} else if(!strcmp(key, "PIDFILE")) {
 						strncpy(o_pidfile, ptr, PATH_MAX-1);
 						o_pidfile[PATH_MAX-1] = '\0';
 						dprint("config: pid file: %s\n", o_pidfile);
+					} else if(!strcmp(key, "SCAN_THRESHOLD")) {
+						o_scan_threshold = (unsigned int)atoi(ptr);
+						dprint("config: scan_threshold: %u\n", o_scan_threshold);
+					} else if(!strcmp(key, "SCAN_WINDOW")) {
+						o_scan_window = (time_t)atoi(ptr);
+						dprint("config: scan_window: %d\n", o_scan_window);
+					} else if(!strcmp(key, "SCAN_BLOCK")) {
+						o_scan_block = (time_t)atoi(ptr);
+						dprint("config: scan_block: %d\n", o_scan_block);
+					} else if(!strcmp(key, "SCAN_TABLE_SIZE")) {
+						o_scan_table_size = (unsigned int)atoi(ptr);
+						dprint("config: scan_table_size: %u\n", o_scan_table_size);
+					} else if(!strcmp(key, "PACKET_RATE") || !strcmp(key, "OPEN_RATE")) {
+						if(ratelimit_parse(ptr, key[0] == 'P' ? &o_packet_rate : &o_open_rate)) {
+							fprintf(stderr, "config: line %d: invalid rate \"%s\"\n", linenum, ptr);
+							return(1);
+						}
+						dprint("config: %s: %s\n", key, ptr);
+					} else if(!strcmp(key, "RATE_TABLE_SIZE")) {
+						o_rate_table_size = (unsigned int)atoi(ptr);
+						dprint("config: rate_table_size: %u\n", o_rate_table_size);
+					} else if(!strcmp(key, "EXEC_WORKERS")) {
+						o_exec_workers = (unsigned int)atoi(ptr);
+						dprint("config: exec_workers: %u\n", o_exec_workers);
+					} else if(!strcmp(key, "EXEC_QUEUE_SIZE")) {
+						o_exec_queue_size = (unsigned int)atoi(ptr);
+						dprint("config: exec_queue_size: %u\n", o_exec_queue_size);
+					} else if(!strcmp(key, "XDP_TABLE_SIZE")) {
+						o_xdp_table_size = (unsigned int)atoi(ptr);
+						dprint("config: xdp_table_size: %u\n", o_xdp_table_size);
 					} else if(!strcmp(key, "INTERFACE")) {
 						/* set interface only if it has not already been set by the -i switch */
 						if(strlen(o_int) == 0) {
@@ -651,13 +2338,34 @@ int parseconfig(char *configfile)
 						return(1);
 					}
 					if(!strcmp(key, "TARGET")) {
+						free(door->target);
 						door->target = malloc(sizeof(char) * (strlen(ptr)+1));
 						if(door->target == NULL) {
 							perror("malloc");
 							exit(1);
 						}
 						strcpy(door->target, ptr);
-						dprint("config: %s: target: %s\n", door->name, door->target);
+						if(parse_prefix_list(ptr, &door->target_set, door)) {
+							fprintf(stderr, "config: line %d: invalid target \"%s\"\n", linenum, door->target);
+							return(1);
+						}
+						dprint("config: %s: target: %s (%d prefixes)\n", door->name, door->target,
+								prefix_set_count(door->target_set));
+					} else if(!strcmp(key, "NETNS")) {
+						strncpy(door->netns, ptr, sizeof(door->netns)-1);
+						door->netns[sizeof(door->netns)-1] = '\0';
+						dprint("config: %s: netns: %s\n", door->name, door->netns);
+					} else if(!strcmp(key, "INTERFACE")) {
+						strncpy(door->iface, ptr, sizeof(door->iface)-1);
+						door->iface[sizeof(door->iface)-1] = '\0';
+						dprint("config: %s: interface: %s\n", door->name, door->iface);
+					} else if(!strcmp(key, "ALLOW") || !strcmp(key, "DENY")) {
+						if(parse_prefix_list(ptr, key[0] == 'A' ? &door->allow_set : &door->deny_set, door)) {
+							fprintf(stderr, "config: line %d: invalid %s list\n", linenum, key);
+							return(1);
+						}
+						dprint("config: %s: %s: %d prefixes\n", door->name, key,
+								prefix_set_count(key[0] == 'A' ? door->allow_set : door->deny_set));
 					} else if(!strcmp(key, "SEQUENCE")) {
 						int i;
 						i = parse_port_sequence(ptr, door);
@@ -688,6 +2396,26 @@ int parseconfig(char *configfile)
 						}
 						strcpy(door->start_command, ptr);
 						dprint("config: %s: start_command: %s\n", door->name, door->start_command);
+					} else if(!strcmp(key, "ACTION")) {
+						size_t n;
+						if(strncmp(ptr, "plugin:", 7) || (n = strcspn(ptr + 7, " \t")) == 0 || n >= PLUGIN_NAME_MAX) {
+							fprintf(stderr, "config: line %d: Action must be plugin:<name> [args]\n", linenum);
+							return(1);
+						}
+						memcpy(door->plugin_name, ptr + 7, n);
+						door->plugin_name[n] = '\0';
+						free(door->plugin_args);
+						if((door->plugin_args = strdup(trim(ptr + 7 + n))) == NULL) {
+							perror("malloc");
+							exit(1);
+						}
+						dprint("config: %s: action: plugin %s (%s)\n", door->name, door->plugin_name, door->plugin_args);
+					} else if(!strcmp(key, "EXEC_LIMIT")) {
+						door->exec_limit = (unsigned int)atoi(ptr);
+						dprint("config: %s: exec_limit: %u\n", door->name, door->exec_limit);
+					} else if(!strcmp(key, "BATCH_WINDOW")) {
+						door->batch_window = (unsigned int)atoi(ptr);
+						dprint("config: %s: batch_window: %u\n", door->name, door->batch_window);
 					} else if(!strcmp(key, "CMD_TIMEOUT")) {
 						door->cmd_timeout = (time_t)atoi(ptr);
 						dprint("config: %s: cmd_timeout: %d\n", door->name, door->cmd_timeout);
@@ -699,6 +2427,33 @@ int parseconfig(char *configfile)
 						}
 						strcpy(door->stop_command, ptr);
 						dprint("config: %s: stop_command: %s\n", door->name, door->stop_command);
+					} else if(!strcmp(key, "NFT_SET")) {
+						if(door->nft_set == NULL && (door->nft_set = malloc(sizeof(nftset_t))) == NULL) {
+							perror("malloc");
+							exit(1);
+						}
+						if(nftset_parse(ptr, door->nft_set)) {
+							fprintf(stderr, "config: line %d: invalid nftables set \"%s\"\n", linenum, ptr);
+							return(1);
+						}
+						dprint("config: %s: nft_set: %s %s %s\n", door->name,
+								nftset_family_name(door->nft_set->family), door->nft_set->table, door->nft_set->set);
+					} else if(!strcmp(key, "XDP_PROTECT")) {
+						if(parse_xdp_ports(ptr, door)) {
+							return(1);
+						}
+						dprint("config: %s: xdp_protect: %d ports\n", door->name, door->xdp_count);
+					} else if(!strcmp(key, "SHELL")) {
+						strtoupper(ptr);
+						if(!strcmp(ptr, "YES")) {
+							door->shell = 1;
+						} else if(!strcmp(ptr, "NO")) {
+							door->shell = 0;
+						} else {
+							fprintf(stderr, "config: line %d: Shell must be yes or no\n", linenum);
+							return(1);
+						}
+						dprint("config: %s: shell: %d\n", door->name, door->shell);
 					} else if(!strcmp(key, "TCPFLAGS")) {
 						char *flag;
 						strtoupper(ptr);
@@ -753,6 +2508,23 @@ int parseconfig(char *configfile)
 			fprintf(stderr, "error: section '%s' has an empty knock sequence\n", door->name);
 			return(1);
 		}
+		if(compile_acl(door)) {
+			perror("malloc");
+			exit(1);
+		}
+		if(compile_command(door, door->start_command, &door->start_tmpl) ||
+				compile_command(door, door->stop_command, &door->stop_tmpl)) {
+			return(1);
+		}
+		if(door->batch_window && ((door->start_tmpl && cmdtmpl_uses(door->start_tmpl, "%IP%")) ||
+				(door->stop_tmpl && cmdtmpl_uses(door->stop_tmpl, "%IP%")))) {
+			fprintf(stderr, "config: %s: batched commands take %%IPS%% or stdin, not %%IP%%\n", door->name);
+			return(1);
+		}
+		if(door->plugin_name[0] && (door->plugin = plugin_find(door->plugin_name)) == NULL) {
+			fprintf(stderr, "config: %s: unknown plugin %s\n", door->name, door->plugin_name);
+			return(1);
+		}
 	}
 
 	return(0);
@@ -793,6 +2565,132 @@ int parse_port_sequence(char *sequence, opendoor_t *door)
 	return(0);
 }
 
+/* Parse the ports of an XDP_Protect directive, "<port>[:tcp|udp],..."
+ */
+int parse_xdp_ports(char *list, opendoor_t *door)
+{
+	char *item, *port, *protocol;
+	int num;
+
+	door->xdp_count = 0;
+	while((item = strsep(&list, ","))) {
+		if(door->xdp_count >= SEQ_MAX) {
+			fprintf(stderr, "config: section %s: too many ports in XDP_Protect\n", door->name);
+			return(1);
+		}
+		port = strsep(&item, ":");
+		num = atoi(port);
+		if(num <= 0 || num > 65535) {
+			fprintf(stderr, "config: section %s: invalid port \"%s\" in XDP_Protect\n", door->name, trim(port));
+			return(1);
+		}
+		door->xdp_port[door->xdp_count] = (unsigned short)num;
+		door->xdp_proto[door->xdp_count] = IPPROTO_TCP;
+		if((protocol = strsep(&item, ":"))) {
+			protocol = strtoupper(trim(protocol));
+			if(!strcmp(protocol, "UDP")) {
+				door->xdp_proto[door->xdp_count] = IPPROTO_UDP;
+			} else if(strcmp(protocol, "TCP")) {
+				fprintf(stderr, "config: section %s: unknown protocol in XDP_Protect\n", door->name);
+				return(1);
+			}
+		}
+		door->xdp_count++;
+	}
+	return(0);
+}
+
+/* Parse a comma-separated list of IP addresses, CIDR prefixes and address
+ * set files (absolute paths, one address or prefix per line) and add them to
+ * *set, creating it if needed. Returns a positive integer on error.
+ */
+int parse_prefix_list(char *list, prefix_set_t **set, opendoor_t *door)
+{
+	char *entry;
+	int ret;
+
+	if(*set == NULL) {
+		if((*set = prefix_set_new()) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	while((entry = strsep(&list, ","))) {
+		trim(entry);
+		if(entry[0] == '/') {
+			ret = prefix_set_load(*set, entry, 0);
+			if(ret < 0) {
+				perror(entry);
+				return(1);
+			} else if(ret > 0) {
+				fprintf(stderr, "config: %s: line %d: invalid address or prefix\n", entry, ret);
+				return(1);
+			}
+		} else if(prefix_set_parse(*set, entry, 0)) {
+			fprintf(stderr, "config: section %s: invalid address \"%s\"\n", door->name, entry);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/* Merge the door's allow and deny lists into a single longest-prefix-match
+ * table. Deny entries are added last so they win over an identical allow
+ * prefix. Returns non-zero if memory runs out.
+ */
+int compile_acl(opendoor_t *door)
+{
+	int i;
+
+	prefix_set_free(door->acl);
+	door->acl = NULL;
+	if(door->allow_set == NULL && door->deny_set == NULL) {
+		return(0);
+	}
+	if((door->acl = prefix_set_new()) == NULL) {
+		return(1);
+	}
+	for(i = 0; door->allow_set && i < prefix_set_count(door->allow_set); i++) {
+		const prefix_entry_t *pfx = prefix_set_entry(door->allow_set, i);
+		if(prefix_set_add(door->acl, pfx->addr, pfx->len, ACL_ALLOW)) {
+			return(1);
+		}
+	}
+	for(i = 0; door->deny_set && i < prefix_set_count(door->deny_set); i++) {
+		const prefix_entry_t *pfx = prefix_set_entry(door->deny_set, i);
+		if(prefix_set_add(door->acl, pfx->addr, pfx->len, ACL_DENY)) {
+			return(1);
+		}
+	}
+	dprint("config: %s: source ACL with %d prefixes\n", door->name, prefix_set_count(door->acl));
+	return(0);
+}
+
+/* Compile a start or stop command of a door into *tmpl. Commands using
+ * shell syntax are run through the shell unless the door says otherwise.
+ * Returns non-zero on error.
+ */
+int compile_command(opendoor_t *door, const char *command, cmdtmpl_t **tmpl)
+{
+	const char *err;
+	int shell = door->shell;
+
+	if(command == NULL || strlen(command) == 0) {
+		return(0);
+	}
+	if(shell < 0) {
+		shell = cmdtmpl_needs_shell(command);
+		if(shell) {
+			dprint("config: %s: running \"%s\" through the shell\n", door->name, command);
+		}
+	}
+	if((*tmpl = cmdtmpl_compile(command, shell, &err)) == NULL) {
+		fprintf(stderr, "config: %s: %s: %s\n", door->name, err, command);
+		return(1);
+	}
+	return(0);
+}
+
 /* Read a new sequence from the one time sequences file and update the door.
  */
 int get_new_one_time_sequence(opendoor_t *door)
@@ -891,7 +2789,7 @@ long get_current_one_time_sequence_position(opendoor_t *door)
  * door->pcap_filter_exp is NULL. This behaviour can be used for doors with one
  * time sequences, where the subfilter has to be generated after each sequence.
  */
-void generate_pcap_filter()
+void generate_pcap_filter(listener_t *l)
 {
 	PMList *lp;
 	opendoor_t *door;
@@ -899,10 +2797,13 @@ void generate_pcap_filter()
 	char *buffer = NULL;   /* temporary buffer to create the individual filter strings */
 	size_t bufsize = 0;    /* size of buffer */
 	char port_str[10];     /* used by snprintf to convert unsigned short --> string */
+	char net_str[20];      /* used by prefix_to_str() to convert a target prefix --> string */
+	prefix_set_t *acl_set; /* ACL prefixes added to the filter */
 	short head_set = 0;	   /* flag indicating if protocol head is set (i.e. "((tcp dst port") */
 	short tcp_present = 0; /* flag indicating if TCP is used */
 	short udp_present = 0; /* flag indicating if UDP is used */
 	unsigned int i;
+	int j;                 /* index into a prefix set */
 	short modified_filters = 0;  /* flag indicating if at least one filter has changed --> recompile the filter */
 	struct bpf_program bpf_prog; /* compiled BPF filter program */
 
@@ -911,7 +2812,7 @@ void generate_pcap_filter()
 	 * Example filter for one single door:
 	 * ((tcp dst port 8000 or 8001 or 8002) and tcp[tcpflags] & tcp-syn != 0) or (udp dst port 4000 or 4001)
 	 */
-	for(lp = doors; lp; lp = lp->next) {
+	for(lp = l->doors; lp; lp = lp->next) {
 		door = (opendoor_t*)lp->data;
 
 		if(door->pcap_filter_exp != NULL) {
@@ -939,18 +2840,49 @@ void generate_pcap_filter()
 			buffer[0] = '\0';
 		}
 
-		/* accept only incoming packets */
-		for(myip = myips; myip != NULL; myip = myip->next) {
-			if(!head_set) {
-				bufsize = realloc_strcat(&buffer, "((dst host ", bufsize);
+		/* accept only incoming packets. Targets with more prefixes than
+		 * TARGET_FILTER_MAX are left to target_match() in sniff(), as spelling
+		 * them out would only bloat the BPF program */
+		bufsize = realloc_strcat(&buffer, "(", bufsize);
+		if(door->target_set) {
+			if(prefix_set_count(door->target_set) <= TARGET_FILTER_MAX) {
+				for(j = 0; j < prefix_set_count(door->target_set); j++) {
+					const prefix_entry_t *pfx = prefix_set_entry(door->target_set, j);
+					bufsize = realloc_strcat(&buffer, head_set ? " or dst net " : "(dst net ", bufsize);
+					bufsize = realloc_strcat(&buffer, prefix_to_str(pfx->addr, pfx->len, net_str, sizeof(net_str)), bufsize);
+					head_set = 1;
+				}
+			}
+		} else {
+			for(myip = l->myips; myip != NULL; myip = myip->next) {
+				bufsize = realloc_strcat(&buffer, head_set ? " or dst host " : "(dst host ", bufsize);
+				bufsize = realloc_strcat(&buffer, myip->value, bufsize);
 				head_set = 1;
-			} else {
-				bufsize = realloc_strcat(&buffer, " or dst host ", bufsize);
 			}
-			bufsize = realloc_strcat(&buffer, door->target ? door->target : myip->value, bufsize);
 		}
+		if(head_set) {
+			bufsize = realloc_strcat(&buffer, ") and ", bufsize);
+		}
+		head_set = 0;
 
-		bufsize = realloc_strcat(&buffer, ") and (", bufsize);
+		/* push the source ACL down as well. An allow list gives a superset of
+		 * the accepted sources (denied sub-prefixes are dropped by acl_match()),
+		 * a pure deny list can be expressed exactly */
+		acl_set = door->allow_set ? door->allow_set : door->deny_set;
+		if(acl_set && prefix_set_count(acl_set) <= TARGET_FILTER_MAX) {
+			for(j = 0; j < prefix_set_count(acl_set); j++) {
+				const prefix_entry_t *pfx = prefix_set_entry(acl_set, j);
+				if(!head_set) {
+					bufsize = realloc_strcat(&buffer, door->allow_set ? "(src net " : "not (src net ", bufsize);
+				} else {
+					bufsize = realloc_strcat(&buffer, " or src net ", bufsize);
+				}
+				bufsize = realloc_strcat(&buffer, prefix_to_str(pfx->addr, pfx->len, net_str, sizeof(net_str)), bufsize);
+				head_set = 1;
+			}
+			bufsize = realloc_strcat(&buffer, ") and ", bufsize);
+		}
+		bufsize = realloc_strcat(&buffer, "(", bufsize);
 		head_set = 0;
 
 		/* generate filter for all TCP ports (i.e. "((tcp dst port 4000 or 4001 or 4002) and tcp[tcpflags] & tcp-syn != 0)" */
@@ -1090,7 +3022,7 @@ void generate_pcap_filter()
 	 */
 	if(modified_filters) {
 		/* iterate over all doors */
-		for(lp = doors; lp; lp = lp->next) {
+		for(lp = l->doors; lp; lp = lp->next) {
 			door = (opendoor_t*)lp->data;
 			bufsize = realloc_strcat(&buffer, door->pcap_filter_exp, bufsize);
 			if(lp->next != NULL) {
@@ -1105,14 +3037,15 @@ void generate_pcap_filter()
 			cleanup(1);
 		}
 
-		if(pcap_compile(cap, &bpf_prog, buffer, 1, 0) < 0) {	/* optimize filter (1), no netmask (0) (we're not interested in broadcasts) */
-			pcap_perror(cap, "pcap");
+		if(pcap_compile(l->cap, &bpf_prog, buffer, 1, 0) < 0) {	/* optimize filter (1), no netmask (0) (we're not interested in broadcasts) */
+			pcap_perror(l->cap, "pcap");
 			cleanup(1);
 		}
-		if(pcap_setfilter(cap, &bpf_prog) < 0) {
-			pcap_perror(cap, "pcap");
+		if(pcap_setfilter(l->cap, &bpf_prog) < 0) {
+			pcap_perror(l->cap, "pcap");
 			cleanup(1);
 		}
+		PROBE3(filter, l->iface, l->netns, buffer);
 		pcap_freecode(&bpf_prog);
 		free(buffer);
 	}
@@ -1162,11 +3095,27 @@ size_t realloc_strcat(char **dest, const char *src, size_t size)
  */
 void close_door(opendoor_t *door)
 {
-	doors = list_remove(doors, door);
+	if(door && door->listener) {
+		door->listener->doors = list_remove(door->listener->doors, door);
+	} else {
+		doors = list_remove(doors, door);
+	}
 	if(door) {
+		if(door->batch) {
+			/* the knockers are in, run the batch now rather than lose it */
+			run_batch(door->batch);
+		}
 		free(door->target);
+		prefix_set_free(door->target_set);
+		prefix_set_free(door->allow_set);
+		prefix_set_free(door->deny_set);
+		prefix_set_free(door->acl);
 		free(door->start_command);
 		free(door->stop_command);
+		cmdtmpl_free(door->start_tmpl);
+		cmdtmpl_free(door->stop_tmpl);
+		free(door->nft_set);
+		free(door->plugin_args);
 		if (door->one_time_sequences_fd) {
 			fclose(door->one_time_sequences_fd);
 		}
@@ -1209,90 +3158,248 @@ char* get_ip(const char* iface, char *buf, int bufsize)
 	return(buf);
 }
 
-/* Parse a command line, replacing tokens (eg, %IP%) with their real values and
- * copy the result to dest. At most size-1 characters will be copied and the
- * result will always be NULL terminated (except if size == 0). The return value
- * is the length of the resulting string. If the returned size is larger than the
- * size of dest, then the result has ben truncated.
+/* Hand a command (packed argv strings) to the executor. Its outcome is
+ * logged by exec_result(), which gets cookie back with it.
+ */
+int exec_cmd(const char *args, size_t len, const char *name, const char *netns,
+		const char *input, size_t inlen, int prio, unsigned int limit, uint64_t cookie)
+{
+	char command[1024];
+
+	cmdtmpl_display(args, len, command, sizeof(command));
+	logprint("%s: running command: %s\n", name, command);
+	vprint("%s: running command: %s\n", name, command);
+	PROBE2(exec_dispatch, name, prio);
+	if(executor_run(name, netns, args, len, input, inlen, prio, limit, cookie)) {
+		fprintf(stderr, "%s: cannot run command: %s\n", name, strerror(errno));
+		logprint("%s: cannot run command: %s", name, strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+/* Log the outcome of a command run by the executor
+ */
+void exec_result(const exec_msg_t *msg)
+{
+	char command[1024];
+	metrics_door_t *door;
+
+	/* the time from dispatch to completion is only of interest for start
+	 * commands, and only for those that got to run */
+	if(msg->prio == EXEC_PRIO_START && !(msg->type == EXEC_FAILED && msg->status == ENOBUFS)) {
+		door = metrics_door(msg->name);
+		if(msg->type == EXEC_DONE) {
+			histogram_record(&door->latency[LATENCY_SPAWN], msg->spawn);
+		}
+		note_latency(door, LATENCY_COMPLETION, msg->sent, now_us());
+	}
+	if(msg->prio == EXEC_PRIO_STOP && msg->cookie) {
+		stop_done(msg->cookie, msg->type == EXEC_FAILED && msg->status == ENOBUFS);
+	}
+
+	if(msg->type == EXEC_FAILED) {
+		cmdtmpl_display(msg->args, msg->len, command, sizeof(command));
+		if(msg->status == ENOBUFS && msg->prio == EXEC_PRIO_STOP) {
+			fprintf(stderr, "%s: too many commands queued, trying again: %s\n", msg->name, command);
+			logprint("%s: too many commands queued, trying again: %s", msg->name, command);
+		} else if(msg->status == ENOBUFS) {
+			fprintf(stderr, "%s: too many commands queued, dropped: %s\n", msg->name, command);
+			logprint("%s: too many commands queued, dropped: %s", msg->name, command);
+		} else {
+			METRIC_INC(metrics.spawn_failures);
+			fprintf(stderr, "%s: cannot run %s: %s\n", msg->name, command, strerror(msg->status));
+			logprint("%s: cannot run %s: %s", msg->name, command, strerror(msg->status));
+		}
+	} else if(WIFSIGNALED(msg->status)) {
+		METRIC_INC(metrics.command_failures);
+		fprintf(stderr, "%s: command killed by signal %d\n", msg->name, WTERMSIG(msg->status));
+		logprint("%s: command killed by signal %d", msg->name, WTERMSIG(msg->status));
+	} else if(WEXITSTATUS(msg->status) != 0) {
+		METRIC_INC(metrics.command_failures);
+		fprintf(stderr, "%s: command returned non-zero status code (%d)\n", msg->name, WEXITSTATUS(msg->status));
+		logprint("%s: command returned non-zero status code (%d)", msg->name, WEXITSTATUS(msg->status));
+	}
+}
+
+/* Run the stop commands and revoke the XDP grants that are due at now. A
+ * job with a command is closed in the journal once the executor has run
+ * it, see stop_done(). A job whose stop event the plugin cannot take yet
+ * is kept and tried again in a while, or else the plugin would never undo
+ * what it did for the start event.
+ */
+void run_stop_timers(uint64_t now)
+{
+	stop_job_t *job, *retry = NULL;
+	struct timeval tv;
+	uint64_t due;
+
+	while((job = timerq_pop(stop_timers, now)) != NULL) {
+		if(!job->retry) {
+			if(job->lease && job->lease->expires > now) {
+				/* renewed meanwhile */
+				schedule_stop(job, job->lease->expires);
+				continue;
+			}
+			if(job->lease == NULL && job->input && (due = batch_expires(job)) > now) {
+				/* a knocker of the batch has knocked again */
+				journal_append(JOURNAL_EXTEND, job->id, wall_time(due), NULL, 0);
+				schedule_stop(job, due);
+				continue;
+			}
+			if(job->lease) {
+				/* a close per knocker, the stop job of a batch has none of
+				 * its own: its knockers are closed by their leases */
+				lease_remove(leases, job->lease);
+				job->lease = NULL;
+				gettimeofday(&tv, NULL);
+				evstream_publish(EVSTREAM_CLOSE, job->addr, 0, job->name, &tv);
+				eventlog_write(EVENTLOG_CLOSE, job->addr, eventlog_door(job->name), 0, 0, 0, tv_usecs(&tv));
+				METRIC_INC(metrics.stop_actions);
+			}
+			if(job->xdp_count) {
+				revoke_xdp(job);
+			}
+			if(job->args) {
+				if(job->srchost) {
+					vprint("%s (%s): %s: command timeout\n", job->src, job->srchost, job->name);
+					logprint("%s (%s): %s: command timeout", job->src, job->srchost, job->name);
+				} else {
+					vprint("%s: %s: command timeout\n", job->src, job->name);
+					logprint("%s: %s: command timeout", job->src, job->name);
+				}
+			}
+		}
+		if(job->event) {
+			if(send_event(job->plugin, job->event, job->src)) {
+				/* not rescheduled before the loop is done, it would come
+				 * right back when all jobs are run at shutdown */
+				job->retry = 1;
+				job->next = retry;
+				retry = job;
+				continue;
+			}
+			/* a command that is run again must not resend it */
+			free(job->event);
+			job->event = NULL;
+		}
+		if(job->args && exec_cmd(job->args, job->len, job->name, job->netns, job->input, job->inlen,
+				EXEC_PRIO_STOP, job->exec_limit, job->id) == 0) {
+			job->next = running_stops;
+			running_stops = job;
+			continue;
+		}
+		journal_append(JOURNAL_CLOSE, job->id, 0, NULL, 0);
+		free_stop_job(job);
+	}
+	while((job = retry) != NULL) {
+		retry = job->next;
+		schedule_stop(job, now_ms() + STOP_RETRY_DELAY);
+	}
+}
+
+/* When the last lease of the knockers of a batch expires, for the stop job
+ * of the batch, which has their addresses as input. 0 if none is left.
+ */
+uint64_t batch_expires(stop_job_t *job)
+{
+	char addr[16];
+	struct in_addr in;
+	lease_t *lease;
+	uint64_t last = 0;
+	size_t i, n;
+
+	for(i = 0; i < job->inlen; i += n + 1) {
+		for(n = 0; i + n < job->inlen && job->input[i+n] != '\n'; n++);
+		if(n >= sizeof(addr)) {
+			continue;
+		}
+		memcpy(addr, job->input + i, n);
+		addr[n] = '\0';
+		if(inet_pton(AF_INET, addr, &in) == 1 &&
+				(lease = lease_find(leases, ntohl(in.s_addr), job->name)) != NULL &&
+				lease->expires > last) {
+			last = lease->expires;
+		}
+	}
+	return(last);
+}
+
+/* The executor is done with the stop command of job id: close the job in
+ * the journal, or if the command was refused for a full queue, run it
+ * again in a while.
+ */
+void stop_done(uint64_t id, int refused)
+{
+	stop_job_t **p, *job;
+
+	for(p = &running_stops; *p && (*p)->id != id; p = &(*p)->next);
+	if((job = *p) == NULL) {
+		return;
+	}
+	*p = job->next;
+	if(refused) {
+		job->retry = 1;
+		schedule_stop(job, now_ms() + STOP_RETRY_DELAY);
+		return;
+	}
+	journal_append(JOURNAL_CLOSE, job->id, 0, NULL, 0);
+	free_stop_job(job);
+}
+
+/* The executor went away, along with the stop commands it had: run them
+ * again. Those it did run are merely run twice.
  */
-size_t parse_cmd(char* dest, size_t size, const char* command, const char* src)
+void retry_running_stops()
 {
-	char *d = dest;
-	const char *c = command;
-	const char *s = src;
-	char *token;
-	size_t n = size;
-	size_t command_len = strlen(command);
-	size_t total_len = 0;
+	stop_job_t *job;
+	uint64_t now = now_ms();
 
-	/* allows us to calculate total length of result string even if the size */
-	/* is zero by setting n to 1 (--> noting will be ever written to dest) */
-	int size_larger_than_zero = 1;
-	if(size == 0) {
-		size_larger_than_zero = 0;
-		n = 1;
-	}
-
-	/* get location of first token */
-	token = strstr(c, "%IP%");
-	if(!token) {
-		/* point token past command (we won't access it anymore) */
-		token = (char*) (c + command_len + 1);
-	}
-	while(*c != '\0') {
-		/* not reached a token yet --> append from command */
-		if(c < token) {
-			if(n != 1) {
-				*d++ = *c;
-				n--;
-			}
-		} else {
-			/* we reached a token --> append from src */
-			while(*s != '\0') {
-				if(n != 1) {
-					*d++ = *s;
-					n--;
-				}
-				s++;
-				total_len++;
-			}
-			c += 4;  /* skip the token in command */
-			s = src; /* "rewind" src string for next token */
-			token = strstr(c, "%IP%"); /* get location of next token */
-			if(!token) {
-				/* point token past command (we won't access it anymore) */
-				token = (char*) (c + command_len + 1);
-			}
-			c--; /* compensate for the following c++ */
-			total_len--; /* compensate for the following total_len++ */
-		}
-		c++;
-		total_len++;
+	while((job = running_stops) != NULL) {
+		running_stops = job->next;
+		job->retry = 1;
+		schedule_stop(job, now);
 	}
-	if(size_larger_than_zero) {
-		/* terminate dest if its size is larger than 0 */
-		*d = '\0';
+}
+
+/* Forget the stop jobs an executor that was stopped has not reported on.
+ * Nothing tells whether their commands ran, so they are left open in the
+ * journal and the next run runs them again.
+ */
+void free_running_stops()
+{
+	stop_job_t *job;
+
+	while((job = running_stops) != NULL) {
+		running_stops = job->next;
+		free_stop_job(job);
 	}
+}
 
-	return(total_len);
+void free_stop_job(stop_job_t *job)
+{
+	free(job->srchost);
+	free(job->input);
+	free(job->netns);
+	free(job->args);
+	free(job->event);
+	free(job);
 }
 
-/* Execute a command through the system shell and wait for return
+/* Microseconds since the epoch, for the event log
  */
-int exec_cmd(char* command, char* name){
-	int ret;
+uint64_t tv_usecs(const struct timeval *tv)
+{
+	return((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec);
+}
 
-	logprint("%s: running command: %s\n", name, command);
-	vprint("%s: running command: %s\n", name, command);
-	ret = system(command);
-	if(ret == -1) {
-		fprintf(stderr, "error: command fork failed!\n");
-		logprint("error: command fork failed!");
-	} else if(ret != 0) {
-		fprintf(stderr, "%s: command returned non-zero status code (%d)\n", name, WEXITSTATUS(ret));
-		logprint("%s: command returned non-zero status code (%d)", name, WEXITSTATUS(ret));
-	}
-	return ret;
+/* Record the time (us) one step towards running a start command took.
+ * Steps that seem to end before they began, eg, because the clock was set
+ * back, count as 0.
+ */
+void note_latency(metrics_door_t *door, int step, uint64_t from, uint64_t to)
+{
+	histogram_record(&door->latency[step], to > from ? to - from : 0);
 }
 
 /*
@@ -1369,15 +3476,40 @@ int flags_match(opendoor_t* door, struct ip* ip, struct tcphdr* tcp)
 	return 1;
 }
 
+/* Pick up the knocker's host name once the resolver has it, if names are
+ * looked up at all. Until then, log messages have the address only.
+ */
+void lookup_host(knocker_t *attempt)
+{
+	if(o_lookup && attempt->srchost == NULL) {
+		attempt->srchost = resolver_lookup(attempt->srcaddr);
+	}
+}
+
 /**
  * Process a knock attempt to see if the knocker has graduated to the next
  * sequence. If they've completed all sequences correctly, then we open the
  * door.
  */
-void process_attempt(knocker_t *attempt)
+void process_attempt(knocker_t *attempt, const struct timeval *ts)
 {
+	lookup_host(attempt);
 	/* level up! */
 	attempt->stage++;
+	METRIC_INC(attempt->door->metrics->advanced);
+	METRIC_INC(attempt->door->metrics->stage_reached[METRICS_STAGE(attempt->stage)]);
+	if(attempt->stage > 1) {
+		/* packet times may go back when the clock is set */
+		histogram_record(&attempt->door->metrics->gap,
+				tv_usecs(ts) > attempt->last_knock ? tv_usecs(ts) - attempt->last_knock : 0);
+	}
+	attempt->last_knock = tv_usecs(ts);
+	evstream_publish(EVSTREAM_STAGE, attempt->srcaddr, attempt->stage, attempt->door->name, ts);
+	eventlog_write(EVENTLOG_STAGE, attempt->srcaddr, attempt->door->event_id, attempt->stage,
+			attempt->door->sequence[attempt->stage-1], attempt->door->protocol[attempt->stage-1], tv_usecs(ts));
+	TRACE(TRACE_STAGE, attempt->srcaddr, attempt->door->event_id, attempt->door->sequence[attempt->stage-1],
+			attempt->door->protocol[attempt->stage-1], attempt->stage, tv_usecs(ts));
+	PROBE3(attempt_stage, attempt->srcaddr, attempt->door->name, attempt->stage);
 	if(attempt->srchost) {
 		vprint("%s (%s): %s: Stage %d\n", attempt->src, attempt->srchost, attempt->door->name, attempt->stage);
 		logprint("%s (%s): %s: Stage %d", attempt->src, attempt->srchost, attempt->door->name, attempt->stage);
@@ -1386,6 +3518,10 @@ void process_attempt(knocker_t *attempt)
 		logprint("%s: %s: Stage %d", attempt->src, attempt->door->name, attempt->stage);
 	}
 	if(attempt->stage >= attempt->door->seqcount) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		attempt->decided = tv_usecs(&now);
+		note_latency(attempt->door->metrics, LATENCY_CAPTURE, tv_usecs(ts), attempt->decided);
 		if(attempt->srchost) {
 			vprint("%s (%s): %s: OPEN SESAME\n", attempt->src, attempt->srchost, attempt->door->name);
 			logprint("%s (%s): %s: OPEN SESAME", attempt->src, attempt->srchost, attempt->door->name);
@@ -1393,54 +3529,22 @@ void process_attempt(knocker_t *attempt)
 			vprint("%s: %s: OPEN SESAME\n", attempt->src, attempt->door->name);
 			logprint("%s: %s: OPEN SESAME", attempt->src, attempt->door->name);
 		}
-		if(attempt->door->start_command && strlen(attempt->door->start_command)) {
-			/* run the associated command */
-			if(fork() == 0) {
-				/* child */
-				char parsed_start_cmd[PATH_MAX];
-				char parsed_stop_cmd[PATH_MAX];
-				size_t cmd_len = 0;
-
-				setsid();
-
-				/* parse start and stop command and check if the parsed commands fit in the given buffer. Don't
-				 * execute any command if one of them has been truncated */
-				cmd_len = parse_cmd(parsed_start_cmd, sizeof(parsed_start_cmd), attempt->door->start_command, attempt->src);
-				if(cmd_len >= sizeof(parsed_start_cmd)) {	/* command has been truncated --> do NOT execute it */
-					fprintf(stderr, "error: parsed start command has been truncated! --> won't execute it\n");
-					logprint("error: parsed start command has been truncated! --> won't execute it");
-					exit(0); /* exit child */
-				}
-				if(attempt->door->stop_command) {
-					cmd_len = parse_cmd(parsed_stop_cmd, sizeof(parsed_stop_cmd), attempt->door->stop_command, attempt->src);
-					if(cmd_len >= sizeof(parsed_stop_cmd)) {	/* command has been truncated --> do NOT execute it */
-						fprintf(stderr, "error: parsed stop command has been truncated! --> won't execute start command\n");
-						logprint("error: parsed stop command has been truncated! --> won't execute start command");
-						exit(0); /* exit child */
-					}
-				}
-
-				/* all parsing ok --> execute the parsed (%IP% = source IP) command */
-				exec_cmd(parsed_start_cmd, attempt->door->name);
-				/* if stop_command is set, sleep for cmd_timeout and run it*/
-				if(attempt->door->stop_command){
-					sleep(attempt->door->cmd_timeout);
-					if(attempt->srchost) {
-						vprint("%s (%s): %s: command timeout\n", attempt->src, attempt->srchost, attempt->door->name);
-						logprint("%s (%s): %s: command timeout", attempt->src, attempt->srchost, attempt->door->name);
-					} else {
-						vprint("%s: %s: command timeout\n", attempt->src, attempt->door->name);
-						logprint("%s: %s: command timeout", attempt->src, attempt->door->name);
-					}
-					exec_cmd(parsed_stop_cmd, attempt->door->name);
-				}
-
-				exit(0); /* exit child */
+		/* the door may be gone after the one time sequence block */
+		if(ratelimit_open(attempt->srcaddr, ts)) {
+			if(attempt->door->nft_set) {
+				add_to_nft_set(attempt);
 			}
+			open_door(attempt, ts);
+			PROBE5(attempt_done, attempt->srcaddr, attempt->door->name, attempt->stage, attempt->door->seqcount, 1);
+		} else {
+			vprint("%s: %s: open rate exceeded, not opening\n", attempt->src, attempt->door->name);
+			logprint("%s: %s: open rate exceeded, not opening", attempt->src, attempt->door->name);
+			PROBE5(attempt_done, attempt->srcaddr, attempt->door->name, attempt->stage, attempt->door->seqcount, 0);
 		}
-		/* change to next sequence if one time sequences are used.
-		 * Note that here the door will eventually be closed in
-		 * get_new_one_time_sequence() if no more sequences are left */
+		/* change to next sequence if one time sequences are used. The
+		 * sequence has been seen on the wire, so it is used up even if the
+		 * door was not opened. Note that here the door will eventually be
+		 * closed in get_new_one_time_sequence() if no more sequences are left */
 		if(attempt->door->one_time_sequences_fd) {
 			disable_used_one_time_sequence(attempt->door);
 			get_new_one_time_sequence(attempt->door);
@@ -1448,9 +3552,630 @@ void process_attempt(knocker_t *attempt)
 			/* update pcap filter */
 			free(attempt->door->pcap_filter_exp);
 			attempt->door->pcap_filter_exp = NULL;
-			generate_pcap_filter();
+			generate_pcap_filter(attempt->door->listener);
+		}
+		return;
+	}
+	PROBE5(attempt_done, attempt->srcaddr, attempt->door->name, attempt->stage, attempt->door->seqcount, 0);
+}
+
+/* Open the door for the knocker: run its start command (or add the knocker
+ * to the batch), let it through the XDP gate and tell the plugin. Whatever
+ * has to be undone after cmd_timeout is held as a lease of the knocker on
+ * the door; knocking again while it is held just extends it.
+ */
+void open_door(knocker_t *attempt, const struct timeval *ts)
+{
+	opendoor_t *door = attempt->door;
+	uint64_t expires = now_ms() + (uint64_t)door->cmd_timeout * 1000;
+	stop_job_t *job = NULL;
+	struct timeval now;
+	lease_t *lease;
+
+	evstream_publish(EVSTREAM_OPEN, attempt->srcaddr, 0, door->name, ts);
+	eventlog_write(EVENTLOG_OPEN, attempt->srcaddr, door->event_id, attempt->stage, 0, 0, tv_usecs(ts));
+	TRACE(TRACE_OPEN, attempt->srcaddr, door->event_id, 0, 0, attempt->stage, tv_usecs(ts));
+	METRIC_INC(door->metrics->opened);
+	if((lease = lease_find(leases, attempt->srcaddr, door->name)) != NULL) {
+		vprint("%s: %s: door is open already, extending it by %d seconds\n", attempt->src, door->name, door->cmd_timeout);
+		logprint("%s: %s: door is open already, extending it by %d seconds", attempt->src, door->name, door->cmd_timeout);
+		lease->expires = expires;
+		lease->renewals++;
+		journal_append(JOURNAL_EXTEND, ((stop_job_t*)lease->data)->id, wall_time(expires), NULL, 0);
+		if(door->xdp_count) {
+			grant_xdp(attempt);
+		}
+		return;
+	}
+
+	if(door->start_tmpl && door->batch_window) {
+		/* run the associated command with those of other knockers. The
+		 * knocker still gets a lease of its own, which keeps a second knock
+		 * out of the next batch and the stop command of the batch waiting */
+		add_to_batch(attempt, ts);
+		if(door->stop_tmpl) {
+			job = new_stop_job(door, attempt->src, attempt->srchost);
+		}
+	} else if(door->start_tmpl) {
+		/* run the associated command */
+		job = run_commands(attempt, ts);
+		gettimeofday(&now, NULL);
+		note_latency(door->metrics, LATENCY_DISPATCH, attempt->decided, tv_usecs(&now));
+	}
+	if(door->xdp_count && grant_xdp(attempt) == 0) {
+		if(job == NULL) {
+			job = new_stop_job(door, attempt->src, attempt->srchost);
+		}
+		strcpy(job->xdp_netns, door->listener->netns);
+		strcpy(job->xdp_iface, door->listener->iface);
+		job->xdp_count = door->xdp_count;
+		memcpy(job->xdp_port, door->xdp_port, sizeof(job->xdp_port));
+		memcpy(job->xdp_proto, door->xdp_proto, sizeof(job->xdp_proto));
+	}
+	if(door->plugin) {
+		if(job == NULL) {
+			job = new_stop_job(door, attempt->src, attempt->srchost);
+		}
+		job->plugin = door->plugin;
+		job->event = notify_plugin(attempt, ts);
+	}
+	if(job == NULL) {
+		return;
+	}
+	job->addr = attempt->srcaddr;
+	if((lease = lease_add(leases, attempt->srcaddr, door->name)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	lease->opened = ts->tv_sec;
+	lease->expires = expires;
+	lease->data = job;
+	job->lease = lease;
+	schedule_stop(job, expires);
+}
+
+/* Run the start command of the door that attempt has opened. Returns its
+ * stop command, to be scheduled by the caller, or NULL if there is none.
+ */
+stop_job_t* run_commands(knocker_t *attempt, const struct timeval *ts)
+{
+	opendoor_t *door = attempt->door;
+	cmd_vars_t vars;
+
+	vars.ip = attempt->src;
+	vars.ips = attempt->src;
+	vars.door = door->name;
+	vars.port = door->sequence[door->seqcount-1];
+	vars.proto = door->protocol[door->seqcount-1] == IPPROTO_UDP ? "udp" : "tcp";
+	vars.time = ts->tv_sec;
+	return(start_door(door, &vars, attempt->src, attempt->srchost, NULL, 0));
+}
+
+/* Run the start command of a door with the given variables and input. The
+ * stop command is expanded with the same ones and returned as a job for the
+ * caller to schedule, or NULL if the door has none. src and srchost are only
+ * used for logging.
+ */
+stop_job_t* start_door(opendoor_t *door, const cmd_vars_t *vars, const char *src, const char *srchost,
+		const char *input, size_t inlen)
+{
+	char *start_args, *stop_args = NULL;
+	size_t start_len, stop_len = 0;
+	char nspath[PATH_MAX];
+	stop_job_t *job;
+
+	if((start_args = cmdtmpl_expand(door->start_tmpl, vars, &start_len)) == NULL ||
+			(door->stop_tmpl && (stop_args = cmdtmpl_expand(door->stop_tmpl, vars, &stop_len)) == NULL)) {
+		perror("malloc");
+		exit(1);
+	}
+	netns_path(door->netns, nspath, sizeof(nspath));
+
+	exec_cmd(start_args, start_len, door->name, nspath, input, inlen, EXEC_PRIO_START, door->exec_limit, 0);
+	free(start_args);
+	if(stop_args == NULL) {
+		return(NULL);
+	}
+	job = new_stop_job(door, src, srchost);
+	if((job->netns = strdup(nspath)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	job->args = stop_args;
+	job->len = stop_len;
+	if(inlen) {
+		if((job->input = malloc(inlen)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		memcpy(job->input, input, inlen);
+		job->inlen = inlen;
+	}
+	return(job);
+}
+
+stop_job_t* new_stop_job(opendoor_t *door, const char *src, const char *srchost)
+{
+	stop_job_t *job;
+
+	if((job = calloc(1, sizeof(stop_job_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(job->name, door->name);
+	strncpy(job->src, src, sizeof(job->src)-1);
+	job->exec_limit = door->exec_limit;
+	if(srchost && (job->srchost = strdup(srchost)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return(job);
+}
+
+/* Queue a stop job to run at due. New jobs are journaled.
+ */
+void schedule_stop(stop_job_t *job, uint64_t due)
+{
+	if(timerq_add(stop_timers, due, job)) {
+		perror("malloc");
+		exit(1);
+	}
+	if(job->id == 0) {
+		job->id = ++journal_id;
+		journal_job(job, due);
+	}
+}
+
+/* Wall clock time of a now_ms() time, rounded up to the next second
+ */
+time_t wall_time(uint64_t due)
+{
+	uint64_t now = now_ms();
+
+	return(time(NULL) + (due > now ? (time_t)((due - now + 999) / 1000) : 0));
+}
+
+/* Append the OPEN record of a stop job due at due to the journal
+ */
+void journal_job(stop_job_t *job, uint64_t due)
+{
+	job_record_t *rec;
+	size_t hostlen, nslen, argslen, size;
+	char *p;
+
+	if(!journal_enabled()) {
+		return;
+	}
+	hostlen = job->srchost ? strlen(job->srchost) + 1 : 0;
+	nslen = job->netns ? strlen(job->netns) + 1 : 0;
+	argslen = job->event ? strlen(job->event->args) + 1 : 0;
+	size = sizeof(job_record_t) + hostlen + nslen + job->len + job->inlen + argslen;
+	if((rec = calloc(1, size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(rec->name, job->name);
+	strcpy(rec->src, job->src);
+	rec->addr = job->addr;
+	if(job->lease) {
+		rec->leased = 1;
+		rec->addr = job->lease->addr;
+		rec->opened = job->lease->opened;
+		rec->renewals = job->lease->renewals;
+		due = job->lease->expires;
+	}
+	strcpy(rec->xdp_netns, job->xdp_netns);
+	strcpy(rec->xdp_iface, job->xdp_iface);
+	rec->xdp_count = job->xdp_count;
+	memcpy(rec->xdp_port, job->xdp_port, sizeof(rec->xdp_port));
+	memcpy(rec->xdp_proto, job->xdp_proto, sizeof(rec->xdp_proto));
+	if(job->event) {
+		strcpy(rec->plugin, plugin_name(job->plugin));
+		rec->time = job->event->time;
+		rec->timeout = job->event->timeout;
+		rec->seqcount = job->event->count;
+		memcpy(rec->sequence, job->event->ports, job->event->count * sizeof(uint16_t));
+		memcpy(rec->protocol, job->event->protocols, job->event->count * sizeof(uint16_t));
+	}
+	rec->hostlen = hostlen;
+	rec->nslen = nslen;
+	rec->len = job->len;
+	rec->inlen = job->inlen;
+	rec->argslen = argslen;
+	rec->exec_limit = job->exec_limit;
+	p = (char*)(rec + 1);
+	memcpy(p, job->srchost, hostlen);
+	memcpy(p += hostlen, job->netns, nslen);
+	memcpy(p += nslen, job->args, job->len);
+	memcpy(p += job->len, job->input, job->inlen);
+	if(job->event) {
+		memcpy(p + job->inlen, job->event->args, argslen);
+	}
+	if(journal_append(JOURNAL_OPEN, job->id, wall_time(due), rec, size)) {
+		perror("malloc");
+		exit(1);
+	}
+	free(rec);
+}
+
+char* copy_field(const char *p, size_t len)
+{
+	char *copy;
+
+	if(len == 0) {
+		return(NULL);
+	}
+	if((copy = malloc(len)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(copy, p, len);
+	return(copy);
+}
+
+/* Reschedule a stop job found in the journal, counting it in *arg. Jobs
+ * that are overdue run on the first pass of the event loop.
+ */
+void replay_job(uint64_t id, time_t expires, const void *data, size_t len, void *arg)
+{
+	const job_record_t *rec = data;
+	const char *p = (const char*)(rec + 1);
+	time_t left = expires - time(NULL);
+	uint64_t due = now_ms() + (left > 0 ? (uint64_t)left * 1000 : 0);
+	knockd_event_t event;
+	char plugin[PLUGIN_NAME_MAX];
+	stop_job_t *job;
+	listener_t *l;
+	int i;
+
+	if(len < sizeof(job_record_t) ||
+			len != sizeof(job_record_t) + rec->hostlen + rec->nslen + rec->len + rec->inlen + rec->argslen ||
+			(rec->hostlen && p[rec->hostlen-1]) || (rec->nslen && p[rec->hostlen+rec->nslen-1]) ||
+			(rec->len && p[rec->hostlen+rec->nslen+rec->len-1]) || (rec->argslen && p[len-sizeof(job_record_t)-1]) ||
+			rec->xdp_count > SEQ_MAX || rec->seqcount > SEQ_MAX) {
+		fprintf(stderr, "journal: ignoring bad record %llu\n", (unsigned long long)id);
+		logprint("journal: ignoring bad record %llu", (unsigned long long)id);
+		return;
+	}
+	if((job = calloc(1, sizeof(stop_job_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	job->id = id;
+	/* the fields are as large as ours, and need not be terminated */
+	memcpy(job->name, rec->name, sizeof(job->name));
+	job->name[sizeof(job->name)-1] = '\0';
+	memcpy(job->src, rec->src, sizeof(job->src));
+	job->src[sizeof(job->src)-1] = '\0';
+	job->addr = rec->addr;
+	memcpy(job->xdp_netns, rec->xdp_netns, sizeof(job->xdp_netns));
+	job->xdp_netns[sizeof(job->xdp_netns)-1] = '\0';
+	memcpy(job->xdp_iface, rec->xdp_iface, sizeof(job->xdp_iface));
+	job->xdp_iface[sizeof(job->xdp_iface)-1] = '\0';
+	job->xdp_count = rec->xdp_count;
+	memcpy(job->xdp_port, rec->xdp_port, sizeof(job->xdp_port));
+	memcpy(job->xdp_proto, rec->xdp_proto, sizeof(job->xdp_proto));
+	job->srchost = copy_field(p, rec->hostlen);
+	job->netns = copy_field(p += rec->hostlen, rec->nslen);
+	job->args = copy_field(p += rec->nslen, rec->len);
+	job->len = rec->len;
+	job->input = copy_field(p += rec->len, rec->inlen);
+	job->inlen = rec->inlen;
+	job->exec_limit = rec->exec_limit;
+	memcpy(plugin, rec->plugin, sizeof(plugin));
+	plugin[sizeof(plugin)-1] = '\0';
+	if(plugin[0] && rec->argslen && (job->plugin = plugin_find(plugin)) == NULL) {
+		fprintf(stderr, "journal: %s: plugin %s is gone, dropping its stop event\n", job->name, plugin);
+		logprint("journal: %s: plugin %s is gone, dropping its stop event", job->name, plugin);
+	} else if(job->plugin) {
+		event.type = KNOCKD_EVENT_STOP;
+		event.src.s_addr = htonl(rec->addr);
+		event.door = job->name;
+		event.ports = rec->sequence;
+		event.protocols = rec->protocol;
+		event.count = rec->seqcount;
+		event.time = rec->time;
+		event.timeout = rec->timeout;
+		event.args = p + rec->inlen;
+		if((job->event = plugin_event_copy(&event)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	if(rec->leased && lease_find(leases, rec->addr, job->name) == NULL) {
+		if((job->lease = lease_add(leases, rec->addr, job->name)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		job->lease->opened = rec->opened;
+		job->lease->renewals = rec->renewals;
+		job->lease->expires = due;
+		job->lease->data = job;
+	}
+	/* the XDP gate is a new one, grant the rest of the time again */
+	if(job->xdp_count && left > 0 && (l = find_listener(job->xdp_netns, job->xdp_iface)) && l->xdp) {
+		for(i = 0; i < job->xdp_count; i++) {
+			xdpgate_grant(l->xdp, job->addr, job->xdp_port[i], job->xdp_proto[i], left);
+		}
+	}
+	schedule_stop(job, due);
+	(*(unsigned int*)arg)++;
+}
+
+void journal_pending(void *data, uint64_t due, void *arg)
+{
+	journal_job((stop_job_t*)data, due);
+}
+
+/* Rewrite the journal with just the pending stop jobs, those whose
+ * command the executor has not run yet included
+ */
+void compact_journal()
+{
+	stop_job_t *job;
+	unsigned int running = 0;
+
+	if(journal_begin_compaction()) {
+		fprintf(stderr, "error: cannot compact journal %s: %s\n", o_journal, strerror(errno));
+		logprint("error: cannot compact journal %s: %s", o_journal, strerror(errno));
+		return;
+	}
+	timerq_walk(stop_timers, journal_pending, NULL);
+	for(job = running_stops; job; job = job->next) {
+		journal_job(job, now_ms());
+		running++;
+	}
+	if(journal_end_compaction()) {
+		fprintf(stderr, "error: cannot compact journal %s: %s\n", o_journal, strerror(errno));
+		logprint("error: cannot compact journal %s: %s", o_journal, strerror(errno));
+		return;
+	}
+	dprint("compacted journal %s to %u pending stop commands\n", o_journal, timerq_count(stop_timers) + running);
+}
+
+/* Add the knocker to the batch of its door, starting a new batch that is run
+ * once the batch window has passed if there is none
+ */
+void add_to_batch(knocker_t *attempt, const struct timeval *ts)
+{
+	opendoor_t *door = attempt->door;
+	batch_t *batch = door->batch;
+	size_t n = strlen(attempt->src);
+	char *p;
+
+	if(batch == NULL) {
+		if((batch = calloc(1, sizeof(batch_t))) == NULL ||
+				timerq_add(batch_timers, now_ms() + door->batch_window, batch)) {
+			perror("malloc");
+			exit(1);
+		}
+		batch->door = door;
+		batch->time = ts->tv_sec;
+		batch->decided = attempt->decided;
+		door->batch = batch;
+	}
+	/* a knocker that is in already is not added twice */
+	for(p = batch->addrs; p && p < batch->addrs + batch->len; p += strcspn(p, "\n") + 1) {
+		if(!strncmp(p, attempt->src, n) && p[n] == '\n') {
+			return;
+		}
+	}
+	if((p = realloc(batch->addrs, batch->len + n + 1)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	batch->addrs = p;
+	memcpy(batch->addrs + batch->len, attempt->src, n);
+	batch->addrs[batch->len + n] = '\n';
+	batch->len += n + 1;
+	batch->count++;
+	dprint("%s: %s: added to batch (%u knockers)\n", attempt->src, door->name, batch->count);
+	/* the addresses go to the executor twice, as arguments and input */
+	if(batch->len >= EXEC_MSG_MAX / 4) {
+		run_batch(batch);
+	}
+}
+
+/* Run the commands of a door once for all knockers of its batch. They get the
+ * addresses in %IPS% and on stdin, one per line. The batch is done with
+ * afterwards, its timer just frees it.
+ */
+void run_batch(batch_t *batch)
+{
+	opendoor_t *door = batch->door;
+	stop_job_t *job;
+	cmd_vars_t vars;
+	struct timeval now;
+	char src[16];
+	char *ips;
+	size_t i;
+
+	if((ips = malloc(batch->len)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for(i = 0; i < batch->len; i++) {
+		ips[i] = batch->addrs[i] == '\n' ? ' ' : batch->addrs[i];
+	}
+	ips[batch->len-1] = '\0';
+
+	snprintf(src, sizeof(src), "%u knockers", batch->count);
+	vprint("%s: %s: running batch\n", src, door->name);
+	logprint("%s: %s: running batch", src, door->name);
+	vars.ip = ips;
+	vars.ips = ips;
+	vars.door = door->name;
+	vars.port = door->sequence[door->seqcount-1];
+	vars.proto = door->protocol[door->seqcount-1] == IPPROTO_UDP ? "udp" : "tcp";
+	vars.time = batch->time;
+	if((job = start_door(door, &vars, src, NULL, batch->addrs, batch->len)) != NULL) {
+		schedule_stop(job, now_ms() + (uint64_t)door->cmd_timeout * 1000);
+	}
+	gettimeofday(&now, NULL);
+	note_latency(door->metrics, LATENCY_DISPATCH, batch->decided, tv_usecs(&now));
+
+	free(ips);
+	free(batch->addrs);
+	batch->addrs = NULL;
+	batch->door = NULL;
+	door->batch = NULL;
+}
+
+/* Run the batches whose window has passed at now
+ */
+void run_batch_timers(uint64_t now)
+{
+	batch_t *batch;
+
+	while((batch = timerq_pop(batch_timers, now)) != NULL) {
+		if(batch->door) {
+			run_batch(batch);
+		}
+		free(batch);
+	}
+}
+
+/* Send the start event of the door attempt has opened to its plugin.
+ * Returns the stop event, for the stop job.
+ */
+knockd_event_t* notify_plugin(knocker_t *attempt, const struct timeval *ts)
+{
+	opendoor_t *door = attempt->door;
+	knockd_event_t event, *stop;
+
+	event.type = KNOCKD_EVENT_START;
+	event.src.s_addr = htonl(attempt->srcaddr);
+	event.door = door->name;
+	event.ports = door->sequence;
+	event.protocols = door->protocol;
+	event.count = door->seqcount;
+	event.time = ts->tv_sec;
+	event.timeout = door->cmd_timeout;
+	event.args = door->plugin_args;
+	send_event(door->plugin, &event, attempt->src);
+
+	event.type = KNOCKD_EVENT_STOP;
+	if((stop = plugin_event_copy(&event)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return(stop);
+}
+
+/* Queue an event for the plugin. Returns non-zero if the plugin cannot take
+ * it; a start event is then lost, a stop event is for the caller to send
+ * again.
+ */
+int send_event(plugin_t *plugin, const knockd_event_t *event, const char *src)
+{
+	if(plugin_submit(plugin, event)) {
+		if(event->type == KNOCKD_EVENT_START) {
+			vprint("%s: %s: plugin is not keeping up, dropped the start event\n", src, event->door);
+			logprint("%s: %s: plugin is not keeping up, dropped the start event", src, event->door);
+		} else {
+			vprint("%s: %s: plugin is not keeping up, trying the stop event again\n", src, event->door);
+			logprint("%s: %s: plugin is not keeping up, trying the stop event again", src, event->door);
+		}
+		return(1);
+	}
+	dprint("%s: %s: sent the %s event to the plugin\n", src, event->door,
+			event->type == KNOCKD_EVENT_START ? "start" : "stop");
+	return(0);
+}
+
+/* Add the knocker to the nftables set of the door, for cmd_timeout seconds
+ */
+void add_to_nft_set(knocker_t *attempt)
+{
+	opendoor_t *door = attempt->door;
+	listener_t *l = door->listener;
+	nftset_t *set = door->nft_set;
+	int err, nsfd;
+
+	/* the socket talks to the namespace it was opened in */
+	if(l->nft_sock < 0) {
+		nsfd = -1;
+		if(l->netns[0] && (nsfd = enter_netns(l->netns)) < 0) {
+			return;
+		}
+		l->nft_sock = nftset_open();
+		err = errno;
+		if(nsfd >= 0) {
+			close(nsfd);
+			leave_netns();
+		}
+		if(l->nft_sock < 0) {
+			fprintf(stderr, "error: cannot open netlink socket: %s\n", strerror(err));
+			logprint("error: cannot open netlink socket: %s", strerror(err));
+			return;
+		}
+	}
+
+	if((err = nftset_add(l->nft_sock, set, attempt->srcaddr, door->cmd_timeout)) != 0) {
+		fprintf(stderr, "%s: cannot add %s to nft set %s %s %s: %s\n", door->name, attempt->src,
+				nftset_family_name(set->family), set->table, set->set, strerror(err));
+		logprint("%s: cannot add %s to nft set %s %s %s: %s", door->name, attempt->src,
+				nftset_family_name(set->family), set->table, set->set, strerror(err));
+		return;
+	}
+	vprint("%s: %s: added to nft set %s %s %s for %d seconds\n", attempt->src, door->name,
+			nftset_family_name(set->family), set->table, set->set, door->cmd_timeout);
+	logprint("%s: %s: added to nft set %s %s %s for %d seconds", attempt->src, door->name,
+			nftset_family_name(set->family), set->table, set->set, door->cmd_timeout);
+}
+
+/* Let the knocker through the XDP gate of the door's listener to the ports
+ * the door protects, for cmd_timeout seconds. The grants expire in the kernel
+ * at that time, the stop job of the lease takes them back as well. Returns
+ * non-zero on error.
+ */
+int grant_xdp(knocker_t *attempt)
+{
+	opendoor_t *door = attempt->door;
+	listener_t *l = door->listener;
+	int i;
+
+	if(l->xdp == NULL) {
+		return(1);
+	}
+	for(i = 0; i < door->xdp_count; i++) {
+		if(xdpgate_grant(l->xdp, attempt->srcaddr, door->xdp_port[i], door->xdp_proto[i], door->cmd_timeout)) {
+			fprintf(stderr, "%s: cannot let %s through the XDP gate: %s\n", door->name, attempt->src, strerror(errno));
+			logprint("%s: cannot let %s through the XDP gate: %s", door->name, attempt->src, strerror(errno));
+			return(1);
 		}
 	}
+	vprint("%s: %s: let through the XDP gate for %d seconds\n", attempt->src, door->name, door->cmd_timeout);
+	logprint("%s: %s: let through the XDP gate for %d seconds", attempt->src, door->name, door->cmd_timeout);
+	return(0);
+}
+
+/* Take back the XDP grants of a stop job, if its listener is still there
+ */
+void revoke_xdp(stop_job_t *job)
+{
+	listener_t *l;
+	int i;
+
+	if((l = find_listener(job->xdp_netns, job->xdp_iface)) == NULL || l->xdp == NULL) {
+		return;
+	}
+	for(i = 0; i < job->xdp_count; i++) {
+		xdpgate_revoke(l->xdp, job->addr, job->xdp_port[i], job->xdp_proto[i]);
+	}
+	dprint("%s: %s: removed from the XDP gate\n", job->src, job->name);
+}
+
+/* Count a failed or timed out knock attempt against its source and
+ * suppress the source if it keeps failing
+ */
+void note_failure(knocker_t *attempt, time_t now)
+{
+	if(offender_fail(attempt->srcaddr, now)) {
+		vprint("%s: too many failed knocks, suppressing for %d seconds\n", attempt->src, o_scan_block);
+		logprint("%s: too many failed knocks, suppressing for %d seconds", attempt->src, o_scan_block);
+	}
 }
 
 /* Sniff an interface, looking for port-knock sequences
@@ -1466,6 +4191,7 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 	/* TCP/IP data */
 	struct in_addr inaddr;
 	unsigned short sport, dport;
+	uint32_t src, dst;
 	char srcIP[16], dstIP[16];
 	/* timestamp */
 	time_t pkt_secs = hdr->ts.tv_sec;
@@ -1475,34 +4201,61 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 	PMList *lp;
 	knocker_t *attempt = NULL;
 	PMList *found_attempts = NULL;
+	listener_t *l = (listener_t*)arg;
 
-	if(lltype == DLT_EN10MB) {
+	if(l->overlap.tv_sec && seen_on_replaced(l, hdr, packet)) {
+		return;
+	}
+	METRIC_INC(metrics.packets_seen);
+	if(l->lltype == DLT_EN10MB) {
 		eth = (struct ether_header*)packet;
 		if(ntohs(eth->ether_type) != ETHERTYPE_IP) {
+			METRIC_INC(metrics.packets_rejected[REJECT_LINK]);
 			return;
 		}
 
 		ip = (struct ip*)(packet + sizeof(struct ether_header));
 #ifdef __linux__
-	} else if(lltype == DLT_LINUX_SLL) {
+	} else if(l->lltype == DLT_LINUX_SLL) {
 		ip = (struct ip*)((u_char*)packet + 16);
 #endif
-	} else if(lltype == DLT_RAW) {
+	} else if(l->lltype == DLT_RAW) {
 		ip = (struct ip*)((u_char*)packet);
 	} else {
 		dprint("link layer header type of packet not recognized, ignoring...\n");
+		METRIC_INC(metrics.packets_rejected[REJECT_LINK]);
+		TRACE(TRACE_REJECT, 0, TRACE_NO_DOOR, 0, 0, REJECT_LINK, tv_usecs(&hdr->ts));
 		return;
 	}
 
 	if(ip->ip_v != 4) {
 		/* no IPv6 yet */
 		dprint("packet is not IPv4, ignoring...\n");
+		METRIC_INC(metrics.packets_rejected[REJECT_NOT_IPV4]);
+		TRACE(TRACE_REJECT, 0, TRACE_NO_DOOR, 0, 0, REJECT_NOT_IPV4, tv_usecs(&hdr->ts));
 		return;
 	}
 	if(ip->ip_p == IPPROTO_ICMP) {
 		/* we don't do ICMP */
+		METRIC_INC(metrics.packets_rejected[REJECT_ICMP]);
+		TRACE(TRACE_REJECT, ntohl(ip->ip_src.s_addr), TRACE_NO_DOOR, 0, IPPROTO_ICMP, REJECT_ICMP, tv_usecs(&hdr->ts));
+		return;
+	}
+
+	/* drop packets from suppressed scanners before doing anything else */
+	src = ntohl(ip->ip_src.s_addr);
+	if(offender_blocked(src, pkt_secs)) {
+		METRIC_INC(metrics.packets_rejected[REJECT_SCANNER]);
+		TRACE(TRACE_REJECT, src, TRACE_NO_DOOR, 0, ip->ip_p, REJECT_SCANNER, tv_usecs(&hdr->ts));
+		return;
+	}
+	if(!ratelimit_packet(src, &hdr->ts)) {
+		dprint("packet rate exceeded, ignoring...\n");
+		METRIC_INC(metrics.packets_rejected[REJECT_RATE]);
+		TRACE(TRACE_REJECT, src, TRACE_NO_DOOR, 0, ip->ip_p, REJECT_RATE, tv_usecs(&hdr->ts));
 		return;
 	}
+	METRIC_INC(metrics.packets_decoded);
 
 	sport = dport = 0;
 
@@ -1533,12 +4286,15 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 	inaddr.s_addr = ip->ip_dst.s_addr;
 	strncpy(dstIP, inet_ntoa(inaddr), sizeof(dstIP)-1);
 	dstIP[sizeof(dstIP)-1] = '\0';
+	dst = ntohl(ip->ip_dst.s_addr);
 
 	dprint("%s %s: %s: %s:%d -> %s:%d %d bytes\n", pkt_date, pkt_time,
 			proto, srcIP, sport, dstIP, dport, hdr->len);
+	TRACE(TRACE_DECODE, src, TRACE_NO_DOOR, dport, ip->ip_p, tcp ? tcp->th_flags : 0, tv_usecs(&hdr->ts));
+	PROBE5(packet, src, dst, ip->ip_p, dport, tcp ? tcp->th_flags : 0);
 
 	/* clean up expired/completed/failed attempts */
-	lp = attempts;
+	lp = l->attempts;
 	while(lp != NULL) {
 		int nix = 0; /* Clear flag */
 		PMList *lpnext = lp->next;
@@ -1562,6 +4318,7 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 		if(!nix && (pkt_secs - attempt->seq_start) >= attempt->door->seq_timeout) {
 
 			/* Do we know the hostname? */
+			lookup_host(attempt);
 			if(attempt->srchost) {
 				/* Log the hostname */
 				vprint("%s (%s): %s: sequence timeout (stage %d)\n", attempt->src, attempt->srchost,
@@ -1575,6 +4332,15 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 				logprint("%s: %s: sequence timeout (stage %d)\n", attempt->src,
 						attempt->door->name, attempt->stage);
 			}
+			evstream_publish(EVSTREAM_TIMEOUT, attempt->srcaddr, attempt->stage, attempt->door->name, &hdr->ts);
+			eventlog_write(EVENTLOG_TIMEOUT, attempt->srcaddr, attempt->door->event_id, attempt->stage,
+					0, 0, tv_usecs(&hdr->ts));
+			TRACE(TRACE_TIMEOUT, attempt->srcaddr, attempt->door->event_id, 0, 0, attempt->stage,
+					tv_usecs(&hdr->ts));
+			PROBE3(attempt_timeout, attempt->srcaddr, attempt->door->name, attempt->stage);
+			METRIC_INC(attempt->door->metrics->timed_out);
+			METRIC_INC(attempt->door->metrics->stage_timed_out[METRICS_STAGE(attempt->stage)]);
+			note_failure(attempt, pkt_secs);
 			nix = 1;
 		}
 
@@ -1583,8 +4349,8 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 			/* splice this entry out of the list */
 			if(lp->prev) lp->prev->next = lp->next;
 			if(lp->next) lp->next->prev = lp->prev;
-			/* If lp is the only element of the list then empty the list */
-			if(lp == attempts) attempts = NULL;
+			/* If lp is the head of the list then move the head on */
+			if(lp == l->attempts) l->attempts = lpnext;
 			lp->prev = lp->next = NULL;
 			if (attempt->srchost) {
 				free(attempt->srchost);
@@ -1598,10 +4364,9 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 
 	attempt = NULL;
 	/* look for this guy in our attempts list */
-	for(lp = attempts; lp; lp = lp->next) {
+	for(lp = l->attempts; lp; lp = lp->next) {
 		knocker_t *att = (knocker_t*)lp->data;
-		if(!strcmp(srcIP, att->src) &&
-		   !target_strcmp(dstIP, att->door->target)) {
+		if(att->srcaddr == src && target_match(att->door, dst)) {
 			found_attempts = list_add(found_attempts, att);
 		}
 	}
@@ -1617,28 +4382,45 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 			int flagsmatch = flags_match(attempt->door, ip, tcp);
 			if(flagsmatch && ip->ip_p == attempt->door->protocol[attempt->stage] &&
 					dport == attempt->door->sequence[attempt->stage]) {
-				process_attempt(attempt);
+				process_attempt(attempt, &hdr->ts);
 			} else if(flagsmatch == 0) {
 				/* TCP flags didn't match -- just ignore this packet, don't
 				 * invalidate the knock.
 				 */
+				TRACE(TRACE_FLAGS, src, attempt->door->event_id, dport, ip->ip_p, tcp->th_flags,
+						tv_usecs(&hdr->ts));
 			} else {
 				/* invalidate the knock sequence, it will be removed in the
 				 * next sniff() call.
 				 */
+				eventlog_write(EVENTLOG_FAIL, attempt->srcaddr, attempt->door->event_id, attempt->stage,
+						dport, ip->ip_p, tv_usecs(&hdr->ts));
+				TRACE(TRACE_INVALID, src, attempt->door->event_id, dport, ip->ip_p, attempt->stage,
+						tv_usecs(&hdr->ts));
+				PROBE4(attempt_invalid, src, attempt->door->name, attempt->stage, dport);
+				METRIC_INC(attempt->door->metrics->invalidated);
+				METRIC_INC(attempt->door->metrics->stage_invalidated[METRICS_STAGE(attempt->stage)]);
 				attempt->stage = -1;
+				note_failure(attempt, pkt_secs);
 			}
 		} else {
 			/* did they hit the first port correctly? */
-			for(lp = doors; lp; lp = lp->next) {
+			for(lp = l->doors; lp; lp = lp->next) {
 				opendoor_t *door = (opendoor_t*)lp->data;
 				/* if we're working with TCP, try to match the flags */
 				if(!flags_match(door, ip, tcp)) {
+					TRACE(TRACE_FLAGS, src, door->event_id, dport, ip->ip_p, tcp->th_flags, tv_usecs(&hdr->ts));
 					continue;
 				}
 				if(ip->ip_p == door->protocol[0] && dport == door->sequence[0] &&
-				   !target_strcmp(dstIP, door->target)) {
-					struct hostent *he;
+				   target_match(door, dst)) {
+					/* check the source ACL before we allocate anything */
+					if(!acl_match(door, src)) {
+						dprint("%s: %s: source not allowed, ignoring...\n", srcIP, door->name);
+						METRIC_INC(metrics.packets_rejected[REJECT_ACL]);
+						TRACE(TRACE_REJECT, src, door->event_id, dport, ip->ip_p, REJECT_ACL, tv_usecs(&hdr->ts));
+						continue;
+					}
 					/* create a new entry */
 					attempt = (knocker_t*)malloc(sizeof(knocker_t));
 					attempt->srchost = NULL;
@@ -1647,20 +4429,14 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 						exit(1);
 					}
 					strcpy(attempt->src, srcIP);
-					/* try a reverse lookup if enabled  */
-					if (o_lookup) {
-						inaddr.s_addr = ip->ip_src.s_addr;
-						he = gethostbyaddr((void *)&inaddr, sizeof(inaddr), AF_INET);
-						if(he) {
-							attempt->srchost = strdup(he->h_name);
-						}
-					}
-
+					attempt->srcaddr = src;
 					attempt->stage = 0;
 					attempt->seq_start = pkt_secs;
 					attempt->door = door;
-					attempts = list_add(attempts, attempt);
-					process_attempt(attempt);
+					l->attempts = list_add(l->attempts, attempt);
+					METRIC_INC(door->metrics->created);
+					PROBE3(attempt_new, src, door->name, dport);
+					process_attempt(attempt, &hdr->ts);
 				}
 			}
 		}
@@ -1669,23 +4445,28 @@ void sniff(u_char* arg, const struct pcap_pkthdr* hdr, const u_char* packet)
 	}
 }
 
-/* Compare ip against door target or all ips of our local interface
+/* Check whether addr (host byte order) is one of the door's targets or, if
+ * the door has none, one of the addresses of our local interface
  */
-int target_strcmp(char *ip, char *target) {
-	ip_literal_t *myip;
-
-	if(target && !strcmp(ip, target))
-		return 0;
-
-	if (target)
-		return 1;
+int target_match(opendoor_t *door, uint32_t addr)
+{
+	return(prefix_set_lookup(door->target_set ? door->target_set : door->listener->myip_set, addr) >= 0);
+}
 
-	for(myip = myips; myip != NULL; myip = myip->next) {
-		if(!strcmp(ip, myip->value))
-			return 0;
+/* Check addr (host byte order) against the door's source ACL. The longest
+ * matching allow or deny prefix decides; sources matching neither are only
+ * accepted if the door has no allow list.
+ */
+int acl_match(opendoor_t *door, uint32_t addr)
+{
+	if(door->acl == NULL) {
+		return(1);
+	}
+	switch(prefix_set_lookup(door->acl, addr)) {
+		case ACL_ALLOW: return(1);
+		case ACL_DENY:  return(0);
+		default:        return(door->allow_set == NULL);
 	}
-
-	return 1;
 }
 
 /* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,72 @@
+/*
+ *  knockd_plugin.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _KNOCKD_PLUGIN_H
+#define _KNOCKD_PLUGIN_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+/* Action plugins for knockd.
+ *
+ * A plugin is a shared object exporting a knockd_plugin_t named
+ * "knockd_plugin". knockd loads it at startup (see the Plugin directive)
+ * and calls its action function for doors that say
+ *
+ *   Action = plugin:<name> [args]
+ *
+ * once when a client opens the door (KNOCKD_EVENT_START) and once when
+ * Cmd_Timeout has passed (KNOCKD_EVENT_STOP). Every plugin has a thread of
+ * its own that makes all calls into it, one at a time, so a plugin needs no
+ * locking of its own and a slow one never holds up packet capture. The
+ * event and everything it points to are only valid during the call.
+ */
+#define KNOCKD_PLUGIN_ABI    1
+#define KNOCKD_PLUGIN_SYMBOL "knockd_plugin"
+
+#define KNOCKD_EVENT_START 1
+#define KNOCKD_EVENT_STOP  2
+
+typedef struct knockd_event {
+	int type;                         /* KNOCKD_EVENT_START or KNOCKD_EVENT_STOP */
+	struct in_addr src;               /* knocker's address */
+	const char *door;                 /* door name */
+	const unsigned short *ports;      /* knock sequence, host byte order */
+	const unsigned short *protocols;  /* IPPROTO_TCP or IPPROTO_UDP for each port */
+	unsigned int count;               /* number of ports */
+	time_t time;                      /* time of the knock */
+	unsigned int timeout;             /* Cmd_Timeout of the door, in seconds */
+	const char *args;                 /* what follows the plugin name in Action, "" = nothing */
+} knockd_event_t;
+
+typedef struct knockd_plugin {
+	unsigned int abi;                 /* KNOCKD_PLUGIN_ABI */
+	/* optional, called in the plugin's thread before the first event;
+	 * non-zero means the plugin cannot be used */
+	int (*init)(void **state);
+	/* non-zero means the action failed, knockd counts it */
+	int (*action)(void *state, const knockd_event_t *event);
+	/* optional, called in the plugin's thread after the last event */
+	void (*fini)(void *state);
+} knockd_plugin_t;
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
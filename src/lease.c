@@ -0,0 +1,172 @@
+/*
+ *  lease.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lease.h"
+
+#define LEASE_BUCKETS 64    /* initial number of buckets, always a power of two */
+
+struct lease_table {
+	lease_t **buckets;
+	unsigned int nbuckets;
+	unsigned int count;
+};
+
+static unsigned int lease_hash(uint32_t addr, const char *door, unsigned int nbuckets)
+{
+	uint32_t h = addr * 2654435761U;
+	const unsigned char *c;
+
+	for(c = (const unsigned char*)door; *c; c++) {
+		h = (h ^ *c) * 16777619U;
+	}
+	return((h ^ (h >> 15)) & (nbuckets - 1));
+}
+
+lease_table_t* lease_table_new()
+{
+	lease_table_t *tab;
+
+	if((tab = calloc(1, sizeof(lease_table_t))) == NULL) {
+		return(NULL);
+	}
+	if((tab->buckets = calloc(LEASE_BUCKETS, sizeof(lease_t*))) == NULL) {
+		free(tab);
+		return(NULL);
+	}
+	tab->nbuckets = LEASE_BUCKETS;
+	return(tab);
+}
+
+/* Free the table and its leases. The data of the leases is left alone.
+ */
+void lease_table_free(lease_table_t *tab)
+{
+	lease_t *lease;
+	unsigned int i;
+
+	if(tab == NULL) {
+		return;
+	}
+	for(i = 0; i < tab->nbuckets; i++) {
+		while((lease = tab->buckets[i]) != NULL) {
+			tab->buckets[i] = lease->next;
+			free(lease);
+		}
+	}
+	free(tab->buckets);
+	free(tab);
+}
+
+lease_t* lease_find(lease_table_t *tab, uint32_t addr, const char *door)
+{
+	lease_t *lease;
+
+	for(lease = tab->buckets[lease_hash(addr, door, tab->nbuckets)]; lease; lease = lease->next) {
+		if(lease->addr == addr && !strcmp(lease->door, door)) {
+			return(lease);
+		}
+	}
+	return(NULL);
+}
+
+/* Double the number of buckets. If that fails the chains just get longer.
+ */
+static void lease_grow(lease_table_t *tab)
+{
+	lease_t **buckets, *lease;
+	unsigned int i, n = tab->nbuckets * 2, h;
+
+	if((buckets = calloc(n, sizeof(lease_t*))) == NULL) {
+		return;
+	}
+	for(i = 0; i < tab->nbuckets; i++) {
+		while((lease = tab->buckets[i]) != NULL) {
+			tab->buckets[i] = lease->next;
+			h = lease_hash(lease->addr, lease->door, n);
+			lease->next = buckets[h];
+			buckets[h] = lease;
+		}
+	}
+	free(tab->buckets);
+	tab->buckets = buckets;
+	tab->nbuckets = n;
+}
+
+/* Add a zeroed lease for addr and door, which must not have one yet.
+ * Returns NULL if out of memory.
+ */
+lease_t* lease_add(lease_table_t *tab, uint32_t addr, const char *door)
+{
+	lease_t *lease;
+	unsigned int h;
+
+	if(tab->count >= tab->nbuckets * 2) {
+		lease_grow(tab);
+	}
+	if((lease = calloc(1, sizeof(lease_t))) == NULL) {
+		return(NULL);
+	}
+	lease->addr = addr;
+	strncpy(lease->door, door, sizeof(lease->door)-1);
+	h = lease_hash(addr, lease->door, tab->nbuckets);
+	lease->next = tab->buckets[h];
+	tab->buckets[h] = lease;
+	tab->count++;
+	return(lease);
+}
+
+/* Take a lease out of the table and free it
+ */
+void lease_remove(lease_table_t *tab, lease_t *lease)
+{
+	lease_t **lp;
+
+	for(lp = &tab->buckets[lease_hash(lease->addr, lease->door, tab->nbuckets)]; *lp; lp = &(*lp)->next) {
+		if(*lp == lease) {
+			*lp = lease->next;
+			tab->count--;
+			free(lease);
+			return;
+		}
+	}
+}
+
+unsigned int lease_count(const lease_table_t *tab)
+{
+	return(tab->count);
+}
+
+/* Call fn for every lease. fn must not add or remove leases.
+ */
+void lease_walk(lease_table_t *tab, lease_walk_fn fn, void *arg)
+{
+	lease_t *lease;
+	unsigned int i;
+
+	for(i = 0; i < tab->nbuckets; i++) {
+		for(lease = tab->buckets[i]; lease; lease = lease->next) {
+			fn(lease, arg);
+		}
+	}
+}
+
+/* vim: set ts=2 sw=2 noet: */
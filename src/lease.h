@@ -0,0 +1,56 @@
+/*
+ *  lease.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_LEASE_H
+#define _PAC_LEASE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Doors that are currently open, one lease per (source, door) pair. The
+ * table is a hash of the pair that grows as needed, so a knock can find
+ * the lease it renews in constant time.
+ */
+#define LEASE_NAME_MAX 128
+
+typedef struct lease {
+	struct lease *next;         /* hash chain */
+	uint32_t addr;              /* source, host byte order */
+	char door[LEASE_NAME_MAX];
+	time_t opened;              /* time the door was opened */
+	uint64_t expires;           /* time it closes, on the caller's monotonic clock */
+	unsigned int renewals;
+	void *data;                 /* owned by the caller */
+} lease_t;
+
+typedef struct lease_table lease_table_t;
+typedef void (*lease_walk_fn)(lease_t *lease, void *arg);
+
+lease_table_t* lease_table_new();
+void lease_table_free(lease_table_t *tab);
+lease_t* lease_find(lease_table_t *tab, uint32_t addr, const char *door);
+lease_t* lease_add(lease_table_t *tab, uint32_t addr, const char *door);
+void lease_remove(lease_table_t *tab, lease_t *lease);
+unsigned int lease_count(const lease_table_t *tab);
+void lease_walk(lease_table_t *tab, lease_walk_fn fn, void *arg);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
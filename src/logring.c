@@ -0,0 +1,352 @@
+/*
+ *  logring.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "logring.h"
+#include "util.h"
+
+#define BATCH     64    /* messages per writev() */
+#define NO_CHANGE (-2)  /* no new log file for the flusher */
+
+/* A bounded multi-producer queue: a slot is free for the producer that
+ * claims position pos when its seq is pos, and ready for the flusher once
+ * the producer has set it to pos + 1.
+ */
+typedef struct slot {
+	size_t seq;
+	time_t time;
+	unsigned int len;           /* of msg, the newline included */
+	char msg[LOGRING_MSG_MAX];
+} slot_t;
+
+static slot_t *ring = NULL;
+static size_t mask;
+static size_t enqueue_pos;      /* claimed by logging threads */
+static size_t dequeue_pos;      /* advanced by the flusher only */
+static int block_when_full;
+static int log_fd = -1;         /* written by the flusher while it runs */
+static int new_fd = NO_CHANGE;  /* handed over to the flusher */
+static int use_syslog;
+static unsigned long written, dropped;
+
+static pthread_t flusher;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static int running, closing, sleeping;
+
+/* "[YYYY-MM-DD HH:MM] ", as the log file has always had it
+ */
+static size_t stamp(time_t t, char *buf)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	return(sprintf(buf, "[%04d-%02d-%02d %02d:%02d] ", tm.tm_year+1900,
+			tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min));
+}
+
+static void writev_all(int fd, struct iovec *iov, int n)
+{
+	ssize_t r;
+
+	while(n > 0) {
+		r = writev(fd, iov, n);
+		if(r < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		while(n > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0) {
+			iov->iov_base = (char*)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
+
+/* Write n messages to the log file and syslog
+ */
+static void write_out(slot_t **msgs, unsigned int n)
+{
+	struct iovec iov[2 * BATCH];
+	char stamps[BATCH][32];
+	unsigned int i;
+
+	if(log_fd >= 0) {
+		for(i = 0; i < n; i++) {
+			iov[2*i].iov_base = stamps[i];
+			iov[2*i].iov_len = stamp(msgs[i]->time, stamps[i]);
+			iov[2*i+1].iov_base = msgs[i]->msg;
+			iov[2*i+1].iov_len = msgs[i]->len;
+		}
+		writev_all(log_fd, iov, 2 * n);
+	}
+	if(__atomic_load_n(&use_syslog, __ATOMIC_RELAXED)) {
+		for(i = 0; i < n; i++) {
+			syslog(LOG_NOTICE, "%.*s", (int)msgs[i]->len - 1, msgs[i]->msg);
+		}
+	}
+}
+
+static void format_msg(slot_t *s, const char *fmt, va_list args)
+{
+	int n;
+
+	s->time = time(NULL);
+	n = vsnprintf(s->msg, sizeof(s->msg) - 1, fmt, args);
+	if(n < 0) {
+		n = 0;
+	} else if(n > (int)sizeof(s->msg) - 2) {
+		n = sizeof(s->msg) - 2;
+	}
+	s->msg[n] = '\n';
+	s->msg[n+1] = '\0';
+	s->len = n + 1;
+}
+
+static void take_new_fd()
+{
+	int fd = __atomic_exchange_n(&new_fd, NO_CHANGE, __ATOMIC_SEQ_CST);
+
+	if(fd != NO_CHANGE) {
+		if(log_fd >= 0) {
+			close(log_fd);
+		}
+		log_fd = fd;
+	}
+}
+
+static slot_t* ready(size_t pos)
+{
+	slot_t *s = &ring[pos & mask];
+
+	return(__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == pos + 1 ? s : NULL);
+}
+
+static void* flush_loop(void *arg)
+{
+	slot_t *batch[BATCH], note;
+	unsigned long reported = 0, d;
+	unsigned int n, i;
+	size_t pos;
+
+	while(1) {
+		take_new_fd();
+		pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+		for(n = 0; n < BATCH && (batch[n] = ready(pos + n)) != NULL; n++);
+		if(n) {
+			write_out(batch, n);
+			/* hand the slots back for the next round of the ring */
+			for(i = 0; i < n; i++) {
+				__atomic_store_n(&batch[i]->seq, pos + i + mask + 1, __ATOMIC_RELEASE);
+			}
+			__atomic_store_n(&dequeue_pos, pos + n, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&written, n, __ATOMIC_RELAXED);
+			continue;
+		}
+		if((d = __atomic_load_n(&dropped, __ATOMIC_RELAXED)) != reported) {
+			note.time = time(NULL);
+			note.len = snprintf(note.msg, sizeof(note.msg), "%lu log messages dropped\n", d - reported);
+			reported = d;
+			batch[0] = &note;
+			write_out(batch, 1);
+			continue;
+		}
+
+		pthread_mutex_lock(&lock);
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if(closing) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		if(ready(pos) == NULL && __atomic_load_n(&new_fd, __ATOMIC_SEQ_CST) == NO_CHANGE) {
+			pthread_cond_wait(&wakeup, &lock);
+		}
+		__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&lock);
+	}
+	return(NULL);
+}
+
+static void wake()
+{
+	if(__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_signal(&wakeup);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/* Start the flusher with a ring of at least size slots. With block set,
+ * logging waits for a free slot rather than drop the message. Returns
+ * non-zero on error.
+ */
+int logring_start(unsigned int size, int block)
+{
+	size_t n = 2, i;
+	int ret;
+
+	if(running) {
+		return(0);
+	}
+	while(n < size) {
+		n *= 2;
+	}
+	if((ring = malloc(n * sizeof(slot_t))) == NULL) {
+		return(1);
+	}
+	for(i = 0; i < n; i++) {
+		ring[i].seq = i;
+	}
+	mask = n - 1;
+	enqueue_pos = dequeue_pos = 0;
+	block_when_full = block;
+	closing = sleeping = 0;
+
+	if((ret = start_thread(&flusher, flush_loop, NULL)) != 0) {
+		free(ring);
+		ring = NULL;
+		errno = ret;
+		return(1);
+	}
+	running = 1;
+	return(0);
+}
+
+/* Write out what is queued and stop the flusher. Messages are written right
+ * away from now on.
+ */
+void logring_stop()
+{
+	if(!running) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	closing = 1;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+	pthread_join(flusher, NULL);
+	running = 0;
+	take_new_fd();
+	free(ring);
+	ring = NULL;
+}
+
+/* Log to path from now on, "" = no log file. The old file is closed once
+ * the messages before are written. Returns non-zero if path cannot be
+ * opened, logging goes on to the old file then.
+ */
+int logring_set_file(const char *path)
+{
+	int fd = -1, old;
+
+	if(path[0] && (fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666)) < 0) {
+		return(1);
+	}
+	if(!running) {
+		if(log_fd >= 0) {
+			close(log_fd);
+		}
+		log_fd = fd;
+		return(0);
+	}
+	if((old = __atomic_exchange_n(&new_fd, fd, __ATOMIC_SEQ_CST)) >= 0) {
+		/* the flusher has not picked that one up yet */
+		close(old);
+	}
+	wake();
+	return(0);
+}
+
+void logring_set_syslog(int on)
+{
+	__atomic_store_n(&use_syslog, on, __ATOMIC_RELAXED);
+}
+
+void logring_vwrite(const char *fmt, va_list args)
+{
+	slot_t *s, one;
+	size_t pos, seq;
+	struct timespec pause = {0, 100000};
+
+	if(!running) {
+		format_msg(&one, fmt, args);
+		s = &one;
+		write_out(&s, 1);
+		return;
+	}
+
+	pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+	while(1) {
+		s = &ring[pos & mask];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if(seq == pos) {
+			if(__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+			/* pos now holds the current position */
+		} else if((intptr_t)(seq - pos) < 0) {
+			/* full */
+			if(!block_when_full) {
+				__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			wake();
+			nanosleep(&pause, NULL);
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	format_msg(s, fmt, args);
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_SEQ_CST);
+	wake();
+}
+
+void logring_get_stats(logring_stats_t *s)
+{
+	s->written = __atomic_load_n(&written, __ATOMIC_RELAXED);
+	s->dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	s->queued = running ? (unsigned int)(__atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED) -
+			__atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED)) : 0;
+	s->size = running ? (unsigned int)(mask + 1) : 0;
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,51 @@
+/*
+ *  logring.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_LOGRING_H
+#define _PAC_LOGRING_H
+
+#include <stdarg.h>
+
+/* Log messages are formatted by the thread that logs them into a slot of a
+ * lock-free ring and written to the log file (in batches, with writev())
+ * and to syslog by a flusher thread. Until logring_start() and after
+ * logring_stop() they are written right away instead. When the ring is
+ * full a message is either dropped and counted or the logging thread
+ * waits for a free slot.
+ */
+#define LOGRING_MSG_MAX 1024
+
+typedef struct logring_stats {
+	unsigned long written;
+	unsigned long dropped;
+	unsigned int queued;
+	unsigned int size;
+} logring_stats_t;
+
+int logring_start(unsigned int size, int block);
+void logring_stop();
+int logring_set_file(const char *path);
+void logring_set_syslog(int on);
+void logring_vwrite(const char *fmt, va_list args);
+void logring_get_stats(logring_stats_t *stats);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,436 @@
+/*
+ *  metrics.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "util.h"
+
+#define LISTENERS   2      /* Unix socket and TCP port */
+#define CLIENTS     16     /* connections served at once, more are refused */
+#define REQUEST_MAX 2048   /* longest request read, the rest is ignored */
+
+struct metrics_buf {
+	char *data;
+	size_t len, size;
+};
+
+typedef struct client {
+	int fd;
+	char req[REQUEST_MAX];
+	size_t reqlen;
+	metrics_buf_t out;     /* response, once the request is complete */
+	size_t sent;
+	uint64_t deadline;     /* ms, when the client is dropped for idling */
+} client_t;
+
+typedef struct door_entry {
+	struct door_entry *next;
+	metrics_door_t counters;
+	char name[1];
+} door_entry_t;
+
+metrics_counters_t metrics;
+
+static int listen_fds[LISTENERS] = { -1, -1 };
+static unsigned int nlisten;
+static char sock_path[PATH_MAX];
+static client_t clients[CLIENTS];
+static unsigned int nclients;
+static door_entry_t *doors = NULL;
+static metrics_render_fn render_fn;
+
+static const char *reject_names[REJECT_REASONS] = {
+	"link", "not_ipv4", "icmp", "scanner", "rate", "acl"
+};
+
+/* Only the loopback address, the numbers are no business of other hosts
+ */
+static int listen_tcp(unsigned short port)
+{
+	struct sockaddr_in sin;
+	int fd, on = 1;
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return(-1);
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(bind(fd, (struct sockaddr*)&sin, sizeof(sin)) || listen(fd, 16) || set_nonblock(fd)) {
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+
+/* Serve metrics on a Unix socket at path and/or on port of 127.0.0.1 ("" or
+ * 0 for none). fn adds the caller's own metrics to every response. Returns
+ * non-zero on error with errno set.
+ */
+int metrics_open(const char *path, unsigned short port, metrics_render_fn fn)
+{
+	int fd;
+
+	render_fn = fn;
+	if(path[0]) {
+		if((fd = listen_unix(path)) < 0) {
+			return(1);
+		}
+		strcpy(sock_path, path);
+		listen_fds[nlisten++] = fd;
+	}
+	if(port) {
+		if((fd = listen_tcp(port)) < 0) {
+			metrics_close();
+			return(1);
+		}
+		listen_fds[nlisten++] = fd;
+	}
+	return(0);
+}
+
+static void drop_client(unsigned int i)
+{
+	close(clients[i].fd);
+	free(clients[i].out.data);
+	clients[i] = clients[--nclients];
+}
+
+void metrics_close()
+{
+	while(nclients) {
+		drop_client(nclients - 1);
+	}
+	while(nlisten) {
+		close(listen_fds[--nlisten]);
+		listen_fds[nlisten] = -1;
+	}
+	if(sock_path[0]) {
+		unlink(sock_path);
+		sock_path[0] = '\0';
+	}
+}
+
+int metrics_enabled()
+{
+	return(nlisten > 0);
+}
+
+/* Number of pollfds metrics_pollfds() fills in
+ */
+unsigned int metrics_npollfds()
+{
+	return(nlisten + nclients);
+}
+
+void metrics_pollfds(struct pollfd *pfds)
+{
+	unsigned int i;
+
+	for(i = 0; i < nlisten; i++) {
+		pfds[i].fd = listen_fds[i];
+		pfds[i].events = POLLIN;
+		pfds[i].revents = 0;
+	}
+	for(i = 0; i < nclients; i++) {
+		pfds[nlisten+i].fd = clients[i].fd;
+		pfds[nlisten+i].events = clients[i].out.data ? POLLOUT : POLLIN;
+		pfds[nlisten+i].revents = 0;
+	}
+}
+
+/* Return the counters of a door, creating them on first use. They are kept
+ * by name, so they survive reloads that replace the door.
+ */
+metrics_door_t* metrics_door(const char *name)
+{
+	door_entry_t *d;
+
+	for(d = doors; d; d = d->next) {
+		if(!strcmp(d->name, name)) {
+			return(&d->counters);
+		}
+	}
+	if((d = calloc(1, sizeof(door_entry_t) + strlen(name))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(d->name, name);
+	d->next = doors;
+	doors = d;
+	return(&d->counters);
+}
+
+void metrics_door_walk(metrics_door_fn fn, void *arg)
+{
+	door_entry_t *d;
+
+	for(d = doors; d; d = d->next) {
+		fn(d->name, &d->counters, arg);
+	}
+}
+
+void metrics_printf(metrics_buf_t *buf, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	while(1) {
+		va_start(args, fmt);
+		n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+		va_end(args);
+		if(n < 0) {
+			return;
+		}
+		if((size_t)n < buf->size - buf->len) {
+			buf->len += n;
+			return;
+		}
+		buf->size = (buf->len + n + 1) * 2;
+		if((buf->data = realloc(buf->data, buf->size)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+}
+
+/* Escape a label value for the text format into dst
+ */
+const char* metrics_escape(const char *value, char *dst, size_t size)
+{
+	size_t i = 0;
+
+	for(; *value && i + 2 < size; value++) {
+		if(*value == '\\' || *value == '"') {
+			dst[i++] = '\\';
+			dst[i++] = *value;
+		} else if(*value == '\n') {
+			dst[i++] = '\\';
+			dst[i++] = 'n';
+		} else {
+			dst[i++] = *value;
+		}
+	}
+	dst[i] = '\0';
+	return(dst);
+}
+
+const char* metrics_reject_name(int reason)
+{
+	return(reason >= 0 && reason < REJECT_REASONS ? reject_names[reason] : "?");
+}
+
+static unsigned long get(const unsigned long *counter)
+{
+	return(__atomic_load_n(counter, __ATOMIC_RELAXED));
+}
+
+static void header(metrics_buf_t *b, const char *name, const char *type, const char *help)
+{
+	metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void door_counter(metrics_buf_t *b, const char *name, const char *help, size_t offset)
+{
+	char label[512];
+	door_entry_t *d;
+
+	header(b, name, "counter", help);
+	for(d = doors; d; d = d->next) {
+		metrics_printf(b, "%s{door=\"%s\"} %lu\n", name, metrics_escape(d->name, label, sizeof(label)),
+				get((const unsigned long*)((const char*)&d->counters + offset)));
+	}
+}
+
+static void render(metrics_buf_t *b)
+{
+	int i;
+
+	header(b, "knockd_packets_seen_total", "counter", "Packets captured.");
+	metrics_printf(b, "knockd_packets_seen_total %lu\n", get(&metrics.packets_seen));
+	header(b, "knockd_packets_decoded_total", "counter", "Packets decoded and checked for knocks.");
+	metrics_printf(b, "knockd_packets_decoded_total %lu\n", get(&metrics.packets_decoded));
+	header(b, "knockd_packets_rejected_total", "counter", "Packets dropped before knock matching, by reason.");
+	for(i = 0; i < REJECT_REASONS; i++) {
+		metrics_printf(b, "knockd_packets_rejected_total{reason=\"%s\"} %lu\n", reject_names[i],
+				get(&metrics.packets_rejected[i]));
+	}
+	door_counter(b, "knockd_attempts_created_total", "Knock attempts started.",
+			offsetof(metrics_door_t, created));
+	door_counter(b, "knockd_attempts_advanced_total", "Knock sequence stages reached.",
+			offsetof(metrics_door_t, advanced));
+	door_counter(b, "knockd_attempts_invalidated_total", "Knock attempts broken by a wrong knock.",
+			offsetof(metrics_door_t, invalidated));
+	door_counter(b, "knockd_attempts_timed_out_total", "Knock attempts that timed out.",
+			offsetof(metrics_door_t, timed_out));
+	door_counter(b, "knockd_door_opens_total", "Doors opened or extended.",
+			offsetof(metrics_door_t, opened));
+	header(b, "knockd_stop_actions_total", "counter", "Doors closed after their command timeout.");
+	metrics_printf(b, "knockd_stop_actions_total %lu\n", get(&metrics.stop_actions));
+	header(b, "knockd_command_spawn_failures_total", "counter", "Commands that could not be started.");
+	metrics_printf(b, "knockd_command_spawn_failures_total %lu\n", get(&metrics.spawn_failures));
+	header(b, "knockd_command_failures_total", "counter", "Commands that exited non-zero or were killed.");
+	metrics_printf(b, "knockd_command_failures_total %lu\n", get(&metrics.command_failures));
+	if(render_fn) {
+		render_fn(b);
+	}
+}
+
+/* Build the response once the request headers are in
+ */
+static void respond(client_t *c)
+{
+	metrics_buf_t body = { NULL, 0, 0 };
+	const char *status = "200 OK";
+
+	c->req[c->reqlen] = '\0';
+	if(strncmp(c->req, "GET ", 4)) {
+		status = "405 Method Not Allowed";
+		metrics_printf(&body, "only GET is supported\n");
+	} else if(strncmp(c->req + 4, "/metrics", 8) && strncmp(c->req + 4, "/ ", 2)) {
+		status = "404 Not Found";
+		metrics_printf(&body, "try /metrics\n");
+	} else {
+		render(&body);
+	}
+	metrics_printf(&c->out, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %lu\r\nConnection: close\r\n\r\n", status, (unsigned long)body.len);
+	metrics_printf(&c->out, "%.*s", (int)body.len, body.data);
+	free(body.data);
+	c->sent = 0;
+}
+
+/* Read what the client sent so far. Returns non-zero if it went away.
+ */
+static int read_request(client_t *c)
+{
+	ssize_t n;
+
+	n = recv(c->fd, c->req + c->reqlen, sizeof(c->req) - 1 - c->reqlen, MSG_DONTWAIT);
+	if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		return(1);
+	}
+	if(n > 0) {
+		c->reqlen += n;
+		c->req[c->reqlen] = '\0';
+		if(strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n") || c->reqlen == sizeof(c->req) - 1) {
+			respond(c);
+		}
+	}
+	return(0);
+}
+
+/* Send as much of the response as the socket takes. Returns non-zero once
+ * the client is done with, one way or the other.
+ */
+static int send_response(client_t *c)
+{
+	ssize_t n;
+
+	while(c->sent < c->out.len) {
+		n = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return(errno != EAGAIN && errno != EWOULDBLOCK);
+		}
+		c->sent += n;
+		c->deadline = now_ms() + IDLE_MAX;
+	}
+	return(1);
+}
+
+/* Serve the pollfds filled in by metrics_pollfds(): read requests, send
+ * responses, drop idle clients and accept new ones.
+ */
+void metrics_handle(const struct pollfd *pfds)
+{
+	uint64_t now = now_ms();
+	unsigned int i;
+	int fd;
+
+	/* backwards, dropping a client moves the last one into its place */
+	for(i = nclients; i-- > 0;) {
+		const struct pollfd *p = &pfds[nlisten+i];
+		if(p->revents == 0) {
+			if(now >= clients[i].deadline) {
+				drop_client(i);
+			}
+			continue;
+		}
+		if(clients[i].out.data == NULL) {
+			if(read_request(&clients[i])) {
+				drop_client(i);
+				continue;
+			}
+		}
+		if(clients[i].out.data && send_response(&clients[i])) {
+			drop_client(i);
+		}
+	}
+
+	for(i = 0; i < nlisten; i++) {
+		if(!(pfds[i].revents & POLLIN)) {
+			continue;
+		}
+		while((fd = accept_client(listen_fds[i])) >= 0) {
+			if(nclients == CLIENTS) {
+				close(fd);
+				continue;
+			}
+			memset(&clients[nclients], 0, sizeof(client_t));
+			clients[nclients].fd = fd;
+			clients[nclients].deadline = now + IDLE_MAX;
+			nclients++;
+		}
+	}
+}
+
+/* Time metrics_handle() has to be called by to drop idle clients, in ms
+ * on CLOCK_MONOTONIC, 0 = none
+ */
+uint64_t metrics_next_expiry()
+{
+	uint64_t next = 0;
+	unsigned int i;
+
+	for(i = 0; i < nclients; i++) {
+		next = sooner(next, clients[i].deadline);
+	}
+	return(next);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,103 @@
+/*
+ *  metrics.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_METRICS_H
+#define _PAC_METRICS_H
+
+#include <stddef.h>
+#include <poll.h>
+#include "histogram.h"
+
+/* Engine counters, served in the Prometheus text format to HTTP clients on a
+ * Unix socket and/or a TCP port on the loopback interface. Counters are
+ * bumped with METRIC_INC(), a relaxed atomic add, so updating them costs
+ * next to nothing on the packet path.
+ */
+#define METRIC_INC(c) __atomic_add_fetch(&(c), 1, __ATOMIC_RELAXED)
+
+/* why sniff() dropped a packet before looking for knocks */
+#define REJECT_LINK      0   /* unknown link layer or not IP */
+#define REJECT_NOT_IPV4  1
+#define REJECT_ICMP      2
+#define REJECT_SCANNER   3   /* source suppressed as a scanner */
+#define REJECT_RATE      4   /* source exceeded its packet rate */
+#define REJECT_ACL       5   /* first knock from a source a door does not allow */
+#define REJECT_REASONS   6
+
+typedef struct metrics_counters {
+	unsigned long packets_seen;
+	unsigned long packets_decoded;
+	unsigned long packets_rejected[REJECT_REASONS];
+	unsigned long stop_actions;       /* doors closed after Cmd_Timeout */
+	unsigned long spawn_failures;     /* commands that could not be started */
+	unsigned long command_failures;   /* commands that failed or were killed */
+} metrics_counters_t;
+
+/* the steps from the last knock of a sequence to its start command done */
+#define LATENCY_CAPTURE    0   /* packet captured -> sequence found complete */
+#define LATENCY_DISPATCH   1   /* complete -> command sent to the executor */
+#define LATENCY_SPAWN      2   /* starting the command in the executor */
+#define LATENCY_COMPLETION 3   /* sent to the executor -> command exited */
+#define LATENCY_STEPS      4
+
+/* stages of a sequence counted apart; stage s goes to slot METRICS_STAGE(s) */
+#define METRICS_STAGES 32
+#define METRICS_STAGE(s) ((s) < 1 ? 0 : (s) > METRICS_STAGES ? METRICS_STAGES - 1 : (s) - 1)
+
+typedef struct metrics_door {
+	unsigned long created;      /* attempts started */
+	unsigned long advanced;     /* stages reached */
+	unsigned long invalidated;  /* attempts broken by a wrong knock */
+	unsigned long timed_out;
+	unsigned long opened;
+	histogram_t latency[LATENCY_STEPS];  /* microseconds */
+	/* how far attempts got: stage reached, and the stage they were at when
+	 * they timed out or a wrong knock broke them */
+	unsigned long stage_reached[METRICS_STAGES];
+	unsigned long stage_timed_out[METRICS_STAGES];
+	unsigned long stage_invalidated[METRICS_STAGES];
+	histogram_t gap;            /* microseconds between two knocks of an attempt */
+} metrics_door_t;
+
+typedef struct metrics_buf metrics_buf_t;
+
+/* called for every scrape to add what only the caller knows, eg, gauges */
+typedef void (*metrics_render_fn)(metrics_buf_t *buf);
+typedef void (*metrics_door_fn)(const char *name, const metrics_door_t *door, void *arg);
+
+extern metrics_counters_t metrics;
+
+int metrics_open(const char *path, unsigned short port, metrics_render_fn fn);
+void metrics_close();
+int metrics_enabled();
+unsigned int metrics_npollfds();
+void metrics_pollfds(struct pollfd *pfds);
+void metrics_handle(const struct pollfd *pfds);
+uint64_t metrics_next_expiry();
+metrics_door_t* metrics_door(const char *name);
+void metrics_door_walk(metrics_door_fn fn, void *arg);
+void metrics_printf(metrics_buf_t *buf, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+const char* metrics_escape(const char *value, char *dst, size_t size);
+const char* metrics_reject_name(int reason);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
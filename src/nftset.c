@@ -0,0 +1,271 @@
+/*
+ *  nftset.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "nftset.h"
+
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+#include <endian.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+static const struct {
+	const char *name;
+	int family;
+} families[] = {
+	{"ip",     NFPROTO_IPV4},
+	{"inet",   NFPROTO_INET},
+	{"bridge", NFPROTO_BRIDGE},
+	{"netdev", NFPROTO_NETDEV},
+	{NULL, 0}
+};
+
+/* a netlink message under construction */
+typedef struct nlbuf {
+	char data[1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+	size_t len;
+} nlbuf_t;
+
+static uint32_t nl_seq = 0;
+
+static struct nlmsghdr* put_msg(nlbuf_t *b, uint16_t type, uint16_t flags, int family, uint16_t res_id)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr*)(b->data + b->len);
+	struct nfgenmsg *nfg;
+
+	memset(nlh, 0, NLMSG_SPACE(sizeof(struct nfgenmsg)));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = ++nl_seq;
+	nfg = NLMSG_DATA(nlh);
+	nfg->nfgen_family = family;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(res_id);
+	return(nlh);
+}
+
+static void end_msg(nlbuf_t *b, struct nlmsghdr *nlh)
+{
+	b->len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+static struct nlattr* put_attr(struct nlmsghdr *nlh, uint16_t type, const void *data, size_t len)
+{
+	struct nlattr *nla = (struct nlattr*)((char*)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if(len) {
+		memcpy((char*)nla + NLA_HDRLEN, data, len);
+	}
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+	return(nla);
+}
+
+static struct nlattr* begin_nest(struct nlmsghdr *nlh, uint16_t type)
+{
+	return(put_attr(nlh, type | NLA_F_NESTED, NULL, 0));
+}
+
+static void end_nest(struct nlmsghdr *nlh, struct nlattr *nest)
+{
+	nest->nla_len = (char*)nlh + nlh->nlmsg_len - (char*)nest;
+}
+#endif
+
+/* Parse "[<family>] <table> <set>", the family defaults to inet. Returns
+ * non-zero on error.
+ */
+int nftset_parse(const char *str, nftset_t *set)
+{
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+	char words[3][NFTSET_NAME_MAX];
+	char extra;
+	int i, n;
+
+	n = sscanf(str, "%63s %63s %63s %c", words[0], words[1], words[2], &extra);
+	if(n == 2) {
+		set->family = NFPROTO_INET;
+		strcpy(set->table, words[0]);
+		strcpy(set->set, words[1]);
+		return(0);
+	}
+	if(n != 3) {
+		return(1);
+	}
+	for(i = 0; families[i].name; i++) {
+		if(!strcmp(words[0], families[i].name)) {
+			set->family = families[i].family;
+			strcpy(set->table, words[1]);
+			strcpy(set->set, words[2]);
+			return(0);
+		}
+	}
+#endif
+	return(1);
+}
+
+const char* nftset_family_name(int family)
+{
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+	int i;
+
+	for(i = 0; families[i].name; i++) {
+		if(families[i].family == family) {
+			return(families[i].name);
+		}
+	}
+#endif
+	return("?");
+}
+
+/* Open a netfilter netlink socket in the calling thread's network
+ * namespace. Returns -1 on error.
+ */
+int nftset_open()
+{
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+	struct sockaddr_nl snl;
+	int sock;
+
+	if((sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) < 0) {
+		return(-1);
+	}
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	if(bind(sock, (struct sockaddr*)&snl, sizeof(snl)) < 0) {
+		close(sock);
+		return(-1);
+	}
+	return(sock);
+#else
+	errno = ENOSYS;
+	return(-1);
+#endif
+}
+
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+/* Append a NEWSETELEM or DELSETELEM message for the address to b. Returns
+ * its sequence number.
+ */
+static uint32_t put_elem(nlbuf_t *b, uint16_t type, uint16_t flags, const nftset_t *set,
+		uint32_t key_addr, unsigned int timeout)
+{
+	struct nlmsghdr *nlh;
+	struct nlattr *list, *elem, *key;
+	uint64_t timeout_ms = htobe64((uint64_t)timeout * 1000);
+
+	nlh = put_msg(b, (NFNL_SUBSYS_NFTABLES << 8) | type, flags | NLM_F_ACK, set->family, 0);
+	put_attr(nlh, NFTA_SET_ELEM_LIST_TABLE, set->table, strlen(set->table) + 1);
+	put_attr(nlh, NFTA_SET_ELEM_LIST_SET, set->set, strlen(set->set) + 1);
+	list = begin_nest(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+	elem = begin_nest(nlh, NFTA_LIST_ELEM);
+	key = begin_nest(nlh, NFTA_SET_ELEM_KEY);
+	put_attr(nlh, NFTA_DATA_VALUE, &key_addr, sizeof(key_addr));
+	end_nest(nlh, key);
+	if(timeout && type == NFT_MSG_NEWSETELEM) {
+		put_attr(nlh, NFTA_SET_ELEM_TIMEOUT, &timeout_ms, sizeof(timeout_ms));
+	}
+	end_nest(nlh, elem);
+	end_nest(nlh, list);
+	end_msg(b, nlh);
+	return(nlh->nlmsg_seq);
+}
+
+/* Add the address to the set as a transaction of its own and wait for the
+ * kernel's answer. With replace, an element that is there already is
+ * deleted first in the same transaction, so it gets the new timeout; some
+ * kernels keep the old one when an element is merely added again. Returns
+ * 0 or an errno value.
+ */
+static int send_elem(int sock, const nftset_t *set, uint32_t key_addr, unsigned int timeout, int replace)
+{
+	nlbuf_t b;
+	struct nlmsghdr *nlh;
+	uint32_t first, last;
+	char reply[1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+	ssize_t n;
+
+	b.len = 0;
+	nlh = put_msg(&b, NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+	end_msg(&b, nlh);
+	if(replace) {
+		first = put_elem(&b, NFT_MSG_DELSETELEM, 0, set, key_addr, 0);
+		last = put_elem(&b, NFT_MSG_NEWSETELEM, NLM_F_CREATE, set, key_addr, timeout);
+	} else {
+		first = last = put_elem(&b, NFT_MSG_NEWSETELEM, NLM_F_CREATE | NLM_F_EXCL, set, key_addr, timeout);
+	}
+	nlh = put_msg(&b, NFNL_MSG_BATCH_END, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+	end_msg(&b, nlh);
+
+	if(send(sock, b.data, b.len, 0) < 0) {
+		return(errno);
+	}
+
+	/* the batch is processed while it is sent, so the answer is there */
+	while((n = recv(sock, reply, sizeof(reply), MSG_DONTWAIT)) > 0) {
+		for(nlh = (struct nlmsghdr*)reply; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+			if(nlh->nlmsg_type == NLMSG_ERROR && nlh->nlmsg_seq >= first && nlh->nlmsg_seq <= last) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+				if(err->error) {
+					return(-err->error);
+				}
+			}
+		}
+	}
+	return(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ? errno : 0);
+}
+#endif
+
+/* Add addr (host byte order) to the set, expiring after timeout seconds
+ * (0 = the set's default). An address that is in the set already is
+ * replaced, so its timeout starts over. Returns 0 or an errno value.
+ */
+int nftset_add(int sock, const nftset_t *set, uint32_t addr, unsigned int timeout)
+{
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+	uint32_t key_addr = htonl(addr);
+	int err;
+
+	err = send_elem(sock, set, key_addr, timeout, 0);
+	if(err == EEXIST && (err = send_elem(sock, set, key_addr, timeout, 1)) == ENOENT) {
+		/* expired in between */
+		err = send_elem(sock, set, key_addr, timeout, 0);
+	}
+	return(err);
+#else
+	return(ENOSYS);
+#endif
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,47 @@
+/*
+ *  nftset.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_NFTSET_H
+#define _PAC_NFTSET_H
+
+#include <stdint.h>
+
+/* Adds addresses to a named nftables set over netlink, with a timeout per
+ * element, so the kernel expires them by itself. The set has to exist and
+ * hold IPv4 addresses, eg:
+ *
+ *   nft add set inet filter knocked '{ type ipv4_addr; flags timeout; }'
+ */
+#define NFTSET_NAME_MAX 64
+
+typedef struct nftset {
+	int family;                     /* NFPROTO_* */
+	char table[NFTSET_NAME_MAX];
+	char set[NFTSET_NAME_MAX];
+} nftset_t;
+
+int nftset_parse(const char *str, nftset_t *set);
+const char* nftset_family_name(int family);
+int nftset_open();
+int nftset_add(int sock, const nftset_t *set, uint32_t addr, unsigned int timeout);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
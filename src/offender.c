@@ -0,0 +1,139 @@
+/*
+ *  offender.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include "srctab.h"
+#include "offender.h"
+
+typedef struct offender {
+	unsigned int fails;     /* failures since window_start */
+	time_t window_start;
+	time_t blocked_until;   /* 0 if not suppressed */
+} offender_t;
+
+static srctab_t *table = NULL;
+static unsigned int o_threshold;
+static time_t o_window;
+static time_t o_block;
+static offender_stats_t stats;
+
+static void offender_evicted(uint32_t addr, void *data)
+{
+	offender_t *off = (offender_t*)data;
+
+	(void)addr;
+	if(off->blocked_until) {
+		stats.evicts++;
+	}
+}
+
+/* Set up the offender table. A threshold of 0 disables suppression. The
+ * current table (and the sources in it) is kept if its size is unchanged,
+ * so this can be called again on reload. Returns non-zero if the table
+ * cannot be allocated.
+ */
+int offender_init(unsigned int threshold, time_t window, time_t block, unsigned int size)
+{
+	o_threshold = threshold;
+	o_window = window;
+	o_block = block;
+	if(threshold == 0) {
+		offender_free();
+		return(0);
+	}
+	if(table && srctab_size(table) == srctab_size_for(size)) {
+		return(0);
+	}
+	offender_free();
+	table = srctab_new(size, sizeof(offender_t), offender_evicted);
+	return(table == NULL);
+}
+
+void offender_free()
+{
+	srctab_free(table);
+	table = NULL;
+}
+
+int offender_enabled()
+{
+	return(table != NULL);
+}
+
+/* Check whether packets from addr should be dropped. Suppressions that have
+ * run out are lifted here.
+ */
+int offender_blocked(uint32_t addr, time_t now)
+{
+	offender_t *off;
+
+	if(table == NULL || (off = srctab_lookup(table, addr, 0)) == NULL) {
+		return(0);
+	}
+	if(off->blocked_until > now) {
+		srctab_lookup(table, addr, now);
+		stats.hits++;
+		return(1);
+	}
+	if(off->blocked_until) {
+		off->blocked_until = 0;
+		stats.evicts++;
+		if(now - off->window_start >= o_window) {
+			srctab_remove(table, addr);
+		}
+	}
+	return(0);
+}
+
+/* Record a failed or timed out knock attempt from addr. Returns 1 if this
+ * failure got the source suppressed.
+ */
+int offender_fail(uint32_t addr, time_t now)
+{
+	offender_t *off;
+
+	if(table == NULL) {
+		return(0);
+	}
+	off = srctab_insert(table, addr, now);
+	if(off->blocked_until > now) {
+		return(0);
+	}
+	if(now - off->window_start >= o_window) {
+		off->fails = 0;
+		off->window_start = now;
+	}
+	if(++off->fails >= o_threshold) {
+		off->fails = 0;
+		off->blocked_until = now + o_block;
+		stats.inserts++;
+		return(1);
+	}
+	return(0);
+}
+
+void offender_get_stats(offender_stats_t *s)
+{
+	*s = stats;
+	s->tracked = table ? srctab_count(table) : 0;
+	s->size = table ? srctab_size(table) : 0;
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,49 @@
+/*
+ *  offender.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_OFFENDER_H
+#define _PAC_OFFENDER_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Recent offenders: sources whose knock attempts failed or timed out
+ * scan_threshold times within scan_window seconds are suppressed for
+ * scan_block seconds. Entries live in a fixed-size srctab, so the oldest
+ * offenders are forgotten first when the table fills up.
+ */
+typedef struct offender_stats {
+	unsigned long hits;     /* packets dropped from suppressed sources */
+	unsigned long inserts;  /* sources added to the suppressed set */
+	unsigned long evicts;   /* sources leaving it (expired or displaced) */
+	unsigned int tracked;   /* sources currently in the table */
+	unsigned int size;      /* capacity of the table */
+} offender_stats_t;
+
+int offender_init(unsigned int threshold, time_t window, time_t block, unsigned int size);
+void offender_free();
+int offender_enabled();
+int offender_blocked(uint32_t addr, time_t now);
+int offender_fail(uint32_t addr, time_t now);
+void offender_get_stats(offender_stats_t *stats);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
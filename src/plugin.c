@@ -0,0 +1,272 @@
+/*
+ *  plugin.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plugin.h"
+#include "util.h"
+
+#define PLUGIN_LOADED  0  /* registered, not started yet */
+#define PLUGIN_RUNNING 1
+#define PLUGIN_FAILED  2  /* init failed, the thread is gone */
+
+struct plugin {
+	struct plugin *next;
+	char name[PLUGIN_NAME_MAX];
+	char path[PATH_MAX];
+	void *handle;
+	const knockd_plugin_t *desc;
+	void *state;
+	pthread_t thread;
+	int status;
+	/* a ring of events waiting for the thread */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	knockd_event_t *queue[PLUGIN_QUEUE_SIZE];
+	unsigned int head, count;
+	int closing;
+	plugin_stats_t stats;
+};
+
+static plugin_t *plugins = NULL;
+
+/* Register a plugin to be loaded by plugin_start(). Returns 1 if a plugin
+ * of that name is registered with another path already, -1 if out of memory.
+ */
+int plugin_add(const char *name, const char *path)
+{
+	plugin_t *p;
+
+	if((p = plugin_find(name)) != NULL) {
+		return(strcmp(p->path, path) != 0);
+	}
+	if((p = calloc(1, sizeof(plugin_t))) == NULL) {
+		return(-1);
+	}
+	strncpy(p->name, name, sizeof(p->name)-1);
+	strncpy(p->path, path, sizeof(p->path)-1);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->next = plugins;
+	plugins = p;
+	return(0);
+}
+
+plugin_t* plugin_find(const char *name)
+{
+	plugin_t *p;
+
+	for(p = plugins; p; p = p->next) {
+		if(!strcmp(p->name, name)) {
+			return(p);
+		}
+	}
+	return(NULL);
+}
+
+const char* plugin_name(const plugin_t *p)
+{
+	return(p->name);
+}
+
+static void* worker(void *arg)
+{
+	plugin_t *p = arg;
+	knockd_event_t *event;
+	int failed;
+
+	pthread_mutex_lock(&p->lock);
+	p->status = (p->desc->init && p->desc->init(&p->state)) ? PLUGIN_FAILED : PLUGIN_RUNNING;
+	pthread_cond_broadcast(&p->cond);
+	while(p->status == PLUGIN_RUNNING) {
+		while(p->count == 0 && !p->closing) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		if(p->count == 0) {
+			/* closing and nothing left to do */
+			break;
+		}
+		event = p->queue[p->head];
+		p->head = (p->head + 1) % PLUGIN_QUEUE_SIZE;
+		p->count--;
+		pthread_mutex_unlock(&p->lock);
+
+		failed = p->desc->action(p->state, event);
+		free(event);
+
+		pthread_mutex_lock(&p->lock);
+		p->stats.calls++;
+		if(failed) {
+			p->stats.failed++;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	if(p->status == PLUGIN_RUNNING && p->desc->fini) {
+		p->desc->fini(p->state);
+	}
+	return(NULL);
+}
+
+/* Load a plugin and wait for its thread to initialize it
+ */
+static int load(plugin_t *p, char *err, size_t errsize)
+{
+	int ret;
+
+	if((p->handle = dlopen(p->path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		snprintf(err, errsize, "%s", dlerror());
+		return(1);
+	}
+	if((p->desc = dlsym(p->handle, KNOCKD_PLUGIN_SYMBOL)) == NULL) {
+		snprintf(err, errsize, "%s: no %s symbol", p->path, KNOCKD_PLUGIN_SYMBOL);
+		return(1);
+	}
+	if(p->desc->abi != KNOCKD_PLUGIN_ABI || p->desc->action == NULL) {
+		snprintf(err, errsize, "%s: plugin ABI %u, knockd has %u", p->path, p->desc->abi, KNOCKD_PLUGIN_ABI);
+		return(1);
+	}
+
+	p->status = PLUGIN_LOADED;
+	if((ret = start_thread(&p->thread, worker, p)) != 0) {
+		snprintf(err, errsize, "%s: %s", p->path, strerror(ret));
+		return(1);
+	}
+	pthread_mutex_lock(&p->lock);
+	while(p->status == PLUGIN_LOADED) {
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	if(p->status == PLUGIN_FAILED) {
+		pthread_join(p->thread, NULL);
+		snprintf(err, errsize, "%s: initialization failed", p->path);
+		return(1);
+	}
+	return(0);
+}
+
+/* Load the plugins registered since the last call. Returns non-zero with a
+ * message in err if one cannot be loaded.
+ */
+int plugin_start(char *err, size_t errsize)
+{
+	plugin_t *p;
+
+	for(p = plugins; p; p = p->next) {
+		if(p->handle == NULL && load(p, err, errsize)) {
+			if(p->handle) {
+				dlclose(p->handle);
+				p->handle = NULL;
+			}
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/* Let every plugin work off its queue, then unload it
+ */
+void plugin_stop()
+{
+	plugin_t *p;
+
+	while((p = plugins) != NULL) {
+		plugins = p->next;
+		if(p->status == PLUGIN_RUNNING) {
+			pthread_mutex_lock(&p->lock);
+			p->closing = 1;
+			pthread_cond_broadcast(&p->cond);
+			pthread_mutex_unlock(&p->lock);
+			pthread_join(p->thread, NULL);
+		}
+		if(p->handle) {
+			dlclose(p->handle);
+		}
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->cond);
+		free(p);
+	}
+}
+
+/* Copy an event and all it points to into a single block, to be freed with
+ * free()
+ */
+knockd_event_t* plugin_event_copy(const knockd_event_t *event)
+{
+	size_t doorlen = strlen(event->door) + 1;
+	size_t argslen = strlen(event->args) + 1;
+	size_t seqlen = event->count * sizeof(unsigned short);
+	knockd_event_t *copy;
+	char *p;
+
+	if((copy = malloc(sizeof(knockd_event_t) + 2 * seqlen + doorlen + argslen)) == NULL) {
+		return(NULL);
+	}
+	*copy = *event;
+	p = (char*)(copy + 1);
+	copy->ports = memcpy(p, event->ports, seqlen);
+	copy->protocols = memcpy(p += seqlen, event->protocols, seqlen);
+	copy->door = memcpy(p += seqlen, event->door, doorlen);
+	copy->args = memcpy(p += doorlen, event->args, argslen);
+	return(copy);
+}
+
+/* Queue an event for a plugin. Returns non-zero if it had to be dropped.
+ */
+int plugin_submit(plugin_t *p, const knockd_event_t *event)
+{
+	knockd_event_t *copy = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	if(p->status != PLUGIN_RUNNING || p->count == PLUGIN_QUEUE_SIZE ||
+			(copy = plugin_event_copy(event)) == NULL) {
+		p->stats.dropped++;
+		pthread_mutex_unlock(&p->lock);
+		return(1);
+	}
+	p->queue[(p->head + p->count) % PLUGIN_QUEUE_SIZE] = copy;
+	p->count++;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return(0);
+}
+
+void plugin_walk(plugin_walk_fn fn, void *arg)
+{
+	plugin_stats_t stats;
+	plugin_t *p;
+
+	for(p = plugins; p; p = p->next) {
+		pthread_mutex_lock(&p->lock);
+		stats = p->stats;
+		stats.queued = p->count;
+		pthread_mutex_unlock(&p->lock);
+		fn(p->name, &stats, arg);
+	}
+}
+
+/* vim: set ts=2 sw=2 noet: */
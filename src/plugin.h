@@ -0,0 +1,59 @@
+/*
+ *  plugin.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_PLUGIN_H
+#define _PAC_PLUGIN_H
+
+#include <stddef.h>
+#include "knockd_plugin.h"
+
+/* Action plugins (see knockd_plugin.h). Plugins are registered while the
+ * config is read and loaded by plugin_start(), after knockd has become a
+ * daemon. Each one gets a worker thread and a bounded queue of events; an
+ * event that finds the queue full is refused and counted as dropped, the
+ * caller may submit it again. Plugins stay loaded until plugin_stop(),
+ * reloads only add new ones.
+ */
+#define PLUGIN_NAME_MAX   64
+#define PLUGIN_QUEUE_SIZE 1024
+
+typedef struct plugin plugin_t;
+
+typedef struct plugin_stats {
+	unsigned long calls;
+	unsigned long failed;   /* the action returned non-zero */
+	unsigned long dropped;  /* the queue was full */
+	unsigned int queued;
+} plugin_stats_t;
+
+typedef void (*plugin_walk_fn)(const char *name, const plugin_stats_t *stats, void *arg);
+
+int plugin_add(const char *name, const char *path);
+plugin_t* plugin_find(const char *name);
+const char* plugin_name(const plugin_t *p);
+int plugin_start(char *err, size_t errsize);
+void plugin_stop();
+int plugin_submit(plugin_t *p, const knockd_event_t *event);
+knockd_event_t* plugin_event_copy(const knockd_event_t *event);
+void plugin_walk(plugin_walk_fn fn, void *arg);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,357 @@
+/*
+ *  prefix.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "prefix.h"
+
+#define TRIE_STRIDE   8
+#define TRIE_FANOUT   (1 << TRIE_STRIDE)
+#define HASH_MINSIZE  16
+
+/* one slot of a trie node. value is the value of the longest prefix
+ * covering this slot (-1 if none) and plen the length of that prefix, so
+ * that a shorter prefix added later never overwrites a longer one.
+ */
+typedef struct trie_slot {
+	uint32_t child;   /* index of the child node, 0 if none (0 is the root) */
+	int value;
+	int plen;
+} trie_slot_t;
+
+typedef struct trie_node {
+	trie_slot_t slot[TRIE_FANOUT];
+} trie_node_t;
+
+typedef struct host_slot {
+	uint32_t addr;
+	int value;        /* -1 marks an empty slot */
+} host_slot_t;
+
+struct prefix_set {
+	trie_node_t *nodes;
+	uint32_t nodecount;
+	uint32_t nodealloc;
+	host_slot_t *hosts;
+	uint32_t hostcount;
+	uint32_t hostsize;    /* always a power of two */
+	prefix_entry_t *entries;
+	int entrycount;
+	int entryalloc;
+};
+
+static uint32_t prefix_mask(int len)
+{
+	return(len <= 0 ? 0 : (0xffffffffU << (32 - len)));
+}
+
+static uint32_t host_hash(uint32_t addr, uint32_t size)
+{
+	return((addr * 2654435761U) & (size - 1));
+}
+
+static uint32_t trie_node_new(prefix_set_t *set)
+{
+	uint32_t i;
+	trie_node_t *node;
+
+	if(set->nodecount == set->nodealloc) {
+		uint32_t n = set->nodealloc ? set->nodealloc * 2 : 4;
+		trie_node_t *p = realloc(set->nodes, n * sizeof(trie_node_t));
+		if(p == NULL) {
+			return(0);
+		}
+		set->nodes = p;
+		set->nodealloc = n;
+	}
+	node = &set->nodes[set->nodecount];
+	for(i = 0; i < TRIE_FANOUT; i++) {
+		node->slot[i].child = 0;
+		node->slot[i].value = -1;
+		node->slot[i].plen = -1;
+	}
+	return(set->nodecount++);
+}
+
+static int host_insert(host_slot_t *tab, uint32_t size, uint32_t addr, int value)
+{
+	uint32_t i = host_hash(addr, size);
+
+	while(tab[i].value >= 0 && tab[i].addr != addr) {
+		i = (i + 1) & (size - 1);
+	}
+	if(tab[i].value < 0) {
+		tab[i].addr = addr;
+		tab[i].value = value;
+		return(1);
+	}
+	tab[i].value = value;
+	return(0);
+}
+
+static int host_add(prefix_set_t *set, uint32_t addr, int value)
+{
+	uint32_t i;
+
+	/* keep the load factor below one half */
+	if((set->hostcount + 1) * 2 > set->hostsize) {
+		uint32_t n = set->hostsize ? set->hostsize * 2 : HASH_MINSIZE;
+		host_slot_t *tab = malloc(n * sizeof(host_slot_t));
+		if(tab == NULL) {
+			return(1);
+		}
+		for(i = 0; i < n; i++) {
+			tab[i].value = -1;
+		}
+		for(i = 0; i < set->hostsize; i++) {
+			if(set->hosts[i].value >= 0) {
+				host_insert(tab, n, set->hosts[i].addr, set->hosts[i].value);
+			}
+		}
+		free(set->hosts);
+		set->hosts = tab;
+		set->hostsize = n;
+	}
+	set->hostcount += host_insert(set->hosts, set->hostsize, addr, value);
+	return(0);
+}
+
+static int trie_add(prefix_set_t *set, uint32_t addr, int len, int value)
+{
+	uint32_t node = 0;
+	int level = 0;
+	int rest, span, base, i;
+
+	/* walk down to the level holding the last (partial) stride of the prefix */
+	while(len > TRIE_STRIDE * (level + 1)) {
+		int idx = (addr >> (24 - TRIE_STRIDE * level)) & 0xff;
+		if(set->nodes[node].slot[idx].child == 0) {
+			uint32_t child = trie_node_new(set);
+			if(child == 0) {
+				return(1);
+			}
+			set->nodes[node].slot[idx].child = child;
+		}
+		node = set->nodes[node].slot[idx].child;
+		level++;
+	}
+
+	/* controlled prefix expansion over the remaining bits */
+	rest = len - TRIE_STRIDE * level;
+	span = 1 << (TRIE_STRIDE - rest);
+	base = ((addr >> (24 - TRIE_STRIDE * level)) & 0xff) & ~(span - 1);
+	for(i = base; i < base + span; i++) {
+		trie_slot_t *slot = &set->nodes[node].slot[i];
+		if(slot->plen <= len) {
+			slot->value = value;
+			slot->plen = len;
+		}
+	}
+	return(0);
+}
+
+prefix_set_t* prefix_set_new()
+{
+	prefix_set_t *set = calloc(1, sizeof(prefix_set_t));
+
+	if(set == NULL) {
+		return(NULL);
+	}
+	/* node 0 is the root, which lets child == 0 mean "no child" */
+	trie_node_new(set);
+	if(set->nodecount == 0) {
+		free(set);
+		return(NULL);
+	}
+	return(set);
+}
+
+void prefix_set_free(prefix_set_t *set)
+{
+	if(set) {
+		free(set->nodes);
+		free(set->hosts);
+		free(set->entries);
+		free(set);
+	}
+}
+
+/* Add addr/len with the given value (>= 0). Host bits beyond the prefix
+ * length are cleared. Returns non-zero on failure.
+ */
+int prefix_set_add(prefix_set_t *set, uint32_t addr, int len, int value)
+{
+	int ret;
+
+	if(len < 0 || len > 32 || value < 0) {
+		return(1);
+	}
+	addr &= prefix_mask(len);
+
+	if(len == 32) {
+		ret = host_add(set, addr, value);
+	} else {
+		ret = trie_add(set, addr, len, value);
+	}
+	if(ret) {
+		return(ret);
+	}
+
+	/* remember the prefix as given, e.g. for building pcap filters */
+	if(set->entrycount == set->entryalloc) {
+		int n = set->entryalloc ? set->entryalloc * 2 : 8;
+		prefix_entry_t *p = realloc(set->entries, n * sizeof(prefix_entry_t));
+		if(p == NULL) {
+			return(1);
+		}
+		set->entries = p;
+		set->entryalloc = n;
+	}
+	set->entries[set->entrycount].addr = addr;
+	set->entries[set->entrycount].len = len;
+	set->entries[set->entrycount].value = value;
+	set->entrycount++;
+	return(0);
+}
+
+/* Parse an "a.b.c.d" or "a.b.c.d/len" string and add it to the set.
+ * Returns non-zero if the string is not a valid IPv4 address or prefix.
+ */
+int prefix_set_parse(prefix_set_t *set, const char *str, int value)
+{
+	char buf[INET_ADDRSTRLEN + 4];
+	char *slash, *end;
+	struct in_addr in;
+	long len = 32;
+
+	if(strlen(str) >= sizeof(buf)) {
+		return(1);
+	}
+	strcpy(buf, str);
+	if((slash = strchr(buf, '/'))) {
+		*slash++ = '\0';
+		len = strtol(slash, &end, 10);
+		if(*slash == '\0' || *end != '\0' || len < 0 || len > 32) {
+			return(1);
+		}
+	}
+	if(inet_pton(AF_INET, buf, &in) != 1) {
+		return(1);
+	}
+	return(prefix_set_add(set, ntohl(in.s_addr), (int)len, value));
+}
+
+/* Load an address set file: one address or prefix per line, blank lines
+ * and lines starting with '#' are ignored. Returns the offending line
+ * number on a parse error, -1 if the file cannot be read and 0 on success.
+ */
+int prefix_set_load(prefix_set_t *set, const char *path, int value)
+{
+	FILE *fp;
+	char line[PATH_MAX+1];
+	char *p, *e;
+	int linenum = 0;
+
+	if((fp = fopen(path, "r")) == NULL) {
+		return(-1);
+	}
+	while(fgets(line, sizeof(line), fp)) {
+		linenum++;
+		for(p = line; isspace((unsigned char)*p); p++);
+		for(e = p + strlen(p); e > p && isspace((unsigned char)e[-1]); e--);
+		*e = '\0';
+		if(*p == '\0' || *p == '#') {
+			continue;
+		}
+		if(prefix_set_parse(set, p, value)) {
+			fclose(fp);
+			return(linenum);
+		}
+	}
+	fclose(fp);
+	return(0);
+}
+
+/* Return the value of the longest prefix containing addr, or -1.
+ */
+int prefix_set_lookup(const prefix_set_t *set, uint32_t addr)
+{
+	const trie_slot_t *slot;
+	uint32_t node = 0;
+	int level, best = -1;
+
+	if(set->hostcount) {
+		uint32_t i = host_hash(addr, set->hostsize);
+		while(set->hosts[i].value >= 0) {
+			if(set->hosts[i].addr == addr) {
+				return(set->hosts[i].value);
+			}
+			i = (i + 1) & (set->hostsize - 1);
+		}
+	}
+
+	for(level = 0; level < 32 / TRIE_STRIDE; level++) {
+		slot = &set->nodes[node].slot[(addr >> (24 - TRIE_STRIDE * level)) & 0xff];
+		if(slot->value >= 0) {
+			best = slot->value;
+		}
+		if(slot->child == 0) {
+			break;
+		}
+		node = slot->child;
+	}
+	return(best);
+}
+
+int prefix_set_count(const prefix_set_t *set)
+{
+	return(set->entrycount);
+}
+
+const prefix_entry_t* prefix_set_entry(const prefix_set_t *set, int idx)
+{
+	if(idx < 0 || idx >= set->entrycount) {
+		return(NULL);
+	}
+	return(&set->entries[idx]);
+}
+
+/* Format a prefix as "a.b.c.d/len" ("a.b.c.d" for host routes).
+ */
+char* prefix_to_str(uint32_t addr, int len, char *buf, int bufsize)
+{
+	struct in_addr in;
+	char ip[INET_ADDRSTRLEN];
+
+	in.s_addr = htonl(addr);
+	inet_ntop(AF_INET, &in, ip, sizeof(ip));
+	if(len == 32) {
+		snprintf(buf, bufsize, "%s", ip);
+	} else {
+		snprintf(buf, bufsize, "%s/%d", ip, len);
+	}
+	return(buf);
+}
+
+/* vim: set ts=2 sw=2 noet: */
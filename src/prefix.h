@@ -0,0 +1,53 @@
+/*
+ *  prefix.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_PREFIX_H
+#define _PAC_PREFIX_H
+
+#include <stdint.h>
+
+/* An IPv4 prefix table mapping address ranges to small non-negative values.
+ * Host routes (/32) live in an open-addressing hash, everything shorter in a
+ * stride-8 multibit trie, so a lookup costs one hash probe plus at most four
+ * array indexings. The longest matching prefix wins.
+ *
+ * All addresses are passed in host byte order.
+ */
+typedef struct prefix_entry {
+	uint32_t addr;
+	int len;
+	int value;
+} prefix_entry_t;
+
+typedef struct prefix_set prefix_set_t;
+
+prefix_set_t* prefix_set_new();
+void prefix_set_free(prefix_set_t *set);
+int prefix_set_add(prefix_set_t *set, uint32_t addr, int len, int value);
+int prefix_set_parse(prefix_set_t *set, const char *str, int value);
+int prefix_set_load(prefix_set_t *set, const char *path, int value);
+int prefix_set_lookup(const prefix_set_t *set, uint32_t addr);
+int prefix_set_count(const prefix_set_t *set);
+const prefix_entry_t* prefix_set_entry(const prefix_set_t *set, int idx);
+char* prefix_to_str(uint32_t addr, int len, char *buf, int bufsize);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
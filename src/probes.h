@@ -0,0 +1,67 @@
+/*
+ *  probes.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+#ifndef _PAC_PROBES_H
+#define _PAC_PROBES_H
+
+/* USDT probes of the "knockd" provider, for bpftrace(8), perf(1) and the
+ * like, eg:
+ *
+ *   bpftrace -e 'usdt:/usr/sbin/knockd:knockd:attempt_invalid { @[str(arg1)] = count(); }'
+ *
+ * With sys/sdt.h a probe is a single nop plus an ELF note describing where
+ * its arguments live; it only costs something while a tracer is attached.
+ * Without sys/sdt.h (or with --disable-usdt) probes compile to nothing, so
+ * their arguments must not have side effects.
+ *
+ * Probes and their arguments (addresses in host byte order):
+ *
+ *   packet(src, dst, proto, dport, tcp_flags)       sniff() decoded a packet
+ *   attempt_new(src, door, dport)                   first knock of a sequence
+ *   attempt_stage(src, door, stage)                 knock advanced an attempt
+ *   attempt_invalid(src, door, stage, dport)        wrong knock broke an attempt
+ *   attempt_timeout(src, door, stage)               attempt ran out of time
+ *   attempt_done(src, door, stage, seqcount, opened)
+ *                                                   process_attempt() returns
+ *   exec_dispatch(door, prio)                       command handed to the executor
+ *   exec_spawn(door, pid, errno, spawn_us)          executor started a command
+ *   exec_exit(door, pid, status)                    the command exited
+ *   filter(iface, netns, filter)                    new pcap filter set
+ *
+ * exec_spawn and exec_exit fire in the executor process.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)                DTRACE_PROBE1(knockd, name, a)
+#define PROBE2(name, a, b)             DTRACE_PROBE2(knockd, name, a, b)
+#define PROBE3(name, a, b, c)          DTRACE_PROBE3(knockd, name, a, b, c)
+#define PROBE4(name, a, b, c, d)       DTRACE_PROBE4(knockd, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)    DTRACE_PROBE5(knockd, name, a, b, c, d, e)
+#else
+#define PROBE1(name, a)                do { } while(0)
+#define PROBE2(name, a, b)             do { } while(0)
+#define PROBE3(name, a, b, c)          do { } while(0)
+#define PROBE4(name, a, b, c, d)       do { } while(0)
+#define PROBE5(name, a, b, c, d, e)    do { } while(0)
+#endif
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,196 @@
+/*
+ *  ratelimit.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include "srctab.h"
+#include "ratelimit.h"
+
+/* tokens are kept in fixed point so that slow rates (eg, 1/h) still refill
+ * by a non-zero amount every millisecond */
+#define TOKEN_SCALE 1000000000ULL
+
+typedef struct bucket {
+	uint64_t tokens;
+	uint64_t stamp;   /* time of the last refill in ms, 0 = new bucket */
+} bucket_t;
+
+typedef struct source_buckets {
+	bucket_t packets;
+	bucket_t opens;
+} source_buckets_t;
+
+typedef struct limit {
+	uint64_t refill;  /* scaled tokens per ms */
+	uint64_t max;     /* scaled bucket size */
+} limit_t;
+
+static srctab_t *table = NULL;
+static limit_t pkt_limit;
+static limit_t open_limit;
+static ratelimit_stats_t stats;
+
+/* Parse a rate of the form "<count>[/s|/m|/h][:<burst>]". The period
+ * defaults to seconds and the burst to count. Returns non-zero on error.
+ */
+int ratelimit_parse(const char *str, ratelimit_spec_t *spec)
+{
+	char *end;
+	long n;
+
+	n = strtol(str, &end, 10);
+	if(end == str || n < 0) {
+		return(1);
+	}
+	spec->count = (unsigned int)n;
+	spec->period = 1000;
+	if(*end == '/') {
+		switch(end[1]) {
+			case 's': spec->period = 1000; break;
+			case 'm': spec->period = 60 * 1000; break;
+			case 'h': spec->period = 3600 * 1000; break;
+			default:  return(1);
+		}
+		end += 2;
+	}
+	spec->burst = spec->count;
+	if(*end == ':') {
+		str = end + 1;
+		n = strtol(str, &end, 10);
+		if(end == str || n <= 0) {
+			return(1);
+		}
+		spec->burst = (unsigned int)n;
+	}
+	return(*end != '\0');
+}
+
+static void set_limit(limit_t *limit, const ratelimit_spec_t *spec)
+{
+	if(spec->count == 0) {
+		limit->refill = limit->max = 0;
+		return;
+	}
+	/* round up, so that eg, 2/m really yields a token every 30 seconds */
+	limit->refill = ((uint64_t)spec->count * TOKEN_SCALE + spec->period - 1) / spec->period;
+	limit->max = (uint64_t)(spec->burst ? spec->burst : 1) * TOKEN_SCALE;
+}
+
+/* Set up the bucket table. Specs with a zero count are unlimited; if both
+ * are, no table is kept. An existing table of the same size is kept across
+ * reloads. Returns non-zero if the table cannot be allocated.
+ */
+int ratelimit_init(const ratelimit_spec_t *packets, const ratelimit_spec_t *opens, unsigned int size)
+{
+	set_limit(&pkt_limit, packets);
+	set_limit(&open_limit, opens);
+	if(pkt_limit.max == 0 && open_limit.max == 0) {
+		ratelimit_free();
+		return(0);
+	}
+	if(table && srctab_size(table) == srctab_size_for(size)) {
+		return(0);
+	}
+	ratelimit_free();
+	table = srctab_new(size, sizeof(source_buckets_t), NULL);
+	return(table == NULL);
+}
+
+void ratelimit_free()
+{
+	srctab_free(table);
+	table = NULL;
+}
+
+int ratelimit_enabled()
+{
+	return(table != NULL);
+}
+
+/* Refill the bucket up to now and try to take one token from it.
+ */
+static int take_token(bucket_t *b, const limit_t *limit, uint64_t now)
+{
+	if(b->stamp == 0 || b->tokens > limit->max) {
+		/* new, or the burst was lowered by a reload */
+		b->tokens = limit->max;
+	}
+	if(now > b->stamp) {
+		/* compare in elapsed time first so the product cannot overflow */
+		uint64_t elapsed = now - b->stamp;
+		if(elapsed > (limit->max - b->tokens) / limit->refill) {
+			b->tokens = limit->max;
+		} else {
+			b->tokens += elapsed * limit->refill;
+		}
+	}
+	b->stamp = now;
+	if(b->tokens < TOKEN_SCALE) {
+		return(0);
+	}
+	b->tokens -= TOKEN_SCALE;
+	return(1);
+}
+
+static source_buckets_t* get_buckets(uint32_t addr, const struct timeval *now)
+{
+	return((source_buckets_t*)srctab_insert(table, addr, now->tv_sec));
+}
+
+static uint64_t msecs(const struct timeval *tv)
+{
+	return((uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000);
+}
+
+/* Returns 1 if a packet from addr may be processed
+ */
+int ratelimit_packet(uint32_t addr, const struct timeval *now)
+{
+	if(table == NULL || pkt_limit.max == 0) {
+		return(1);
+	}
+	if(!take_token(&get_buckets(addr, now)->packets, &pkt_limit, msecs(now))) {
+		stats.packets_limited++;
+		return(0);
+	}
+	return(1);
+}
+
+/* Returns 1 if addr may open a door
+ */
+int ratelimit_open(uint32_t addr, const struct timeval *now)
+{
+	if(table == NULL || open_limit.max == 0) {
+		return(1);
+	}
+	if(!take_token(&get_buckets(addr, now)->opens, &open_limit, msecs(now))) {
+		stats.opens_limited++;
+		return(0);
+	}
+	return(1);
+}
+
+void ratelimit_get_stats(ratelimit_stats_t *s)
+{
+	*s = stats;
+	s->tracked = table ? srctab_count(table) : 0;
+	s->size = table ? srctab_size(table) : 0;
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,53 @@
+/*
+ *  ratelimit.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_RATELIMIT_H
+#define _PAC_RATELIMIT_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Per-source token buckets, one for packets reaching the knock matching
+ * logic and one for door openings. Buckets are kept in a fixed-size srctab.
+ */
+typedef struct ratelimit_spec {
+	unsigned int count;     /* tokens per period, 0 = unlimited */
+	unsigned int period;    /* period in milliseconds */
+	unsigned int burst;     /* bucket size */
+} ratelimit_spec_t;
+
+typedef struct ratelimit_stats {
+	unsigned long packets_limited;
+	unsigned long opens_limited;
+	unsigned int tracked;
+	unsigned int size;
+} ratelimit_stats_t;
+
+int ratelimit_parse(const char *str, ratelimit_spec_t *spec);
+int ratelimit_init(const ratelimit_spec_t *packets, const ratelimit_spec_t *opens, unsigned int size);
+void ratelimit_free();
+int ratelimit_enabled();
+int ratelimit_packet(uint32_t addr, const struct timeval *now);
+int ratelimit_open(uint32_t addr, const struct timeval *now);
+void ratelimit_get_stats(ratelimit_stats_t *stats);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
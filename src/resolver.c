@@ -0,0 +1,331 @@
+/*
+ *  resolver.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
+#include "srctab.h"
+#include "resolver.h"
+#include "util.h"
+
+#define THREADS      4      /* so one slow server does not hold up all lookups */
+#define QUEUE_SIZE   256    /* addresses waiting for a resolver thread */
+#define MIN_TTL      30     /* shortest time a result is cached (seconds) */
+#define MAX_TTL      86400  /* longest time a name is cached */
+#define MAX_NEG_TTL  3600   /* longest time a missing name is cached */
+#define FAIL_TTL     60     /* time a server failure or timeout is cached */
+#define DEFAULT_TTL  3600   /* for names from getnameinfo(), which has no TTL */
+
+#define ENTRY_PENDING 0     /* new entries are zeroed, so pending */
+#define ENTRY_FOUND   1
+#define ENTRY_NONE    2
+
+typedef struct entry {
+	int state;
+	time_t expires;
+	char name[RESOLVER_NAME_MAX];
+} entry_t;
+
+static srctab_t *cache = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[THREADS];
+static int running = 0;    /* threads started */
+static int stopping = 0;
+static uint32_t queue[QUEUE_SIZE];
+static unsigned int queue_head;
+static unsigned int queue_count;
+static resolver_stats_t stats;
+
+static time_t now_secs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + 1);  /* srctab takes 0 for "no time" */
+}
+
+#ifdef HAVE_NS_INITPARSE
+static unsigned int clamp_ttl(unsigned long ttl, unsigned long max)
+{
+	return(ttl < MIN_TTL ? MIN_TTL : ttl > max ? max : ttl);
+}
+
+/* The minimum field of an SOA record, the TTL of negative answers
+ * (RFC 2308). Returns -1 if the record is malformed.
+ */
+static long soa_minimum(ns_rr *rr)
+{
+	const unsigned char *p = ns_rr_rdata(*rr), *end = p + ns_rr_rdlen(*rr);
+	unsigned long minimum;
+	int i, n;
+
+	/* skip MNAME and RNAME */
+	for(i = 0; i < 2; i++) {
+		if((n = dn_skipname(p, end)) < 0) {
+			return(-1);
+		}
+		p += n;
+	}
+	if(end - p < 20) {
+		return(-1);
+	}
+	p += 16;
+	NS_GET32(minimum, p);
+	return(minimum);
+}
+
+/* Look up the PTR record of addr (host byte order). Returns 1 and the name
+ * if there is one, 0 otherwise; ttl is set to the time the result may be
+ * cached either way.
+ */
+static int query(res_state res, uint32_t addr, char *name, size_t len, unsigned int *ttl)
+{
+	unsigned char question[NS_PACKETSZ], answer[NS_MAXMSG];
+	char qname[32];
+	ns_msg msg;
+	ns_rr rr;
+	long minimum;
+	int i, n, rcode;
+
+	*ttl = FAIL_TTL;
+	snprintf(qname, sizeof(qname), "%u.%u.%u.%u.in-addr.arpa", addr & 0xff, (addr >> 8) & 0xff,
+			(addr >> 16) & 0xff, addr >> 24);
+	if((n = res_nmkquery(res, ns_o_query, qname, ns_c_in, ns_t_ptr, NULL, 0, NULL,
+					question, sizeof(question))) < 0) {
+		return(0);
+	}
+	/* res_nsend() rather than res_nquery(), which hides negative answers */
+	if((n = res_nsend(res, question, n, answer, sizeof(answer))) < 0 ||
+			ns_initparse(answer, n, &msg) < 0) {
+		return(0);
+	}
+	rcode = ns_msg_getflag(msg, ns_f_rcode);
+	if(rcode == ns_r_noerror) {
+		for(i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+			if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+				return(0);
+			}
+			if(ns_rr_type(rr) == ns_t_ptr &&
+					dn_expand(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr), name, len) >= 0) {
+				*ttl = clamp_ttl(ns_rr_ttl(rr), MAX_TTL);
+				return(1);
+			}
+		}
+	} else if(rcode != ns_r_nxdomain) {
+		return(0);
+	}
+	/* no such name: cached as long as the zone's SOA allows */
+	for(i = 0; i < ns_msg_count(msg, ns_s_ns); i++) {
+		if(ns_parserr(&msg, ns_s_ns, i, &rr) == 0 && ns_rr_type(rr) == ns_t_soa &&
+				(minimum = soa_minimum(&rr)) >= 0) {
+			*ttl = clamp_ttl((unsigned long)minimum < ns_rr_ttl(rr) ? (unsigned long)minimum : ns_rr_ttl(rr),
+					MAX_NEG_TTL);
+			break;
+		}
+	}
+	return(0);
+}
+#else
+/* Without the resolver's parser there are no TTLs, results are cached for
+ * fixed times.
+ */
+static int query(res_state res, uint32_t addr, char *name, size_t len, unsigned int *ttl)
+{
+	struct sockaddr_in sin;
+	int ret;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(addr);
+	ret = getnameinfo((struct sockaddr*)&sin, sizeof(sin), name, len, NULL, 0, NI_NAMEREQD);
+	if(ret == 0) {
+		*ttl = DEFAULT_TTL;
+		return(1);
+	}
+	*ttl = ret == EAI_NONAME ? MAX_NEG_TTL : FAIL_TTL;
+	return(0);
+}
+#endif
+
+static void* worker(void *arg)
+{
+	struct __res_state res;
+	char name[RESOLVER_NAME_MAX];
+	unsigned int ttl;
+	uint32_t addr;
+	entry_t *e;
+	int found;
+
+	memset(&res, 0, sizeof(res));
+#ifdef HAVE_NS_INITPARSE
+	res_ninit(&res);
+#endif
+	/* resolver_stop() cancels a query in progress, but nothing else */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&lock);
+	while(!stopping) {
+		if(queue_count == 0) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		addr = queue[queue_head];
+		queue_head = (queue_head + 1) % QUEUE_SIZE;
+		queue_count--;
+		pthread_mutex_unlock(&lock);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		found = query(&res, addr, name, sizeof(name), &ttl);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		pthread_mutex_lock(&lock);
+		/* the pending entry may have been displaced meanwhile */
+		e = (entry_t*)srctab_insert(cache, addr, now_secs());
+		e->state = found ? ENTRY_FOUND : ENTRY_NONE;
+		e->expires = now_secs() + ttl;
+		if(found) {
+			strncpy(e->name, name, sizeof(e->name)-1);
+			e->name[sizeof(e->name)-1] = '\0';
+			stats.resolved++;
+		} else {
+			stats.failed++;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+#ifdef HAVE_NS_INITPARSE
+	res_nclose(&res);
+#endif
+	return(NULL);
+}
+
+/* Set up a cache of size entries and start the resolver threads. Returns
+ * non-zero on error with errno set.
+ */
+int resolver_start(unsigned int size)
+{
+	int i, ret = 0;
+
+	if(running) {
+		return(0);
+	}
+	if((cache = srctab_new(size, sizeof(entry_t), NULL)) == NULL) {
+		return(1);
+	}
+	stopping = 0;
+	for(i = 0; i < THREADS && ret == 0; i++) {
+		if((ret = start_thread(&threads[i], worker, NULL)) == 0) {
+			running++;
+		}
+	}
+	if(ret) {
+		resolver_stop();
+		errno = ret;
+		return(1);
+	}
+	return(0);
+}
+
+void resolver_stop()
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for(i = 0; i < running; i++) {
+		pthread_cancel(threads[i]);
+		pthread_join(threads[i], NULL);
+	}
+	running = 0;
+	srctab_free(cache);
+	cache = NULL;
+	queue_count = 0;
+}
+
+/* Return the name of addr (host byte order) as a malloc'd string, or NULL
+ * if it has none or is not known yet. Addresses not in the cache are queued
+ * for the resolver threads; this never waits for the DNS.
+ */
+char* resolver_lookup(uint32_t addr)
+{
+	time_t now = now_secs();
+	char *name = NULL;
+	entry_t *e;
+
+	if(!running) {
+		return(NULL);
+	}
+	pthread_mutex_lock(&lock);
+	e = (entry_t*)srctab_lookup(cache, addr, now);
+	if(e && e->state != ENTRY_PENDING && e->expires <= now) {
+		e = NULL;
+	}
+	if(e == NULL) {
+		if(queue_count == QUEUE_SIZE) {
+			stats.dropped++;
+		} else {
+			/* an expired entry is kept, it has to be marked pending again */
+			e = (entry_t*)srctab_insert(cache, addr, now);
+			e->state = ENTRY_PENDING;
+			queue[(queue_head + queue_count) % QUEUE_SIZE] = addr;
+			queue_count++;
+			stats.queued++;
+			pthread_cond_signal(&cond);
+		}
+	} else if(e->state == ENTRY_FOUND) {
+		stats.hits++;
+		if((name = strdup(e->name)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	} else if(e->state == ENTRY_NONE) {
+		stats.negative++;
+	} else {
+		stats.pending++;
+	}
+	pthread_mutex_unlock(&lock);
+	return(name);
+}
+
+void resolver_get_stats(resolver_stats_t *s)
+{
+	pthread_mutex_lock(&lock);
+	*s = stats;
+	s->cached = cache ? srctab_count(cache) : 0;
+	s->size = cache ? srctab_size(cache) : 0;
+	pthread_mutex_unlock(&lock);
+}
+
+/* vim: set ts=2 sw=2 noet: */
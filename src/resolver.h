@@ -0,0 +1,52 @@
+/*
+ *  resolver.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_RESOLVER_H
+#define _PAC_RESOLVER_H
+
+#include <stdint.h>
+
+/* Reverse DNS lookups for log messages, done by threads of their own so
+ * that a slow or unreachable name server never holds up packet capture.
+ * Results, failures included, are kept in a fixed-size cache for as long as
+ * the DNS says they are valid.
+ */
+#define RESOLVER_NAME_MAX 256
+
+typedef struct resolver_stats {
+	unsigned long hits;      /* names returned from the cache */
+	unsigned long negative;  /* lookups answered by a cached failure */
+	unsigned long pending;   /* lookups of addresses still being resolved */
+	unsigned long queued;    /* addresses handed to the resolver threads */
+	unsigned long dropped;   /* not queued, the queue was full */
+	unsigned long resolved;
+	unsigned long failed;
+	unsigned int cached;
+	unsigned int size;
+} resolver_stats_t;
+
+int resolver_start(unsigned int size);
+void resolver_stop();
+char* resolver_lookup(uint32_t addr);
+void resolver_get_stats(resolver_stats_t *stats);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,191 @@
+/*
+ *  srctab.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "srctab.h"
+
+/* every slot is a header followed by datasize bytes of caller data */
+typedef struct srctab_slot {
+	uint32_t addr;
+	int used;
+	time_t stamp;   /* last time the slot was inserted or looked up */
+} srctab_slot_t;
+
+struct srctab {
+	unsigned char *slots;
+	size_t stride;
+	size_t datasize;
+	unsigned int nbuckets;  /* always a power of two */
+	unsigned int count;
+	srctab_evict_fn evict;
+};
+
+#define SLOT(tab, i) ((srctab_slot_t*)((tab)->slots + (size_t)(i) * (tab)->stride))
+#define SLOT_DATA(slot) ((void*)((unsigned char*)(slot) + sizeof(srctab_slot_t)))
+
+static unsigned int srctab_bucket(const srctab_t *tab, uint32_t addr)
+{
+	return(((addr * 2654435761U) >> 7) & (tab->nbuckets - 1));
+}
+
+/* Number of slots a table created for entries records will have
+ */
+unsigned int srctab_size_for(unsigned int entries)
+{
+	unsigned int n = 1;
+
+	while(n * SRCTAB_WAYS < entries) {
+		n *= 2;
+	}
+	return(n * SRCTAB_WAYS);
+}
+
+/* Create a table able to hold at least entries records of datasize bytes.
+ * evict (optional) is called for live records displaced by an insert.
+ */
+srctab_t* srctab_new(unsigned int entries, size_t datasize, srctab_evict_fn evict)
+{
+	srctab_t *tab;
+	unsigned int n = srctab_size_for(entries) / SRCTAB_WAYS;
+
+	if((tab = calloc(1, sizeof(srctab_t))) == NULL) {
+		return(NULL);
+	}
+	/* keep the caller's data suitably aligned */
+	tab->stride = (sizeof(srctab_slot_t) + datasize + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	tab->datasize = datasize;
+	tab->nbuckets = n;
+	tab->evict = evict;
+	if((tab->slots = calloc((size_t)n * SRCTAB_WAYS, tab->stride)) == NULL) {
+		free(tab);
+		return(NULL);
+	}
+	return(tab);
+}
+
+void srctab_free(srctab_t *tab)
+{
+	if(tab) {
+		free(tab->slots);
+		free(tab);
+	}
+}
+
+/* Return the record for addr or NULL. A non-zero now marks the record as
+ * recently used.
+ */
+void* srctab_lookup(srctab_t *tab, uint32_t addr, time_t now)
+{
+	unsigned int i, base = srctab_bucket(tab, addr) * SRCTAB_WAYS;
+	srctab_slot_t *slot;
+
+	for(i = base; i < base + SRCTAB_WAYS; i++) {
+		slot = SLOT(tab, i);
+		if(slot->used && slot->addr == addr) {
+			if(now) {
+				slot->stamp = now;
+			}
+			return(SLOT_DATA(slot));
+		}
+	}
+	return(NULL);
+}
+
+/* Return the record for addr, creating a zeroed one if needed. When the
+ * bucket is full the least recently used record is displaced.
+ */
+void* srctab_insert(srctab_t *tab, uint32_t addr, time_t now)
+{
+	unsigned int i, base = srctab_bucket(tab, addr) * SRCTAB_WAYS;
+	srctab_slot_t *slot, *victim = NULL;
+
+	for(i = base; i < base + SRCTAB_WAYS; i++) {
+		slot = SLOT(tab, i);
+		if(!slot->used) {
+			if(victim == NULL || victim->used) {
+				victim = slot;
+			}
+			continue;
+		}
+		if(slot->addr == addr) {
+			slot->stamp = now;
+			return(SLOT_DATA(slot));
+		}
+		if(victim == NULL || (victim->used && slot->stamp < victim->stamp)) {
+			victim = slot;
+		}
+	}
+
+	if(victim->used) {
+		if(tab->evict) {
+			tab->evict(victim->addr, SLOT_DATA(victim));
+		}
+	} else {
+		tab->count++;
+	}
+	victim->addr = addr;
+	victim->used = 1;
+	victim->stamp = now;
+	memset(SLOT_DATA(victim), 0, tab->datasize);
+	return(SLOT_DATA(victim));
+}
+
+void srctab_remove(srctab_t *tab, uint32_t addr)
+{
+	unsigned int i, base = srctab_bucket(tab, addr) * SRCTAB_WAYS;
+	srctab_slot_t *slot;
+
+	for(i = base; i < base + SRCTAB_WAYS; i++) {
+		slot = SLOT(tab, i);
+		if(slot->used && slot->addr == addr) {
+			slot->used = 0;
+			tab->count--;
+			return;
+		}
+	}
+}
+
+unsigned int srctab_count(const srctab_t *tab)
+{
+	return(tab->count);
+}
+
+unsigned int srctab_size(const srctab_t *tab)
+{
+	return(tab->nbuckets * SRCTAB_WAYS);
+}
+
+/* Call fn for every live record. fn must not insert or remove records.
+ */
+void srctab_walk(srctab_t *tab, srctab_walk_fn fn, void *arg)
+{
+	unsigned int i;
+	srctab_slot_t *slot;
+
+	for(i = 0; i < tab->nbuckets * SRCTAB_WAYS; i++) {
+		slot = SLOT(tab, i);
+		if(slot->used) {
+			fn(slot->addr, SLOT_DATA(slot), arg);
+		}
+	}
+}
+
+/* vim: set ts=2 sw=2 noet: */
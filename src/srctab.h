@@ -0,0 +1,52 @@
+/*
+ *  srctab.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_SRCTAB_H
+#define _PAC_SRCTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* A fixed-memory table of per-source records keyed by IPv4 address (host
+ * byte order). The table is set-associative: each address hashes to one
+ * bucket of SRCTAB_WAYS slots, and inserting into a full bucket displaces
+ * the slot that was least recently touched. Memory use never grows after
+ * srctab_new().
+ */
+#define SRCTAB_WAYS 8
+
+typedef struct srctab srctab_t;
+typedef void (*srctab_evict_fn)(uint32_t addr, void *data);
+typedef void (*srctab_walk_fn)(uint32_t addr, void *data, void *arg);
+
+srctab_t* srctab_new(unsigned int entries, size_t datasize, srctab_evict_fn evict);
+void srctab_free(srctab_t *tab);
+void* srctab_lookup(srctab_t *tab, uint32_t addr, time_t now);
+void* srctab_insert(srctab_t *tab, uint32_t addr, time_t now);
+void srctab_remove(srctab_t *tab, uint32_t addr);
+unsigned int srctab_count(const srctab_t *tab);
+unsigned int srctab_size(const srctab_t *tab);
+unsigned int srctab_size_for(unsigned int entries);
+void srctab_walk(srctab_t *tab, srctab_walk_fn fn, void *arg);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
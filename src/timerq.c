@@ -0,0 +1,183 @@
+/*
+ *  timerq.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include "timerq.h"
+
+struct timer {
+	uint64_t due;
+	void *data;
+};
+
+struct timerq {
+	struct timer *heap;
+	unsigned int count;
+	unsigned int size;
+};
+
+/* Move t up from slot i to where it belongs
+ */
+static void sift_up(timerq_t *tq, unsigned int i, struct timer t)
+{
+	unsigned int parent;
+
+	for(; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if(tq->heap[parent].due <= t.due) {
+			break;
+		}
+		tq->heap[i] = tq->heap[parent];
+	}
+	tq->heap[i] = t;
+}
+
+/* Move t down from slot i to where it belongs
+ */
+static void sift_down(timerq_t *tq, unsigned int i, struct timer t)
+{
+	unsigned int child;
+
+	for(; (child = 2 * i + 1) < tq->count; i = child) {
+		if(child + 1 < tq->count && tq->heap[child + 1].due < tq->heap[child].due) {
+			child++;
+		}
+		if(t.due <= tq->heap[child].due) {
+			break;
+		}
+		tq->heap[i] = tq->heap[child];
+	}
+	tq->heap[i] = t;
+}
+
+timerq_t* timerq_new()
+{
+	return(calloc(1, sizeof(timerq_t)));
+}
+
+/* Free the queue, passing the data of timers still pending to free_fn
+ * (if given)
+ */
+void timerq_free(timerq_t *tq, void (*free_fn)(void *data))
+{
+	unsigned int i;
+
+	if(tq == NULL) {
+		return;
+	}
+	if(free_fn) {
+		for(i = 0; i < tq->count; i++) {
+			free_fn(tq->heap[i].data);
+		}
+	}
+	free(tq->heap);
+	free(tq);
+}
+
+/* Add a timer for data. Returns non-zero if the queue cannot grow.
+ */
+int timerq_add(timerq_t *tq, uint64_t due, void *data)
+{
+	struct timer t;
+
+	if(tq->count == tq->size) {
+		unsigned int size = tq->size ? tq->size * 2 : 64;
+		struct timer *heap = realloc(tq->heap, size * sizeof(struct timer));
+		if(heap == NULL) {
+			return(1);
+		}
+		tq->heap = heap;
+		tq->size = size;
+	}
+
+	t.due = due;
+	t.data = data;
+	sift_up(tq, tq->count++, t);
+	return(0);
+}
+
+/* Due time of the earliest timer, 0 if there is none
+ */
+uint64_t timerq_next(const timerq_t *tq)
+{
+	return(tq->count ? tq->heap[0].due : 0);
+}
+
+/* Remove the earliest timer and return its data if it is due at now,
+ * otherwise return NULL
+ */
+void* timerq_pop(timerq_t *tq, uint64_t now)
+{
+	void *data;
+
+	if(tq->count == 0 || tq->heap[0].due > now) {
+		return(NULL);
+	}
+	data = tq->heap[0].data;
+
+	/* sift the last timer down from the root */
+	tq->count--;
+	sift_down(tq, 0, tq->heap[tq->count]);
+	return(data);
+}
+
+/* Change the due time of the timer for data. This has to search the queue,
+ * so it is meant for rare events. Returns non-zero if there is no such timer.
+ */
+int timerq_reschedule(timerq_t *tq, void *data, uint64_t due)
+{
+	struct timer t;
+	unsigned int i;
+
+	for(i = 0; i < tq->count; i++) {
+		if(tq->heap[i].data == data) {
+			break;
+		}
+	}
+	if(i == tq->count) {
+		return(1);
+	}
+	t.due = due;
+	t.data = data;
+	if(i > 0 && tq->heap[(i - 1) / 2].due > due) {
+		sift_up(tq, i, t);
+	} else {
+		sift_down(tq, i, t);
+	}
+	return(0);
+}
+
+unsigned int timerq_count(const timerq_t *tq)
+{
+	return(tq->count);
+}
+
+/* Call fn for the data and due time of every pending timer, in no
+ * particular order. fn must not add or remove timers.
+ */
+void timerq_walk(timerq_t *tq, void (*fn)(void *data, uint64_t due, void *arg), void *arg)
+{
+	unsigned int i;
+
+	for(i = 0; i < tq->count; i++) {
+		fn(tq->heap[i].data, tq->heap[i].due, arg);
+	}
+}
+
+/* vim: set ts=2 sw=2 noet: */
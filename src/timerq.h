@@ -0,0 +1,43 @@
+/*
+ *  timerq.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_TIMERQ_H
+#define _PAC_TIMERQ_H
+
+#include <stdint.h>
+
+/* A queue of timers ordered by due time (a binary min-heap), so that
+ * thousands of pending timers cost one wakeup for the earliest of them.
+ * Times are in milliseconds on any monotonic clock the caller likes.
+ */
+typedef struct timerq timerq_t;
+
+timerq_t* timerq_new();
+void timerq_free(timerq_t *tq, void (*free_fn)(void *data));
+int timerq_add(timerq_t *tq, uint64_t due, void *data);
+uint64_t timerq_next(const timerq_t *tq);
+void* timerq_pop(timerq_t *tq, uint64_t now);
+int timerq_reschedule(timerq_t *tq, void *data, uint64_t due);
+unsigned int timerq_count(const timerq_t *tq);
+void timerq_walk(timerq_t *tq, void (*fn)(void *data, uint64_t due, void *arg), void *arg);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
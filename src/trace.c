@@ -0,0 +1,211 @@
+/*
+ *  trace.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "metrics.h"
+#include "trace.h"
+
+typedef struct trace_ring {
+	struct trace_ring *next;
+	unsigned int thread;       /* in the order threads started recording */
+	uint64_t head;             /* records written so far */
+	trace_record_t recs[1];
+} trace_ring_t;
+
+unsigned int trace_size = 0;	/* records per thread, 0 = off */
+
+static __thread trace_ring_t *ring = NULL;
+static trace_ring_t *rings = NULL;
+static unsigned int nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *type_names[] = {
+	"?", "decode", "reject", "flags", "stage", "invalid", "timeout", "open"
+};
+
+/* Keep the last records records of every thread, 0 turns the recorder off.
+ * Only to be called before the first record; rings are allocated as threads
+ * start recording.
+ */
+void trace_init(unsigned int records)
+{
+	trace_size = records;
+}
+
+/* The ring of the calling thread, set up on its first record
+ */
+static trace_ring_t* thread_ring()
+{
+	trace_ring_t *r;
+
+	if(ring) {
+		return(ring);
+	}
+	if((r = calloc(1, sizeof(trace_ring_t) + (trace_size - 1) * sizeof(trace_record_t))) == NULL) {
+		return(NULL);
+	}
+	pthread_mutex_lock(&rings_lock);
+	r->thread = nrings++;
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	return(ring = r);
+}
+
+/* Record an event, addr in host byte order and time in microseconds since
+ * the epoch. Callers use TRACE(), which does nothing while the recorder is
+ * off.
+ */
+void trace_add(int type, uint32_t addr, unsigned int door, unsigned int port,
+		unsigned int proto, unsigned int arg, uint64_t time)
+{
+	trace_ring_t *r;
+	trace_record_t *rec;
+
+	if((r = thread_ring()) == NULL) {
+		return;
+	}
+	rec = &r->recs[r->head % trace_size];
+	rec->time = time;
+	rec->addr = addr;
+	rec->door = door > TRACE_NO_DOOR ? TRACE_NO_DOOR : door;
+	rec->port = port;
+	rec->type = type;
+	rec->proto = proto;
+	rec->arg = arg;
+	/* a dump from another thread only reads records below head */
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static void format_flags(unsigned int flags, char *buf)
+{
+	const char *names = "FSRPAU";
+	int i, n = 0;
+
+	for(i = 0; i < 6; i++) {
+		if(flags & (1 << i)) {
+			buf[n++] = names[i];
+		}
+	}
+	if(n == 0) {
+		buf[n++] = '-';
+	}
+	buf[n] = '\0';
+}
+
+static void print_record(FILE *f, const trace_record_t *rec, trace_door_fn door_name)
+{
+	struct in_addr in;
+	struct tm tm;
+	time_t secs = rec->time / 1000000;
+	const char *door = NULL;
+	char date[32], src[16], flags[8];
+
+	localtime_r(&secs, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	in.s_addr = htonl(rec->addr);
+	inet_ntop(AF_INET, &in, src, sizeof(src));
+	if(rec->door != TRACE_NO_DOOR && door_name) {
+		door = door_name(rec->door);
+	}
+	fprintf(f, "%s.%06lu %s %s", date, (unsigned long)(rec->time % 1000000), src,
+			rec->type < sizeof(type_names) / sizeof(type_names[0]) ? type_names[rec->type] : "?");
+	if(rec->door != TRACE_NO_DOOR) {
+		fprintf(f, " %s", door ? door : "?");
+	}
+	switch(rec->type) {
+		case TRACE_DECODE:
+			format_flags(rec->arg, flags);
+			fprintf(f, " %s/%u", rec->proto == IPPROTO_UDP ? "udp" : rec->proto == IPPROTO_TCP ? "tcp" : "ip",
+					rec->port);
+			if(rec->proto == IPPROTO_TCP) {
+				fprintf(f, " flags %s", flags);
+			}
+			break;
+		case TRACE_REJECT:
+			fprintf(f, " %s", metrics_reject_name(rec->arg));
+			break;
+		case TRACE_FLAGS:
+			format_flags(rec->arg, flags);
+			fprintf(f, " flags %s", flags);
+			break;
+		case TRACE_INVALID:
+			fprintf(f, " stage %u by %s/%u", rec->arg, rec->proto == IPPROTO_UDP ? "udp" : "tcp", rec->port);
+			break;
+		case TRACE_STAGE:
+		case TRACE_TIMEOUT:
+			fprintf(f, " stage %u", rec->arg);
+			break;
+	}
+	fputc('\n', f);
+}
+
+/* Write the records of every thread to path, oldest first, as text. The
+ * rings are copied before formatting, records written meanwhile by other
+ * threads may be garbled. Returns non-zero on error with errno set.
+ */
+int trace_dump(const char *path, trace_door_fn door_name, unsigned long *written)
+{
+	trace_record_t *copy;
+	trace_ring_t *r;
+	uint64_t head, first, i;
+	FILE *f;
+	int ret = 0;
+
+	*written = 0;
+	if((f = fopen(path, "w")) == NULL) {
+		return(1);
+	}
+	if((copy = malloc(sizeof(trace_record_t) * (trace_size ? trace_size : 1))) == NULL) {
+		fclose(f);
+		return(1);
+	}
+	pthread_mutex_lock(&rings_lock);
+	for(r = rings; r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		first = head > trace_size ? head - trace_size : 0;
+		for(i = first; i < head; i++) {
+			copy[i - first] = r->recs[i % trace_size];
+		}
+		fprintf(f, "# thread %u: %lu of %lu records\n", r->thread, (unsigned long)(head - first),
+				(unsigned long)head);
+		for(i = 0; i < head - first; i++) {
+			print_record(f, &copy[i], door_name);
+		}
+		*written += head - first;
+	}
+	pthread_mutex_unlock(&rings_lock);
+	free(copy);
+	if(ferror(f)) {
+		ret = 1;
+	}
+	if(fclose(f)) {
+		ret = 1;
+	}
+	return(ret);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,67 @@
+/*
+ *  trace.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+#ifndef _PAC_TRACE_H
+#define _PAC_TRACE_H
+
+#include <stdint.h>
+
+/* A flight recorder: every thread that records gets a fixed-size ring of
+ * compact binary records, overwriting the oldest ones. Recording is a copy
+ * into the ring and nothing else; the rings are only formatted when they are
+ * dumped to a file, eg, after a knock failed for unknown reasons.
+ */
+#define TRACE_DECODE   1   /* packet decoded: port, protocol, TCP flags */
+#define TRACE_REJECT   2   /* packet dropped before matching: REJECT_* reason */
+#define TRACE_FLAGS    3   /* TCP flags do not suit the door: the flags */
+#define TRACE_STAGE    4   /* knock advanced the attempt: stage reached */
+#define TRACE_INVALID  5   /* wrong knock broke the attempt: stage it had */
+#define TRACE_TIMEOUT  6   /* attempt timed out: stage it had */
+#define TRACE_OPEN     7   /* sequence complete, door opened */
+
+#define TRACE_NO_DOOR  0xffff
+
+typedef struct trace_record {
+	uint64_t time;     /* microseconds since the epoch */
+	uint32_t addr;     /* source, host byte order */
+	uint16_t door;     /* door id (see eventlog_door()), TRACE_NO_DOOR = none */
+	uint16_t port;
+	uint8_t type;
+	uint8_t proto;
+	uint8_t arg;
+	uint8_t pad;
+} trace_record_t;
+
+/* name of a door id for dumps, NULL = unknown */
+typedef const char* (*trace_door_fn)(unsigned int door);
+
+extern unsigned int trace_size;
+
+void trace_init(unsigned int records);
+void trace_add(int type, uint32_t addr, unsigned int door, unsigned int port,
+		unsigned int proto, unsigned int arg, uint64_t time);
+int trace_dump(const char *path, trace_door_fn door_name, unsigned long *written);
+
+/* skip the call altogether while the recorder is off */
+#define TRACE(type, addr, door, port, proto, arg, time) \
+	do { if(trace_size) trace_add(type, addr, door, port, proto, arg, time); } while(0)
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
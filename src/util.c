@@ -0,0 +1,133 @@
+/*
+ *  util.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "util.h"
+
+/* Milliseconds on a clock that is not affected by changes of the system time
+ */
+uint64_t now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Microseconds on the same clock, the one the executor stamps its jobs with
+ */
+uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* The earlier of two deadlines, 0 = none
+ */
+uint64_t sooner(uint64_t a, uint64_t b)
+{
+	return(a == 0 || (b && b < a) ? b : a);
+}
+
+/* Make fd non-blocking and close-on-exec. Returns non-zero on error.
+ */
+int set_nonblock(int fd)
+{
+	return(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+			fcntl(fd, F_SETFD, FD_CLOEXEC) < 0);
+}
+
+/* Listen on a Unix stream socket at path that only root may connect to,
+ * replacing whatever is there. Returns the non-blocking socket, or -1 on
+ * error with errno set.
+ */
+int listen_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd, ret;
+
+	if(strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return(-1);
+	}
+	unlink(path);
+	mask = umask(0177);
+	ret = bind(fd, (struct sockaddr*)&sun, sizeof(sun));
+	umask(mask);
+	if(ret || listen(fd, 16) || set_nonblock(fd)) {
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+
+/* Accept the next connection waiting on listen_fd. Returns it non-blocking,
+ * or -1 once there are no more.
+ */
+int accept_client(int listen_fd)
+{
+	int fd;
+
+	while((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		if(set_nonblock(fd) == 0) {
+			return(fd);
+		}
+		close(fd);
+	}
+	return(-1);
+}
+
+/* Start a thread with all signals blocked, signals are for the main thread.
+ * Returns 0 or an error number, like pthread_create().
+ */
+int start_thread(pthread_t *thread, void *(*fn)(void *arg), void *arg)
+{
+	sigset_t all, old;
+	int ret;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(thread, NULL, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return(ret);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,42 @@
+/*
+ *  util.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_UTIL_H
+#define _PAC_UTIL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* Helpers shared by the modules that serve local sockets (admin, event
+ * stream, metrics) and those that run threads next to the main one.
+ */
+#define IDLE_MAX 5000   /* ms a client may go without making progress before it is dropped */
+
+uint64_t now_ms();
+uint64_t now_us();
+uint64_t sooner(uint64_t a, uint64_t b);
+int set_nonblock(int fd);
+int listen_unix(const char *path);
+int accept_client(int listen_fd);
+int start_thread(pthread_t *thread, void *(*fn)(void *arg), void *arg);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */
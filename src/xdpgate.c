@@ -0,0 +1,382 @@
+/*
+ *  xdpgate.c
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include "xdpgate.h"
+
+#ifdef HAVE_LINUX_BPF_H
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+
+/* map keys, all fields in network byte order */
+typedef struct port_key {
+	uint16_t port;
+	uint8_t proto;
+	uint8_t pad;
+} port_key_t;
+
+typedef struct grant_key {
+	uint32_t addr;
+	port_key_t port;
+} grant_key_t;
+
+struct xdpgate {
+	int protected_fd;   /* port_key_t -> uint32_t (unused) */
+	int granted_fd;     /* grant_key_t -> uint64_t expiry in CLOCK_MONOTONIC ns, 0 = none */
+	int prog_fd;
+	int link_fd;
+};
+
+#define PROTECTED_MAX 256
+
+/* eBPF instruction encoding, see Documentation/bpf/instruction-set.rst */
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define LDX(sz, d, s, o)    INSN(BPF_LDX | BPF_MEM | (sz), d, s, o, 0)
+#define STX(sz, d, s, o)    INSN(BPF_STX | BPF_MEM | (sz), d, s, o, 0)
+#define ST(sz, d, o, i)     INSN(BPF_ST | BPF_MEM | (sz), d, 0, o, i)
+#define ALU_K(op, d, i)     INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define ALU_X(op, d, s)     INSN(BPF_ALU64 | (op) | BPF_X, d, s, 0, 0)
+#define JMP_K(op, d, i, o)  INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMP_X(op, d, s, o)  INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define CALL(f)             INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()              INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* jumps to these are patched once the program is laid out */
+#define TO_PASS 0x7ff0
+#define TO_DROP 0x7ff1
+
+/* Load a map fd into a register, a two instruction wide opcode
+ */
+static int ld_map(struct bpf_insn *insn, int reg, int fd)
+{
+	insn[0] = INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, fd);
+	insn[1] = INSN(0, 0, 0, 0, 0);
+	return(2);
+}
+
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return(syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+}
+
+static int map_create(int type, unsigned int keysize, unsigned int valsize, unsigned int entries)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = keysize;
+	attr.value_size = valsize;
+	attr.max_entries = entries;
+	return(sys_bpf(BPF_MAP_CREATE, &attr));
+}
+
+static int map_update(int fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	attr.value = (uint64_t)(unsigned long)value;
+	attr.flags = BPF_ANY;
+	return(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr));
+}
+
+static int map_delete(int fd, const void *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	return(sys_bpf(BPF_MAP_DELETE_ELEM, &attr));
+}
+
+static int map_next_key(int fd, const void *key, void *next)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	attr.next_key = (uint64_t)(unsigned long)next;
+	return(sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr));
+}
+
+/* Assemble and load the filter. Returns the program fd or -1, with the
+ * verifier's complaint in log.
+ */
+static int load_prog(int protected_fd, int granted_fd, char *log, size_t logsize)
+{
+	struct bpf_insn prog[64];
+	union bpf_attr attr;
+	int i, n = 0, drop = 0, pass = 0;
+
+	/* r6 = packet, r3 = end of packet */
+	prog[n++] = LDX(BPF_W, 6, 1, offsetof(struct xdp_md, data));
+	prog[n++] = LDX(BPF_W, 3, 1, offsetof(struct xdp_md, data_end));
+	/* ethernet + minimal IPv4 header */
+	prog[n++] = ALU_X(BPF_MOV, 4, 6);
+	prog[n++] = ALU_K(BPF_ADD, 4, 34);
+	prog[n++] = JMP_X(BPF_JGT, 4, 3, TO_PASS);
+	prog[n++] = LDX(BPF_H, 4, 6, 12);
+	prog[n++] = JMP_K(BPF_JNE, 4, htons(0x0800), TO_PASS);
+	/* no ports in later fragments */
+	prog[n++] = LDX(BPF_H, 4, 6, 20);
+	prog[n++] = ALU_K(BPF_AND, 4, htons(0x1fff));
+	prog[n++] = JMP_K(BPF_JNE, 4, 0, TO_PASS);
+	/* r5 = IP header length, r7 = protocol, r8 = source address */
+	prog[n++] = LDX(BPF_B, 5, 6, 14);
+	prog[n++] = ALU_K(BPF_AND, 5, 0x0f);
+	prog[n++] = ALU_K(BPF_LSH, 5, 2);
+	prog[n++] = JMP_K(BPF_JLT, 5, 20, TO_PASS);
+	prog[n++] = LDX(BPF_B, 7, 6, 23);
+	prog[n++] = LDX(BPF_W, 8, 6, 26);
+	/* r9 = destination port, the same place for TCP and UDP */
+	prog[n++] = ALU_X(BPF_ADD, 6, 5);
+	prog[n++] = ALU_X(BPF_MOV, 4, 6);
+	prog[n++] = ALU_K(BPF_ADD, 4, 18);
+	prog[n++] = JMP_X(BPF_JGT, 4, 3, TO_PASS);
+	prog[n++] = LDX(BPF_H, 9, 6, 16);
+
+	/* port_key_t at fp-8: pass if the port is not protected */
+	prog[n++] = ST(BPF_W, 10, -8, 0);
+	prog[n++] = STX(BPF_H, 10, 9, -8);
+	prog[n++] = STX(BPF_B, 10, 7, -6);
+	n += ld_map(&prog[n], 1, protected_fd);
+	prog[n++] = ALU_X(BPF_MOV, 2, 10);
+	prog[n++] = ALU_K(BPF_ADD, 2, -8);
+	prog[n++] = CALL(BPF_FUNC_map_lookup_elem);
+	prog[n++] = JMP_K(BPF_JEQ, 0, 0, TO_PASS);
+
+	/* grant_key_t at fp-16: drop unless granted and not expired */
+	prog[n++] = STX(BPF_W, 10, 8, -16);
+	prog[n++] = LDX(BPF_W, 4, 10, -8);
+	prog[n++] = STX(BPF_W, 10, 4, -12);
+	n += ld_map(&prog[n], 1, granted_fd);
+	prog[n++] = ALU_X(BPF_MOV, 2, 10);
+	prog[n++] = ALU_K(BPF_ADD, 2, -16);
+	prog[n++] = CALL(BPF_FUNC_map_lookup_elem);
+	prog[n++] = JMP_K(BPF_JEQ, 0, 0, TO_DROP);
+	prog[n++] = LDX(BPF_DW, 6, 0, 0);
+	prog[n++] = JMP_K(BPF_JEQ, 6, 0, TO_PASS);
+	prog[n++] = CALL(BPF_FUNC_ktime_get_ns);
+	prog[n++] = JMP_X(BPF_JGT, 6, 0, TO_PASS);
+
+	drop = n;
+	prog[n++] = ALU_K(BPF_MOV, 0, XDP_DROP);
+	prog[n++] = EXIT();
+	pass = n;
+	prog[n++] = ALU_K(BPF_MOV, 0, XDP_PASS);
+	prog[n++] = EXIT();
+
+	for(i = 0; i < n; i++) {
+		if(BPF_CLASS(prog[i].code) == BPF_JMP && prog[i].off == TO_PASS) {
+			prog[i].off = pass - i - 1;
+		} else if(BPF_CLASS(prog[i].code) == BPF_JMP && prog[i].off == TO_DROP) {
+			prog[i].off = drop - i - 1;
+		}
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(unsigned long)prog;
+	attr.insn_cnt = n;
+	attr.license = (uint64_t)(unsigned long)"GPL";
+	attr.log_buf = (uint64_t)(unsigned long)log;
+	attr.log_size = logsize;
+	attr.log_level = 1;
+	log[0] = '\0';
+	return(sys_bpf(BPF_PROG_LOAD, &attr));
+}
+#endif
+
+/* Load the gate and attach it to iface (in the calling thread's network
+ * namespace). size is the number of grants it can hold. Returns NULL on
+ * error, with the reason in err.
+ */
+xdpgate_t* xdpgate_attach(const char *iface, unsigned int size, char *err, size_t errsize)
+{
+#ifdef HAVE_LINUX_BPF_H
+	xdpgate_t *gate;
+	union bpf_attr attr;
+	unsigned int ifindex;
+	char *log;
+
+	if((ifindex = if_nametoindex(iface)) == 0) {
+		snprintf(err, errsize, "%s: %s", iface, strerror(errno));
+		return(NULL);
+	}
+	if((gate = malloc(sizeof(xdpgate_t))) == NULL || (log = malloc(65536)) == NULL) {
+		free(gate);
+		snprintf(err, errsize, "%s", strerror(ENOMEM));
+		return(NULL);
+	}
+	gate->protected_fd = map_create(BPF_MAP_TYPE_HASH, sizeof(port_key_t), sizeof(uint32_t), PROTECTED_MAX);
+	gate->granted_fd = map_create(BPF_MAP_TYPE_HASH, sizeof(grant_key_t), sizeof(uint64_t), size ? size : 1);
+	gate->prog_fd = gate->link_fd = -1;
+	if(gate->protected_fd < 0 || gate->granted_fd < 0) {
+		snprintf(err, errsize, "cannot create maps: %s", strerror(errno));
+	} else if((gate->prog_fd = load_prog(gate->protected_fd, gate->granted_fd, log, 65536)) < 0) {
+		snprintf(err, errsize, "cannot load program: %s%s%s", strerror(errno), log[0] ? "\n" : "", log);
+	} else {
+		memset(&attr, 0, sizeof(attr));
+		attr.link_create.prog_fd = gate->prog_fd;
+		attr.link_create.target_ifindex = ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		if((gate->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+			snprintf(err, errsize, "cannot attach to %s: %s", iface, strerror(errno));
+		}
+	}
+	free(log);
+	if(gate->link_fd < 0) {
+		xdpgate_detach(gate);
+		return(NULL);
+	}
+	return(gate);
+#else
+	snprintf(err, errsize, "XDP is not supported on this system");
+	return(NULL);
+#endif
+}
+
+void xdpgate_detach(xdpgate_t *gate)
+{
+#ifdef HAVE_LINUX_BPF_H
+	if(gate == NULL) {
+		return;
+	}
+	if(gate->link_fd >= 0) {
+		close(gate->link_fd);
+	}
+	if(gate->prog_fd >= 0) {
+		close(gate->prog_fd);
+	}
+	if(gate->protected_fd >= 0) {
+		close(gate->protected_fd);
+	}
+	if(gate->granted_fd >= 0) {
+		close(gate->granted_fd);
+	}
+	free(gate);
+#endif
+}
+
+/* Make the given ports (host byte order, with IPPROTO_TCP or IPPROTO_UDP)
+ * the protected ones. New ports are added before old ones are dropped, so a
+ * port protected before and after is never open. Returns non-zero (with
+ * errno set) on error.
+ */
+int xdpgate_protect(xdpgate_t *gate, const unsigned short *ports, const unsigned short *protos, unsigned int count)
+{
+#ifdef HAVE_LINUX_BPF_H
+	port_key_t key, next, *keys;
+	uint32_t one = 1;
+	unsigned int i, n = 0;
+	int found, more;
+
+	if((keys = calloc(count ? count : 1, sizeof(port_key_t))) == NULL) {
+		return(1);
+	}
+	for(i = 0; i < count; i++) {
+		keys[i].port = htons(ports[i]);
+		keys[i].proto = protos[i];
+		if(map_update(gate->protected_fd, &keys[i], &one)) {
+			free(keys);
+			return(1);
+		}
+	}
+
+	/* restart the walk after every delete, the map is small */
+	do {
+		more = 0;
+		for(found = map_next_key(gate->protected_fd, NULL, &next) == 0; found;
+				found = map_next_key(gate->protected_fd, &key, &next) == 0) {
+			key = next;
+			for(n = 0; n < count && memcmp(&keys[n], &key, sizeof(key)); n++);
+			if(n == count) {
+				map_delete(gate->protected_fd, &key);
+				more = 1;
+				break;
+			}
+		}
+	} while(more);
+	free(keys);
+	return(0);
+#else
+	errno = ENOSYS;
+	return(1);
+#endif
+}
+
+/* Let addr (host byte order) through to port for timeout seconds (0 = until
+ * revoked). Returns non-zero (with errno set) on error, eg, if the table is
+ * full.
+ */
+int xdpgate_grant(xdpgate_t *gate, uint32_t addr, unsigned short port, unsigned short proto, unsigned int timeout)
+{
+#ifdef HAVE_LINUX_BPF_H
+	grant_key_t key;
+	struct timespec ts;
+	uint64_t expiry = 0;
+
+	memset(&key, 0, sizeof(key));
+	key.addr = htonl(addr);
+	key.port.port = htons(port);
+	key.port.proto = proto;
+	if(timeout) {
+		/* bpf_ktime_get_ns() is CLOCK_MONOTONIC */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		expiry = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + (uint64_t)timeout * 1000000000ULL;
+	}
+	return(map_update(gate->granted_fd, &key, &expiry) != 0);
+#else
+	errno = ENOSYS;
+	return(1);
+#endif
+}
+
+void xdpgate_revoke(xdpgate_t *gate, uint32_t addr, unsigned short port, unsigned short proto)
+{
+#ifdef HAVE_LINUX_BPF_H
+	grant_key_t key;
+
+	memset(&key, 0, sizeof(key));
+	key.addr = htonl(addr);
+	key.port.port = htons(port);
+	key.port.proto = proto;
+	map_delete(gate->granted_fd, &key);
+#endif
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,43 @@
+/*
+ *  xdpgate.h
+ *
+ *  Copyright (c) 2004-2016 by Judd Vinet <jvinet@zeroflux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PAC_XDPGATE_H
+#define _PAC_XDPGATE_H
+
+#include <stdint.h>
+
+/* An XDP program on an interface that drops IPv4 TCP and UDP packets to
+ * protected ports unless the (source, port, protocol) triple has been
+ * granted. Grants carry an expiry the program checks itself, so access
+ * ends on time even if nobody revokes it. Everything is built with the
+ * bare bpf() syscall, no libbpf; the gate is detached when it is freed
+ * or knockd exits.
+ */
+typedef struct xdpgate xdpgate_t;
+
+xdpgate_t* xdpgate_attach(const char *iface, unsigned int size, char *err, size_t errsize);
+void xdpgate_detach(xdpgate_t *gate);
+int xdpgate_protect(xdpgate_t *gate, const unsigned short *ports, const unsigned short *protos, unsigned int count);
+int xdpgate_grant(xdpgate_t *gate, uint32_t addr, unsigned short port, unsigned short proto, unsigned int timeout);
+void xdpgate_revoke(xdpgate_t *gate, uint32_t addr, unsigned short port, unsigned short proto);
+
+#endif
+
+/* vim: set ts=2 sw=2 noet: */